@@ -0,0 +1,312 @@
+#define EDITOR_NO_MAIN
+#include "../main.c"
+
+#include <sys/stat.h>
+
+/* ------ Macros and definitions ------ */
+
+// every measurement is the best of this many runs
+#define BENCH_RUNS 3
+
+#define BENCH_SCREEN_ROWS 48
+#define BENCH_SCREEN_COLS 160
+
+// the line pasted by the bulk insert, without its null byte
+#define PASTE_LINE "pasted line with\tsome contents;\n"
+#define PASTE_LINE_LEN (sizeof(PASTE_LINE) - 1)
+
+/* ------ Types ------ */
+
+/*
+ * A synthetic file the benchmarks run on. The generator writes
+ * the file line by line until it reaches the given size.
+ */
+typedef struct bench_corpus {
+  char *name;
+  size_t size;
+  void (*generate)(FILE *f, size_t size);
+} bench_corpus;
+
+/* ------ Function declarations ------ */
+
+/* --- corpora --- */
+
+/*
+ * Writes many short ASCII lines.
+ */
+void generate_short_lines(FILE *f, size_t size);
+
+/*
+ * Writes a handful of huge single lines.
+ */
+void generate_huge_lines(FILE *f, size_t size);
+
+/*
+ * Writes tab indented C-like code.
+ */
+void generate_tab_code(FILE *f, size_t size);
+
+/*
+ * Writes log lines mixing ASCII with multi-byte and wide UTF-8.
+ */
+void generate_utf8_log(FILE *f, size_t size);
+
+/* --- measuring --- */
+
+/*
+ * Returns the current monotonic time in seconds.
+ */
+double now();
+
+/*
+ * Prints one result as a JSON object into the results file.
+ * It will receive the corpus name, the operation name, the best time
+ * in seconds and the number of bytes the operation went through.
+ */
+void report(char *corpus, char *op, double seconds, size_t bytes);
+
+/*
+ * Runs every benchmark on the given corpus file.
+ */
+void bench_corpus_file(bench_corpus *c, char *path);
+
+/* ------ Globals ------ */
+
+FILE *results;
+int first_result = 1;
+unsigned int seed = 1;
+
+bench_corpus corpora[] = {
+    {"short_lines", 32 << 20, generate_short_lines},
+    {"huge_lines", 32 << 20, generate_huge_lines},
+    {"tab_code", 32 << 20, generate_tab_code},
+    {"utf8_log", 32 << 20, generate_utf8_log},
+};
+
+/* --- Main function --- */
+
+int main(int argc, char *argv[]) {
+  char *out = argc >= 2 ? argv[1] : "bench_results.json";
+  char dir[] = "/tmp/text-editor-bench-XXXXXX";
+
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  results = fopen(out, "w");
+  if (results == NULL) {
+    perror(out);
+    return 1;
+  }
+
+  // refresh_screen writes the frames into the standard input
+  int null = open("/dev/null", O_RDWR);
+  dup2(null, STDIN_FILENO);
+  close(null);
+
+  config.headless = 1;
+  init();
+  config.headless = 0;
+  config.rows = BENCH_SCREEN_ROWS;
+  config.cols = BENCH_SCREEN_COLS;
+
+  fprintf(results, "{\n  \"runs\": %d,\n  \"results\": [\n", BENCH_RUNS);
+
+  for (size_t i = 0; i < sizeof(corpora) / sizeof(corpora[0]); i++) {
+    char path[128];
+    snprintf(path, sizeof(path), "%s/%s.c", dir, corpora[i].name);
+
+    FILE *f = fopen(path, "w");
+    corpora[i].generate(f, corpora[i].size);
+    fclose(f);
+
+    fprintf(stderr, "%s...\n", corpora[i].name);
+    bench_corpus_file(&corpora[i], path);
+    unlink(path);
+  }
+
+  fprintf(results, "\n  ]\n}\n");
+  fclose(results);
+  rmdir(dir);
+
+  fprintf(stderr, "results written to %s\n", out);
+  return 0;
+}
+
+/* ------ Function definitions ------ */
+
+void generate_short_lines(FILE *f, size_t size) {
+  size_t written = 0;
+
+  for (int i = 0; written < size; i++) {
+    written += fprintf(f, "line %d of the corpus, value = %u;\n", i,
+                       rand_r(&seed) % 100000);
+  }
+}
+
+void generate_huge_lines(FILE *f, size_t size) {
+  size_t line = size / 4;
+
+  for (int i = 0; i < 4; i++) {
+    for (size_t j = 0; j < line; j += 32) {
+      fputs(j % 320 ? "int foo = bar(baz, 42); /* x */ " :
+                      "\"a string\" 3.14 while return \t",
+            f);
+    }
+    fputc('\n', f);
+  }
+}
+
+void generate_tab_code(FILE *f, size_t size) {
+  size_t written = 0;
+
+  for (int i = 0; written < size; i++) {
+    int depth = rand_r(&seed) % 6;
+
+    for (int d = 0; d < depth; d++) {
+      fputc('\t', f);
+    }
+
+    written += depth;
+    written += fprintf(f, "if (value_%d > %d) {\treturn \"%d\";\t// note\n",
+                       i, i % 97, i);
+  }
+}
+
+void generate_utf8_log(FILE *f, size_t size) {
+  const char *words[] = {"request", "héllo", "naïve", "日本語", "ok",
+                         "😀",      "Ωmega", "status", "données", "中文"};
+  size_t written = 0;
+
+  for (int i = 0; written < size; i++) {
+    written += fprintf(f, "2024-01-01T00:00:%02d [%d]", i % 60, i);
+
+    for (int w = 0; w < 6; w++) {
+      written += fprintf(f, " %s", words[rand_r(&seed) % 10]);
+    }
+
+    fputc('\n', f);
+    written++;
+  }
+}
+
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void report(char *corpus, char *op, double seconds, size_t bytes) {
+  fprintf(results,
+          "%s    {\"corpus\": \"%s\", \"op\": \"%s\", \"seconds\": %.6f, "
+          "\"bytes\": %zu, \"mb_per_s\": %.2f}",
+          first_result ? "" : ",\n", corpus, op, seconds, bytes,
+          seconds > 0 ? bytes / seconds / 1e6 : 0);
+  fflush(results);
+  first_result = 0;
+}
+
+void bench_corpus_file(bench_corpus *c, char *path) {
+  struct stat st;
+  stat(path, &st);
+  size_t size = st.st_size;
+
+  double best_open = 1e9;
+  double best_search = 1e9;
+  double best_to_str = 1e9;
+  double best_save = 1e9;
+  double best_insert = 1e9;
+  double best_full_frame = 1e9;
+  double best_scroll_frame = 1e9;
+  char save_path[160];
+  snprintf(save_path, sizeof(save_path), "%s.out", path);
+
+  for (int run = 0; run < BENCH_RUNS; run++) {
+    double t = now();
+    editor_open(path);
+    t = now() - t;
+    if (t < best_open)
+      best_open = t;
+
+    t = now();
+    search_pattern("return", 6);
+    t = now() - t;
+    if (t < best_search)
+      best_search = t;
+
+    size_t len;
+    t = now();
+    char *buf = erows_to_str(&len);
+    t = now() - t;
+    free(buf);
+    if (t < best_to_str)
+      best_to_str = t;
+
+    t = now();
+    write_file(save_path);
+    t = now() - t;
+    if (t < best_save)
+      best_save = t;
+
+    // full repaints at evenly spaced positions of the file
+    int frames = 200;
+    t = now();
+    for (int i = 0; i < frames; i++) {
+      config.cy = (long long)config.numrows * i / frames;
+      config.cx = 0;
+      config.screen_dirty = 1;
+      refresh_screen();
+    }
+    t = (now() - t) / frames;
+    if (t < best_full_frame)
+      best_full_frame = t;
+
+    // one line scrolls, which only draw the exposed line
+    config.cy = 0;
+    config.rowoff = 0;
+    refresh_screen();
+    frames = config.numrows < 2000 ? config.numrows : 2000;
+    t = now();
+    for (int i = 0; i < frames; i++) {
+      config.cy++;
+      refresh_screen();
+    }
+    t = frames > 0 ? (now() - t) / frames : 0;
+    if (t < best_scroll_frame)
+      best_scroll_frame = t;
+
+    // a 10000 line paste in the middle of the file, then 10000 keystrokes
+    char *paste = malloc(10000 * PASTE_LINE_LEN);
+    for (int i = 0; i < 10000; i++) {
+      memcpy(&paste[i * PASTE_LINE_LEN], PASTE_LINE, PASTE_LINE_LEN);
+    }
+
+    undo_begin_action();
+    config.cy = config.numrows / 2;
+    config.cx = 0;
+    t = now();
+    insert_text(paste, 10000 * PASTE_LINE_LEN - 1);
+    for (int i = 0; i < 10000; i++) {
+      undo_begin_action();
+      insert_char('a' + i % 26);
+    }
+    t = now() - t;
+    free(paste);
+    if (t < best_insert)
+      best_insert = t;
+
+    editor_close();
+    journal_close(1);
+  }
+
+  unlink(save_path);
+
+  report(c->name, "editor_open", best_open, size);
+  report(c->name, "search", best_search, size);
+  report(c->name, "erows_to_str", best_to_str, size);
+  report(c->name, "save", best_save, size);
+  report(c->name, "bulk_insert", best_insert, 10000 * PASTE_LINE_LEN + 10000);
+  report(c->name, "full_frame", best_full_frame, 0);
+  report(c->name, "scroll_frame", best_scroll_frame, 0);
+}
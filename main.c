@@ -4,16 +4,30 @@
 
 #include <asm-generic/ioctls.h>
 #include <ctype.h>
+#include <dirent.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
 /* ------ Macros and definitions ------ */
 
@@ -21,18 +35,789 @@
 
 #define VERSION "0.0.1"
 
-#define TAB_STOP 4
+#define DEFAULT_TAB_STOP 4
 
 #define FORCE_QUIT_TIMES 2
 
+// the most arguments a command line is split into
+#define COMMAND_MAX_ARGS 8
+
+// the default memory cap of the undo history in bytes
+#define UNDO_LIMIT (64 * 1024 * 1024)
+
+// size of the fixed part of an undo record and of its trailing length
+#define UNDO_HEADER_SIZE 14
+#define UNDO_TRAILER_SIZE 4
+
+// the journal buffer is written once it holds this many bytes,
+// otherwise it is written when the editor is idle
+#define JOURNAL_BATCH_SIZE 4096
+
+// the minimum number of seconds between two syncs of the journal
+#define JOURNAL_SYNC_INTERVAL 2
+
+#define JOURNAL_MAGIC "TEJ1"
+
+// rows longer than twice the segment size are rendered in segments
+#define SEGMENT_SIZE 4096
+
+// row bytes are carved out of chunks of this size
+#define ARENA_CHUNK_SHIFT 20
+#define ARENA_CHUNK_SIZE (1 << ARENA_CHUNK_SHIFT)
+
+// blocks are addressed by 32-bit offsets counted in 4-byte units, whose
+// high bits are the chunk index and low bits the unit inside the chunk
+#define ARENA_UNIT_SHIFT 2
+#define ARENA_UNIT_BITS (ARENA_CHUNK_SHIFT - ARENA_UNIT_SHIFT)
+#define ARENA_MAX_CHUNKS (1 << (32 - ARENA_UNIT_BITS))
+
+// the end of a free list
+#define ARENA_NONE UINT32_MAX
+
+// blocks up to the largest size class come from per-class slabs,
+// bigger blocks are allocated on their own
+#define ARENA_MAX_CLASS 4096
+#define ARENA_CLASSES 32
+
+// a slab holds this many blocks of its size class
+#define ARENA_SLAB_BLOCKS 32
+
+// large blocks start with their capacity
+#define ARENA_LARGE_HEADER 8
+
+// rows up to this many bytes are stored inside the row itself
+#define ROW_INLINE_SIZE 11
+
+// an interned line starts with its reference count, its hash and its size
+#define INTERN_HEADER 12
+
+// cold rows are compressed together into blocks of up to this many bytes,
+// and rows longer than a quarter of a block are never compressed
+#define COLD_BLOCK_SIZE (64 << 10)
+#define COLD_ROW_MAX (COLD_BLOCK_SIZE / 4)
+
+// the number of decompressed blocks kept around
+#define COLD_CACHE_BLOCKS 8
+
+// the rows this close to the screen are never compressed
+#define COLD_MARGIN 256
+
+// the uncompressed row bytes allowed before cold rows are compressed
+#define COLD_BUDGET (256 << 20)
+
+// the compressor finds matches of at least LZ_MIN_MATCH bytes through
+// a hash table of 1 << LZ_HASH_BITS positions, up to 64K bytes back
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 0xffff
+
+// the decompressor copies in words of up to this many bytes, so its
+// input and output are allocated with that much room after their end
+#define LZ_WILD 16
+
+// every thread of a parallel sort gets at least this many rows,
+// and at most SORT_MAX_THREADS threads are started
+#define SORT_MIN_ROWS 16384
+#define SORT_MAX_THREADS 16
+
+// runs shorter than this are sorted by insertion
+#define SORT_INSERTION_RUN 16
+
+// the byte offset index holds one sum per block of this many rows
+#define OFFSET_BLOCK_ROWS 64
+
+// the rows scanned for the grep view on every idle tick
+#define FILTER_SCAN_ROWS (1 << 18)
+
+// a file with a null byte in its first BINARY_PROBE bytes is binary
+#define BINARY_PROBE 8000
+
+// the project grep searches the files on up to this many threads,
+// maps the files bigger than GREP_MMAP_MIN and reads the others, and
+// cuts the lines it shows after GREP_LINE_MAX bytes
+#define GREP_MAX_THREADS 16
+#define GREP_MMAP_MIN (64 << 10)
+#define GREP_LINE_MAX 512
+
+// the bytes shown on a line of the hex view
+#define HEX_LINE_BYTES 16
+
+// column mode samples the widths of the columns from this many rows,
+// the first COLUMN_SAMPLE_HEAD of them and others spread over the file,
+// caps them at COLUMN_MAX_WIDTH and puts COLUMN_GAP spaces between them
+#define COLUMN_SAMPLE_ROWS 1024
+#define COLUMN_SAMPLE_HEAD 256
+#define COLUMN_MAX_WIDTH 40
+#define COLUMN_GAP 2
+
+// the width of the columns after the sampled ones
+#define COLUMN_DEFAULT_WIDTH 12
+
+// the field index is kept for this many rows, in the slot row % slots
+#define COLUMN_CACHE_SLOTS 1024
+
+// once more rows than this have a render cache, the caches of
+// the rows out of the screen are dropped
+#define RENDER_CACHE_LIMIT 4096
+
+// follow mode reads the bytes appended to the file this many at a time
+#define FOLLOW_READ_SIZE (64 << 10)
+
+// gzip files are decompressed and compressed this many bytes at a time
+#define GZIP_BUFFER_SIZE (256 << 10)
+
+// saved files are written this many bytes at a time
+#define SAVE_BUFFER_SIZE (256 << 10)
+
+// the number of events and frames the latency trace keeps
+#define TRACE_EVENTS (1 << 16)
+#define TRACE_FRAMES (1 << 12)
+
+// how many of the latest events the percentile overlay looks at
+#define TRACE_WINDOW 4096
+
+// every allocation is counted for the per-frame statistics of the trace,
+// the wrappers call the real functions with their names in parentheses,
+// as the threads do since the counters aren't shared
+#define malloc(size) trace_malloc(size)
+#define realloc(ptr, size) trace_realloc(ptr, size)
+#define calloc(count, size) trace_calloc(count, size)
+#define strdup(s) trace_strdup(s)
+#define strndup(s, n) trace_strndup(s, n)
+
+#define HL_HIGHLIGHT_NUMBERS (1 << 0)
+#define HL_HIGHLIGHT_STRINGS (1 << 1)
+
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+
 /* ------ Types ------ */
 
+enum editor_highlight {
+  HL_NORMAL = 0,
+  HL_COMMENT,
+  HL_MLCOMMENT,
+  HL_KEYWORD1,
+  HL_KEYWORD2,
+  HL_STRING,
+  HL_NUMBER
+};
+
+/*
+ * The lexer state carried from the end of one row into the next one.
+ * A string state means the row ended with a backslash inside a string.
+ * The segments of a long row can also start inside a single line
+ * comment or right after a backslash in a string, and after the first
+ * bytes of a comment delimiter, whose count is kept above HL_STATE_SKIP.
+ */
+enum highlight_state {
+  HL_STATE_NONE = -1,
+  HL_STATE_NORMAL = 0,
+  HL_STATE_MLCOMMENT,
+  HL_STATE_DQ_STRING,
+  HL_STATE_SQ_STRING,
+  HL_STATE_COMMENT,
+  HL_STATE_DQ_ESCAPE,
+  HL_STATE_SQ_ESCAPE
+};
+
+// the bytes of a delimiter left for the next segment are state >> HL_STATE_SKIP
+#define HL_STATE_SKIP 8
+
+typedef struct editor_syntax {
+  char *filetype;
+  char **filematch;
+  char **keywords;
+  char *singleline_comment_start;
+  char *multiline_comment_start;
+  char *multiline_comment_end;
+  int flags;
+} editor_syntax;
+
+/*
+ * A character of a row whose byte length differs from its display
+ * width, such as a tab or a multi-byte UTF-8 character.
+ * It holds the index and the byte length of the character in chars,
+ * and the render index and the render column right after it.
+ */
+typedef struct cell_entry {
+  int cx;
+  int len;
+  int rbyte;
+  int rx;
+} cell_entry;
+
+enum row_flags {
+  ROW_PACKED = 1 << 0,
+  ROW_TAB_FREE = 1 << 1,
+  ROW_ASCII = 1 << 2,
+  ROW_HAS_RENDER = 1 << 3,
+  ROW_INTERNED = 1 << 4,
+  ROW_COLD = 1 << 5,
+  ROW_WARM = 1 << 6
+};
+
+/*
+ * A row of the document, packed into 24 bytes without pointers.
+ * Rows of up to ROW_INLINE_SIZE bytes keep their bytes in data,
+ * longer ones in the row arena at the offset off: rows longer than
+ * the largest size class in a large block, packed rows (loaded from
+ * a file) in a block of their size rounded up to the arena unit, and
+ * the others in a block of their size class. The capacity of the block
+ * is thus known from the size and the flags. Interned rows point at
+ * a line shared with the identical rows instead, and cold rows at their
+ * bytes in the compressed block off, pos bytes in. Rows which have been
+ * edited or drawn since the last cold sweep are warm. Tab-free and ASCII
+ * rows display one column per byte, and rows which have been drawn keep
+ * their render in the render cache slot given by cache.
+ */
 typedef struct erow {
   int size;
-  int rsize;
+  uint16_t flags;
+  int8_t hl_start;
+  int8_t hl_open;
+  uint32_t cache;
+  union {
+    char data[ROW_INLINE_SIZE + 1];
+    struct {
+      uint32_t off;
+      uint32_t pos;
+    };
+  };
+} erow;
+
+/*
+ * The rendered form of a row, or of a segment of a long row: the render
+ * string with tabs expanded, the cells, the highlight and the segments.
+ * chars points at the row bytes it has been rendered from, and the phase
+ * is the start column modulo the tab width. The render string is a block
+ * of the row arena at roff with the capacity rcap.
+ */
+typedef struct row_render {
+  int size;
   char *chars;
+  int rsize;
+  int rcap;
+  uint32_t roff;
+  int width;
+  int phase;
   char *render;
-} erow;
+  cell_entry *cells;
+  int ncells;
+  unsigned char *hl;
+  int hl_start;
+  int hl_open;
+  struct erow_segment *segs;
+  int nsegs;
+} row_render;
+
+/*
+ * A fixed-size piece of a very long row. It holds its start index in
+ * the chars of the row and its start column, and the render of the piece,
+ * whose chars point into the row.
+ */
+typedef struct erow_segment {
+  int cx;
+  int rx;
+  row_render r;
+} erow_segment;
+
+/*
+ * A slot of the interned lines table: the arena offset of the line,
+ * or ARENA_NONE, and its hash, so probing doesn't read the lines.
+ */
+typedef struct intern_slot {
+  uint32_t line;
+  uint32_t hash;
+} intern_slot;
+
+/*
+ * The open addressing hash table of the interned lines.
+ * The capacity is a power of two.
+ */
+struct intern_table {
+  intern_slot *slots;
+  int cap;
+  int count;
+};
+
+/*
+ * A block of cold rows, compressed into data. size is the size of the
+ * decompressed block, and live the bytes of the refs rows which still
+ * point into it. slot is the decompressed cache slot holding it, or -1.
+ */
+typedef struct cold_block {
+  char *data;
+  uint32_t csize;
+  uint32_t size;
+  uint32_t live;
+  uint32_t refs;
+  int slot;
+} cold_block;
+
+/*
+ * The compressed store of the cold rows. Block ids are reused through
+ * the free list. Rows are gathered uncompressed in buf for the block
+ * being built, and the last decompressed blocks are kept in the cache.
+ * hot is the uncompressed row bytes, and a sweep compresses the cold
+ * rows once it goes over limit, which follows the budget. The counters
+ * tell how often reading a cold row found its block decompressed.
+ */
+struct cold_store {
+  cold_block *blocks;
+  int nblocks;
+  int cap;
+  int *free;
+  int nfree;
+  int building;
+  char *buf;
+  uint32_t buf_len;
+  char *zbuf;
+  char *cache[COLD_CACHE_BLOCKS];
+  int cache_block[COLD_CACHE_BLOCKS];
+  uint64_t cache_used[COLD_CACHE_BLOCKS];
+  uint64_t tick;
+  size_t budget;
+  size_t limit;
+  size_t hot;
+  size_t compressed;
+  uint64_t hits;
+  uint64_t misses;
+};
+
+/*
+ * The render caches of the rows which have been drawn. Slots are
+ * reused through the free list, and live counts the slots in use.
+ */
+struct render_cache {
+  row_render **slots;
+  int nslots;
+  int cap;
+  int *free;
+  int nfree;
+  int live;
+};
+
+/*
+ * Binary indexed tree holding prefix sums over per-row values.
+ */
+typedef struct fenwick {
+  long long *tree;
+  int size;
+  int cap;
+} fenwick;
+
+/*
+ * The allocator of the row bytes. Memory is taken from the heap in large
+ * chunks which are only given back when the document is closed, so
+ * closing a file frees a handful of chunks instead of every row.
+ * Blocks up to the largest size class are cut from per-class slabs and
+ * go back to a per-class free list, and rows loaded from a file are
+ * packed back to back with a bump pointer. Bigger blocks are allocated
+ * on their own and addressed by their index in the large table.
+ */
+struct row_arena {
+  char **chunks;
+  int nchunks;
+  int chunkcap;
+  size_t used;
+  uint32_t slab[ARENA_CLASSES];
+  uint32_t slab_left[ARENA_CLASSES];
+  uint32_t free_list[ARENA_CLASSES];
+  char **large;
+  int nlarge;
+  int largecap;
+  uint32_t *free_large;
+  int nfree_large;
+  size_t reserved;
+};
+
+enum undo_type {
+  UNDO_INS_TEXT = 1,
+  UNDO_DEL_TEXT,
+  UNDO_INS_ROWS,
+  UNDO_DEL_ROWS,
+  UNDO_PERM_ROWS
+};
+
+// the record belongs to the same action as the record before it
+#define UNDO_CHAIN (1 << 0)
+
+/*
+ * The undo history is a byte log of packed records. Each record is
+ * a type byte, a flags byte, then the row, the column and the length
+ * as 32-bit values, followed by the payload and the total size of the
+ * record, so the log can be walked backwards. Text records carry the
+ * inserted or deleted bytes (len is the byte count), row records carry
+ * a pointer to the rows they hold while those rows are out of the
+ * document (len is the row count, and the column of deleted rows is
+ * the capacity of their array), so bulk row operations never copy
+ * the line bytes. Permutation records carry one 32-bit index per row
+ * of the range: row i of the range came from row perm[i] before the
+ * edit (len is the row count). Records before len can be undone, and the ones
+ * between len and end can be redone.
+ */
+struct undo_history {
+  unsigned char *log;
+  size_t len;
+  size_t end;
+  size_t cap;
+  size_t ref_bytes;
+  size_t limit;
+  int action;
+  int last_action;
+  int sealed;
+  int paused;
+};
+
+enum journal_type {
+  JOURNAL_INS_TEXT = 1,
+  JOURNAL_DEL_TEXT,
+  JOURNAL_INS_ROW,
+  JOURNAL_DEL_ROWS,
+  JOURNAL_PERM_ROWS
+};
+
+/*
+ * The crash-recovery journal of the open file. It starts with a header
+ * holding the size and the modification time of the file it applies to,
+ * followed by one record per edit: the type, the row, the column and
+ * the length as variable-length integers, and the inserted bytes for
+ * insertions. Records are collected in buf and written in batches,
+ * and the file is synced at most once per sync interval.
+ * While following a file, the header is followed by a record deleting
+ * the rows of the file past the first base_rows, the ones the edits
+ * don't apply to, and base is where the records of the edits start.
+ */
+struct journal {
+  int fd;
+  char *path;
+  char *buf;
+  size_t len;
+  size_t cap;
+  time_t last_sync;
+  int unsynced;
+  int paused;
+  size_t base;
+  int base_rows;
+};
+
+enum trace_probe {
+  PROBE_INPUT = 0,
+  PROBE_KEY,
+  PROBE_EDIT,
+  PROBE_RENDER_ROW,
+  PROBE_DRAW_ROWS,
+  PROBE_WRITE,
+  PROBE_FRAME,
+  PROBE_COUNT
+};
+
+/*
+ * A timed span of one of the probes, in nanoseconds.
+ */
+typedef struct trace_event {
+  uint64_t start;
+  uint32_t dur;
+  uint32_t probe;
+} trace_event;
+
+/*
+ * The allocations made since the previous frame and the bytes
+ * the frame has written to the terminal.
+ */
+typedef struct trace_frame {
+  uint64_t start;
+  uint32_t allocs;
+  uint32_t alloc_bytes;
+  uint32_t written;
+} trace_frame;
+
+/*
+ * The latency trace. Events and frames are kept in fixed-size rings,
+ * so recording is a clock read and a store, and the oldest entries are
+ * overwritten. The counters are the numbers of entries ever recorded.
+ */
+struct trace {
+  trace_event *events;
+  uint64_t nevents;
+  trace_frame *frames;
+  uint64_t nframes;
+  uint32_t allocs;
+  uint32_t alloc_bytes;
+  uint64_t input_start;
+  int overlay;
+};
+
+enum mem_subsystem {
+  MEM_CHARS = 0,
+  MEM_RENDER,
+  MEM_ROWS,
+  MEM_SEARCH,
+  MEM_UNDO,
+  MEM_JOURNAL,
+  MEM_TRACE,
+  MEM_WRAP,
+  MEM_OFFSETS,
+  MEM_COLUMNS,
+  MEM_FOLDS,
+  MEM_INTERN,
+  MEM_COLD,
+  MEM_ARENA,
+  MEM_COUNT
+};
+
+/*
+ * The memory held by a subsystem: the number of allocations,
+ * the bytes the allocator reserved for them, and the bytes
+ * actually in use. The difference is the allocator slack.
+ */
+typedef struct mem_usage {
+  size_t allocs;
+  size_t bytes;
+  size_t used;
+} mem_usage;
+
+/*
+ * The usage of every subsystem, and the heap totals at the same moment.
+ */
+typedef struct mem_report {
+  mem_usage usage[MEM_COUNT];
+  size_t cold_blocks;
+  size_t cold_size;
+  uint64_t cold_hits;
+  uint64_t cold_misses;
+  size_t heap_used;
+  size_t heap_free;
+  size_t heap_mapped;
+} mem_report;
+
+/*
+ * The state of follow mode. The file and its directory are watched
+ * through the inotify instance fd, so rotations are noticed as well.
+ * offset is where the first line which isn't loaded yet starts in the
+ * file with the inode ino, lines the number of lines before it, and buf
+ * holds the bytes read past it.
+ */
+struct follow {
+  int active;
+  int fd;
+  int file_wd;
+  int dir_wd;
+  off_t offset;
+  int lines;
+  ino_t ino;
+  char *buf;
+  size_t cap;
+};
+
+enum sort_flags {
+  SORT_NUMERIC = 1 << 0,
+  SORT_NOCASE = 1 << 1,
+  SORT_UNIQUE = 1 << 2,
+  SORT_REVERSE = 1 << 3
+};
+
+/*
+ * The sort key of a row: its bytes, which stay put while the rows are
+ * sorted, its leading number for numeric sorts and its index in the
+ * range, which keeps the sort stable.
+ */
+typedef struct sort_key {
+  const char *s;
+  int len;
+  uint32_t index;
+  double num;
+} sort_key;
+
+/*
+ * A part of a parallel sort: the keys of src from start to end are
+ * sorted in place when mid is -1, using dst as the scratch space,
+ * otherwise the sorted runs start..mid and mid..end are merged into dst.
+ */
+typedef struct sort_job {
+  sort_key *src;
+  sort_key *dst;
+  int start;
+  int mid;
+  int end;
+  int flags;
+} sort_job;
+
+/*
+ * The grep view, which only shows the rows listed in rows, in order.
+ * The rows before scanned have been searched for the pattern, a chunk
+ * more on every idle tick or when the screen needs more of them. Rows
+ * inserted in the searched part are searched right away, and the row
+ * under the cursor is always shown. wrap remembers the soft wrap mode,
+ * which is off in the view.
+ */
+struct filter {
+  int active;
+  char *pattern;
+  size_t plen;
+  int *rows;
+  int count;
+  int cap;
+  int scanned;
+  int wrap;
+};
+
+/*
+ * A .gitignore pattern. The patterns with a slash before their end
+ * are matched against the path from the directory of the .gitignore,
+ * the others against the name of the entry.
+ */
+typedef struct ignore_pattern {
+  char *glob;
+  int negate;
+  int dir_only;
+  int anchored;
+} ignore_pattern;
+
+/*
+ * The patterns of the .gitignore of a directory, whose path from the
+ * root of the search is base, then the rules of its parent. next links
+ * every rules list of the search, so they are freed with it.
+ */
+typedef struct ignore_rules {
+  struct ignore_rules *parent;
+  struct ignore_rules *next;
+  char *base;
+  ignore_pattern *patterns;
+  int count;
+} ignore_rules;
+
+/*
+ * A directory to read or a file to search for the project grep,
+ * with the ignore rules of the directory holding it.
+ */
+typedef struct grep_task {
+  char *path;
+  int is_dir;
+  ignore_rules *rules;
+} grep_task;
+
+/*
+ * The result lines of a searched file, as path:line:text.
+ */
+typedef struct grep_chunk {
+  struct grep_chunk *next;
+  size_t len;
+  char data[];
+} grep_chunk;
+
+/*
+ * The project grep, whose results are the rows of an unnamed buffer.
+ * The worker threads take the tasks from a stack and push the entries
+ * of the directories they read onto it, busy counting the ones working
+ * on a task, so the search is over once the stack is empty and none is.
+ * The results of every file are queued and appended to the rows while
+ * waiting for input. root_len is the length of the prefix of the paths
+ * which leads to the root, and files and matched count the files
+ * searched and the ones with a match, which are copied into
+ * files_seen and matched_seen when their results are appended.
+ */
+struct project_grep {
+  int active;
+  int done;
+  char *pattern;
+  size_t plen;
+  char *root;
+  size_t root_len;
+  pthread_t threads[GREP_MAX_THREADS];
+  int nthreads;
+  int running;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  grep_task *tasks;
+  int ntasks;
+  int taskcap;
+  int busy;
+  int stop;
+  grep_chunk *head;
+  grep_chunk *tail;
+  ignore_rules *rules;
+  int files;
+  int matched;
+  int files_seen;
+  int matched_seen;
+};
+
+/*
+ * The read-only hex view of a binary file, which is mapped instead of
+ * being loaded into rows. Line y of the view shows HEX_LINE_BYTES bytes
+ * from y * HEX_LINE_BYTES, cy is the line of the cursor and cx its byte
+ * in the line. digits is the width of the offsets, match the offset
+ * of the last search match or -1, and force makes the next file open
+ * in the view (1) or as text (-1).
+ */
+struct hex_view {
+  int active;
+  int force;
+  unsigned char *data;
+  size_t size;
+  int digits;
+  char *pattern;
+  size_t plen;
+  long long match;
+};
+
+/*
+ * The field index of a row in column mode: field i starts at starts[i]
+ * and ends at starts[i + 1] - 1, where its delimiter is, starts[count]
+ * being one past the end of the row. It is valid while row and gen
+ * match the row and the generation of the column mode.
+ */
+typedef struct column_fields {
+  int row;
+  unsigned int gen;
+  int count;
+  int cap;
+  uint32_t *starts;
+} column_fields;
+
+/*
+ * The column mode, which shows the fields separated by delim aligned
+ * in columns, with double quotes around the fields holding delimiters
+ * unless quotes is 0. widths holds the widths of the columns sampled
+ * from some of the rows and pos the screen column where each one
+ * starts, then where the columns after them start. The field indexes
+ * of the rows are built when they are drawn or the cursor is on them,
+ * and gen is bumped when rows are inserted, deleted or moved, which
+ * drops every index. wrap remembers the soft wrap mode, which is off.
+ */
+struct columns {
+  int active;
+  char delim;
+  int quotes;
+  int wrap;
+  int count;
+  int *widths;
+  int *pos;
+  unsigned int gen;
+  column_fields *cache;
+};
+
+/*
+ * A fold: the rows from start to end, excluded, are hidden under
+ * the row before start, which is the header of the fold.
+ */
+typedef struct fold_range {
+  int start;
+  int end;
+} fold_range;
+
+/*
+ * The folds, sorted and disjoint, with hidden[i] the number of rows
+ * hidden by the folds before fold i, so rows and screen lines are
+ * mapped into each other with a binary search over the folds.
+ */
+struct folds {
+  fold_range *ranges;
+  int *hidden;
+  int count;
+  int cap;
+};
 
 typedef struct search_match {
   int cx;
@@ -47,10 +832,12 @@ struct conf {
   int cy;
   int rows;
   int cols;
-  int rowoff;
+  int rowoff; // counts screen lines instead of rows in soft-wrap mode
   int coloff;
   int numrows;
+  int rowcap;
   int modified;
+  int tab_stop;
   erow *editor_rows;
   char *filename;
   char status_msg[160];
@@ -58,11 +845,59 @@ struct conf {
   search_match *search_matches;
   int search_match_found;
   int current_search_idx;
+  editor_syntax *syntax;
+  int hl_frontier;
+  int prev_rowoff;
+  int prev_coloff;
+  int screen_dirty;
+  int wrap;
+  int wrap_dirty;
+  fenwick wrap_index;
+  int offsets_dirty;
+  fenwick offset_index;
+  struct row_arena arena;
+  struct render_cache renders;
+  row_render scratch;
+  int intern;
+  struct intern_table interned;
+  struct cold_store cold;
+  struct undo_history undo;
+  struct journal journal;
+  volatile sig_atomic_t pending_signal;
+  struct follow follow;
+  struct filter filter;
+  struct project_grep project;
+  struct hex_view hex;
+  struct columns columns;
+  struct folds folds;
+  int gzip;
+  struct trace trace;
+  int headless;
+  int mem_stats;
   struct termios orig_termios;
 };
 
 struct conf config;
 
+/* ------ Syntax highlight database ------ */
+
+char *C_HL_extensions[] = {".c", ".h", ".cpp", ".hpp", ".cc", NULL};
+
+// keywords ending with '|' are highlighted as types
+char *C_HL_keywords[] = {
+    "switch",    "if",       "while",   "for",     "break",   "continue",
+    "return",    "else",     "struct",  "union",   "typedef", "static",
+    "enum",      "class",    "case",    "default", "do",      "goto",
+    "sizeof",    "const",    "extern",  "volatile",
+
+    "int|",      "long|",    "double|", "float|",  "char|",   "unsigned|",
+    "signed|",   "void|",    "short|",  "size_t|", "auto|",   NULL};
+
+editor_syntax HLDB[] = {
+    {"c", C_HL_extensions, C_HL_keywords, "//", "/*", "*/",
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+};
+
 enum editor_keys {
   BACKSPACE = 127,
   ARROW_LEFT = 1000,
@@ -73,7 +908,8 @@ enum editor_keys {
   PAGE_DOWN,
   HOME_KEY,
   END_KEY,
-  DEL_KEY
+  DEL_KEY,
+  BACK_TAB
 };
 
 /* ------ Appendable buffer ------ */
@@ -87,6 +923,68 @@ struct ap_buf {
 
 /* ------ Function declarations ------ */
 
+/* --- prefix sums --- */
+
+/*
+ * Resets the tree to the given number of zero values.
+ */
+void fenwick_reset(fenwick *f, int size);
+
+/*
+ * Frees the tree of the fenwick struct.
+ */
+void fenwick_free(fenwick *f);
+
+/*
+ * Adds delta to the value at the given index.
+ */
+void fenwick_add(fenwick *f, int at, long long delta);
+
+/*
+ * Appends a new value after the last one.
+ */
+void fenwick_push(fenwick *f, long long value);
+
+/*
+ * Turns a tree whose (index + 1) slots hold the raw values
+ * into the prefix-sum form in linear time.
+ */
+void fenwick_build(fenwick *f);
+
+/*
+ * Returns the sum of the values before the given index.
+ */
+long long fenwick_prefix(fenwick *f, int at);
+
+/*
+ * Returns the index of the value which covers the given target sum,
+ * which is the number of values whose prefix sum is at most target.
+ */
+int fenwick_search(fenwick *f, long long target);
+
+/* --- byte offsets --- */
+
+/*
+ * Rebuilds the byte offset index if rows have been inserted, deleted
+ * or moved since it was built. Every row counts its size plus one byte
+ * for its newline, as in the saved file.
+ */
+void offsets_sync();
+
+/*
+ * Returns the byte offset where the row at the given index starts,
+ * adding the sizes of the rows before it inside its block to the sum
+ * of the blocks before it.
+ */
+long long row_offset(int at);
+
+/*
+ * Returns the row holding the given byte offset, and sets col to the
+ * index of the offset in that row. Offsets past the end of the file
+ * map to the position after the last row.
+ */
+int offset_to_row(long long offset, int *col);
+
 /* --- searching --- */
 
 /*
@@ -105,12 +1003,28 @@ int *compute_lps(char *pattern, size_t len);
 int *kmp_matching(char *str, char *pattern, size_t slen, size_t plen,
                   int *matches_len);
 
+/*
+ * Returns the first occurrence of the pattern in the string, or NULL.
+ * With SSE2 it tests 16 positions at once against the first and the
+ * last byte of the pattern, and only compares the whole pattern where
+ * both of them match.
+ */
+const char *find_pattern(const char *s, size_t len, const char *p,
+                         size_t plen);
+
 /*
  * It will prompt the user to enter a pattern for searching
  * through the current file.
  */
 void editor_search();
 
+/*
+ * Finds every match of the given pattern in the current file
+ * and stores them in the search_matches array.
+ * It will receive the pattern and its length.
+ */
+void search_pattern(char *pattern, size_t plen);
+
 /*
  * It will move the cursor at the front of the matching pattern
  * of the search result. It will receive the index of the matches.
@@ -129,1022 +1043,9807 @@ void increment_search();
  */
 void decrement_search();
 
-/* --- editor rows --- */
+/* --- row arena --- */
 
 /*
- * Appends a new editor row to the editor_row array in the
- * editor config struct.
- * It will receive the line string and the line length.
+ * Returns the size class holding blocks of at least the given size.
+ * Classes are 16 bytes apart up to 256 bytes, then there are four
+ * classes between two powers of two.
  */
-void append_erow(char *s, size_t len);
+int arena_class(size_t size);
 
 /*
- * Inserts a new editor row at the given position with
- * the given string. It will receive the position, the string
- * contents of the new row and the length of the string.
+ * Returns the block size of the given size class.
  */
-void insert_erow(int at, char *s, size_t len);
+size_t arena_class_size(int c);
 
 /*
- * Will delete a row at the given index.
- * It will free the row and move the rows on step backward.
- * It will receive the row index.
+ * Returns the size of a packed block holding the given size,
+ * which is rounded up to the arena unit.
  */
-void delete_erow(int at);
+size_t arena_packed_size(size_t size);
 
 /*
- * Formats each row characters, and copy it into
- * the render field of the row.
- * It will receive the row pointer.
+ * Cuts the given number of bytes from the current chunk, starting
+ * a new chunk when it doesn't have enough room, and returns their offset.
+ * The size has to be a multiple of the arena unit.
  */
-void update_erow(erow *row);
+uint32_t arena_carve(size_t size);
 
 /*
- * Converts cx into rx by counting the tab stops.
- * It will receive the row pointer and the current cx.
+ * Returns the address of the block at the given offset.
  */
-int row_cx_to_rx(erow *row, int cx);
+char *arena_ptr(uint32_t off);
 
 /*
- * Converts rx into cx by counting the tab stops.
- * It will receive the row pointer and the current rx.
+ * Returns the address of a block of any size.
+ * It will receive the offset and the capacity of the block.
  */
-int row_rx_to_cx(erow *row, int rx);
+char *arena_block(uint32_t off, int cap);
 
 /*
- * Inserts a character at the given row and the given
- * position. It will receive the row pointer, position index,
- * and the character.
+ * Allocates a block of at least the given size and returns its offset,
+ * or its index in the large table for blocks bigger than the largest
+ * size class. It will receive the size and a pointer for setting
+ * the capacity of the block, which has to be given back when it is freed.
  */
-void insert_char_at_row(erow *row, int at, char c);
+uint32_t arena_alloc(size_t size, int *cap);
 
 /*
- * Inserts a string at the given row and the given
- * position. It will receive the row pointer, position index,
- * the string and the length of the string.
+ * Allocates a block of the given size rounded up to the arena unit
+ * with the bump pointer. It is meant for rows loaded from a file,
+ * which are never grown in place.
  */
-void insert_str_at_row(erow *row, int at, char *c, size_t len);
+uint32_t arena_alloc_packed(size_t size);
 
 /*
- * Removes a character at the given row and the given position.
- * It will receive the row pointer and the position index.
+ * Allocates, resizes and frees a block bigger than the largest size
+ * class, which keeps its index in the large table when it is resized.
  */
-void remove_char_at_row(erow *row, int at);
+uint32_t arena_alloc_large(size_t size);
+void arena_realloc_large(uint32_t id, size_t size);
+void arena_free_large(uint32_t id);
 
-/* --- editor operations --- */
+/*
+ * Returns the address and the capacity of the large block with
+ * the given index.
+ */
+char *arena_large_ptr(uint32_t id);
+size_t arena_large_cap(uint32_t id);
 
 /*
- * Converts all editor_rows elements into a one
- * single buffer, and returns it. Also set the buflen
- * parameter to the buffer length.
- * It will receive the buflen parameter and returns a string.
+ * Gives a block back to the free list of its size class.
+ * It will receive the offset of the block and its capacity,
+ * and does nothing when the capacity is 0.
  */
-char *erows_to_str(int *buflen);
+void arena_free(uint32_t off, int cap);
 
 /*
- * Inserts a character in the editor screen by using
- * the insert_char_at_row function.
- * If the cursor is at the end of file it will append a row.
- * It will receive the character.
+ * Frees every block at once by freeing the chunks and the large blocks.
  */
-void insert_char(int c);
+void arena_reset();
+
+/* --- line interning --- */
 
 /*
- * Inserts a new line in the editor screen at the cursor position.
- * If there is any remaining character at the front of the cursor,
- * it will put them on the new line.
+ * Hashes the given line, 8 bytes at a time.
+ * It will receive the line and its length.
  */
-void insert_new_line();
+uint32_t intern_hash(const char *s, size_t len);
 
 /*
- * Deletes a character from the editor screen.
- * It will delete the character of a row
- * until there is no character left behind the cursor,
- * after that it will append the remaining characters after
- * the cursor to the previous row.
+ * Makes the row share the interned copy of the given line, interning
+ * the line first when no row has it yet. It only interns lines which
+ * are too long to be stored inline and fit in a size class.
+ * It will receive the row pointer, the line and its length, and returns
+ * 0 when the line isn't interned.
  */
-void delete_char();
+int intern_erow(erow *row, char *s, size_t len);
 
 /*
- * Gives a prompt on the status message line for the user,
- * and waits for the user to press enter, and the returns
- * the value of that prompt. If user cancels the prompt
- * with ESCAPE key it will return NULL pointer.
- * It will receive the prompt and a default value for the prompt.
- * Remember to include %s at the end of the prompt for the formatting
- * to work properly.
+ * Drops a reference to an interned line, and frees the line with
+ * the last one. It will receive the arena offset of the line.
  */
-char *editor_prompt(char *prompt, char *default_value);
+void intern_release(uint32_t line);
 
-/* --- appendable buffer --- */
+/*
+ * Doubles the capacity of the hash table of interned lines.
+ */
+void intern_grow();
 
 /*
- * Append a string to the appendable buffer. It will receive
- * the buffer struct pointer, new string and the new string length.
+ * Forgets every interned line. The lines themselves go with the arena.
  */
-void ap_buf_append(struct ap_buf *buf, const char *s, size_t len);
+void intern_reset();
+
+/* --- cold rows --- */
 
 /*
- * Free the buffer of the appendable buffer struct. It will receive
- * the buffer struct pointer.
+ * Returns the most bytes lz_compress can write for the given length.
  */
-void free_ap_buf(struct ap_buf *buf);
+size_t lz_bound(size_t len);
 
-/* --- screen update --- */
+/*
+ * Compresses bytes with an LZ77 codec: each sequence is a token byte
+ * holding the literal length and the match length, the literals, and
+ * the 16-bit offset of the match. Lengths which don't fit in the token
+ * go on in bytes of 255. It will receive the bytes, their length and
+ * the output, which has to hold lz_bound bytes, and returns the size
+ * of the compressed bytes.
+ */
+size_t lz_compress(const char *src, size_t len, char *dst);
 
 /*
- * Draw tildes on the left side of the screen.
- * It will receive the appendable buffer pointer.
+ * Writes the rest of a length which didn't fit in a token.
+ * It will receive the output and the length, and returns the new output.
  */
-void draw_rows(struct ap_buf *buf);
+char *lz_put_length(char *op, size_t n);
 
 /*
- * It will force write to the screen to clear it.
- * This function will use the write function immediately,
- * and it won't use the appendable buffer.
+ * Decompresses bytes of lz_compress. It will receive the compressed
+ * bytes, their size, the output and the decompressed size, and
+ * returns -1 when the bytes are malformed. Both buffers need LZ_WILD
+ * bytes of room after their end.
  */
-void clear_screen();
+int lz_decompress(const char *src, size_t clen, char *dst, size_t len);
 
 /*
- * It will force write to the screen to move the cursor to the given position.
- * This function will use the write function immediately,
- * and it won't use the appendable buffer.
- * It will receive the x and y of the position.
+ * Returns the decompressed bytes of a cold block, decompressing it into
+ * the least recently used cache slot when it isn't cached. The bytes
+ * stay valid until COLD_CACHE_BLOCKS other blocks have been fetched.
+ * A block which doesn't decompress ends the editor through die.
  */
-void move_cursor(int x, int y);
+char *cold_fetch(int id);
 
 /*
- * Updates the cursor position based on the given key,
- * to left, right, up or down.
- * It will update the cx and cy values in the editor config.
- * It will receives the pressed key as a parameter.
+ * Adds the given bytes to the block being built and points the row
+ * at them, compressing the block first when they don't fit.
+ * It will receive the row pointer, the bytes and their length.
  */
-void update_cursor_pos(int key);
+void cold_put(erow *row, const char *s, size_t len);
 
 /*
- * Updates the coloff or rowoff variables from the config,
- * when the cx or cy reaches to the edge of the screen.
+ * Compresses the block being built. Blocks whose rows are all gone
+ * by then are freed instead.
  */
-void update_scroll();
+void cold_flush();
 
 /*
- * Sets the status message based on the given formatted string.
- * Also updates the status time.
- * It will receive the formatted string alongside with the
- * string arguments.
+ * Compresses the bytes of a row, or moves a cold row into the block
+ * being built, and drops its render cache.
+ * It will receive the row pointer.
  */
-void set_status_msg(const char *fmt, ...);
+void cold_freeze(erow *row);
 
 /*
- * Draws the status line in the bottom of the terminal screen.
- * It will receive the appendable buffer pointer.
+ * Gives a cold row its own arena block again and marks it warm.
+ * It will receive the row pointer.
  */
-void draw_status_line(struct ap_buf *buf);
+void cold_thaw(erow *row);
 
 /*
- * It will draw the status line for showing the status message
- * below the main status line.
- * It will receive the appendable buffer pointer.
+ * Drops the reference of a row to a cold block, and frees the block
+ * with the last one. It will receive the block id and the row size.
  */
-void draw_status_msg_line(struct ap_buf *buf);
+void cold_unref(int id, int size);
 
 /*
- * Refresh the screen by first hiding the cursor,
- * then move the cursor to the top of screen
- * and draw the leftside tildes (clears each line before drawing),
- * and the move the cursor to the defined position in the config struct.
- * It will use the appendable buffer to do all of this with
- * a single write to the screen.
+ * Frees a cold block and gives its id back.
  */
-void refresh_screen();
+void cold_free_block(int id);
 
-/* --- get screen info --- */
+/*
+ * Compresses the rows which are neither near the screen nor warm once
+ * the uncompressed row bytes go over the limit, along with the rows of
+ * blocks which are mostly gone. The rows it skips stop being warm, so
+ * they are compressed by the next sweep unless they are used meanwhile.
+ */
+void cold_sweep();
 
 /*
- * Gets the cursor position in the screen and copy the
- * values in the rows and cols parameters which it receives.
+ * Frees every cold block and the caches, keeping the budget.
  */
-int get_cursor_pos(int *rows, int *cols);
+void cold_reset();
+
+/* --- editor rows --- */
 
 /*
- * Gets the terminal size and copy the values
- * in the rows and cols parameters which it receives.
+ * Appends a new editor row to the editor_row array in the
+ * editor config struct.
+ * It will receive the line string and the line length.
  */
-int get_term_size(int *rows, int *cols);
+void append_erow(char *s, size_t len);
 
-/* --- raw mode --- */
+/*
+ * Initializes a row with a copy of the given string, without
+ * rendering it. It will receive the row pointer, the string,
+ * the length of the string and 1 if the bytes should be packed
+ * with the bump allocator, which leaves no room to grow in place.
+ */
+void init_erow(erow *row, char *s, size_t len, int packed);
 
 /*
- * Disables the raw mode in the terminal.
+ * Returns the bytes of the row, which are followed by a null byte.
+ * Cold rows are thawed first. The pointer is only valid until the row
+ * or the rows array changes.
  */
-void disable_raw_mode();
+char *row_chars(erow *row);
 
 /*
- * Enables the raw mode in the terminal.
+ * Returns the bytes of the row for reading, like row_chars but without
+ * thawing cold rows, whose bytes are read from the decompressed block.
+ * It is meant for the loops going through many rows, and the pointer
+ * is only valid until the next row is read.
  */
-void enable_raw_mode();
+char *row_peek(erow *row);
 
-/* --- key press event handlers --- */
+/*
+ * Returns the capacity of the arena block holding the bytes of the row,
+ * or 0 when they are stored inline or compressed.
+ */
+int row_cap(erow *row);
 
 /*
- * Reads each key press and returns the character which has been pressed.
+ * Gives the bytes of the row back to the arena, or drops its reference
+ * to the interned line it shares.
  */
-int read_input_key();
+void row_release(erow *row);
 
 /*
- * Reads the pressed key, then assign the special keys to certain actions.
+ * Gives the row its own copy of its bytes when it shares an interned
+ * line, before they are changed in place, and returns the bytes.
+ * It will receive the row pointer.
  */
-void process_key_press();
+char *row_unshare(erow *row);
 
-/* --- file i/o --- */
+/*
+ * Changes the size of the row, keeping the bytes which fit and moving
+ * them inline, into a block of another size class or into a large block
+ * when needed. A row sharing an interned line gets its own copy.
+ * It will receive the row pointer and the new size, and
+ * returns the bytes of the row, the new ones being left to the caller.
+ */
+char *row_resize(erow *row, int size);
 
 /*
- * Opens a file with the given filename, and then appends
- * all the lines to the editor_row array.
- * It will receive the filename as parameter.
+ * Clears the tab-free and ASCII flags of the row when the bytes inserted
+ * into it have tabs or non ASCII bytes. Removing bytes never sets them
+ * back, that is left to the next render of the row.
+ * It will receive the row pointer and the inserted bytes.
  */
-void editor_open(char *filename);
+void row_scan_inserted(erow *row, const char *s, size_t len);
 
 /*
- * Saves the current buffer into the file.
+ * Inserts the given initialized rows at the given position with
+ * a single move of the rows after it, and records them as one edit.
+ * It will receive the position, the number of rows and the rows.
  */
-void editor_save();
+void insert_erows(int at, int n, erow *rows);
 
-/* --- error handling --- */
+/*
+ * Grows the editor_rows array so it can hold at least n rows.
+ * The capacity doubles, so appending rows is amortized O(1).
+ */
+void reserve_erows(int n);
 
 /*
- * Clears the screen, moves the cursor to the top,
- * and prints the error on the screen and then sends the exit signal.
- * It will receive the error string.
+ * Inserts a new editor row at the given position with
+ * the given string. It will receive the position, the string
+ * contents of the new row and the length of the string.
  */
-void die(const char *s);
+void insert_erow(int at, char *s, size_t len);
 
-/* --- init function --- */
+/*
+ * Will delete a row at the given index.
+ * It will free the row and move the rows on step backward.
+ * It will receive the row index.
+ */
+void delete_erow(int at);
 
 /*
- * Initializes the editor configuration.
+ * Deletes n rows starting at the given index with a single move of
+ * the rows after them, and records them as one edit.
+ * It will receive the index of the first row and the number of rows.
  */
-void init();
+void delete_erows(int at, int n);
 
-/* --- Main function --- */
+/*
+ * Returns the render cache of the row, rendering the row into a new
+ * cache slot when it has none. Rows which were already lexed are
+ * lexed again into the new cache.
+ * It will receive the row pointer.
+ */
+row_render *erow_render(erow *row);
 
-int main(int argc, char *argv[]) {
-  enable_raw_mode();
-  init();
+/*
+ * Renders a row without a cache into the scratch render, which is
+ * overwritten by the next call. It is meant for rows which are only
+ * measured or lexed, like the ones out of the screen.
+ * It will receive the row pointer.
+ */
+row_render *scratch_render(erow *row);
 
-  if (argc >= 2) {
-    editor_open(argv[1]);
-  }
+/*
+ * Drops the render caches of the rows out of the screen once there
+ * are more than RENDER_CACHE_LIMIT of them. It is called before
+ * a frame is drawn, while no render pointer is held.
+ */
+void trim_render_cache();
 
-  set_status_msg("HELP: Ctrl-S = save | Ctrl-Q = quit");
+/*
+ * Frees every render cache and the scratch render.
+ */
+void free_render_cache();
 
-  while (1) {
-    refresh_screen();
-    process_key_press();
-  }
+/*
+ * Notes that the chars of the row changed: renders the cache
+ * of the row again when it has one, and drops its highlight.
+ * It will receive the row pointer.
+ */
+void update_erow(erow *row);
 
-  return 0;
-}
+/*
+ * Renders the given part of a row again after an edit.
+ * Short rows are rendered as a whole, while segmented rows only render
+ * the segments which overlap the edit.
+ * It will receive the row pointer, the index of the edit, the number
+ * of removed characters and the number of inserted characters.
+ */
+void update_erow_edit(erow *row, int at, int removed, int inserted);
 
-/* ------ Function definitions ------ */
+/*
+ * Formats the chars of a render, expanding tabs and building the cell
+ * index, and splits it into segments when it is very long.
+ * It will receive the render pointer.
+ */
+void render_row(row_render *r);
 
-void clear_screen() { write(STDIN_FILENO, "\x1b[2J", 4); }
+/*
+ * Splits the given part of the chars of a render into segments and
+ * renders them. It will receive the render pointer, the index of the
+ * first new segment, the start index and end index in chars and
+ * the start column.
+ */
+void build_segments(row_render *r, int seg, int start, int end, int rx);
 
-void move_cursor(int x, int y) {
-  char temp_buf[32];
-  snprintf(temp_buf, sizeof(temp_buf), "\x1b[%d;%dH", y + 1, x + 1);
-  write(STDIN_FILENO, temp_buf, strlen(temp_buf));
-}
+/*
+ * Brings the start columns, the tab phases and the chars pointers of the
+ * segments up to date after an edit, and sums the render totals.
+ * It will receive the render pointer and the first segment whose start
+ * column may have changed.
+ */
+void sync_segments(row_render *r, int from);
 
-int *compute_lps(char *pattern, size_t len) {
-  int i = 1;
-  int j = 0;
-  int *lps = malloc(sizeof(int) * len);
-  lps[0] = 0;
+/*
+ * Drops the render cache of the row, if it has one.
+ * It will receive the row pointer.
+ */
+void free_erow_render(erow *row);
 
-  while (i < len) {
-    if (pattern[i] == pattern[j]) {
-      j++;
-      lps[i] = j;
-      i++;
-    } else {
-      if (j != 0) {
-        j = lps[j - 1];
-      } else {
-        i++;
-      }
-    }
-  }
+/*
+ * Frees the rendered data of a render, including its segments.
+ * It will receive the render pointer.
+ */
+void free_render(row_render *r);
 
-  return lps;
-}
+/*
+ * Returns the index of the segment containing the given index of chars.
+ * It will receive the render pointer and the index.
+ */
+int find_segment_by_cx(row_render *r, int cx);
 
-int *kmp_matching(char *str, char *pattern, size_t slen, size_t plen,
-                  int *matches_len) {
-  int matches_idx = 0;
-  int m_len = 5;
-  int *matches = malloc(sizeof(int) * m_len);
+/*
+ * Returns the index of the segment containing the given column.
+ * It will receive the render pointer and the column.
+ */
+int find_segment_by_rx(row_render *r, int rx);
 
-  for (int i = 0; i < m_len; i++) {
-    matches[i] = -1;
-  }
+/*
+ * Converts cx into rx, without a render for the rows with one
+ * column per byte. It will receive the row pointer and the current cx.
+ */
+int row_cx_to_rx(erow *row, int cx);
 
-  int *lps = compute_lps(pattern, plen);
+/*
+ * Converts rx into cx, without a render for the rows with one
+ * column per byte. It will receive the row pointer and the current rx.
+ */
+int row_rx_to_cx(erow *row, int rx);
 
-  int i = 0;
-  int j = 0;
+/*
+ * Returns how many columns the row takes on the screen. Only rows
+ * with tabs or non ASCII bytes and no render cache are rendered,
+ * into the render cache for segmented rows.
+ */
+int row_width(erow *row);
 
-  while ((slen - i) >= (plen - j)) {
-    if (i >= slen) {
-      free(lps);
-      return matches;
-    }
+/*
+ * Converts cx into rx with a binary search over the cells of a render.
+ * It will receive the render pointer and the current cx.
+ */
+int render_cx_to_rx(row_render *r, int cx);
 
-    if (str[i] == pattern[j]) {
-      j++;
-      i++;
-    }
+/*
+ * Converts rx into cx with a binary search over the cells of a render.
+ * It will receive the render pointer and the current rx.
+ */
+int render_rx_to_cx(row_render *r, int rx);
 
-    if (j == plen) {
-      if (matches_idx >= m_len - 1) {
-        m_len *= 2;
-        matches = realloc(matches, sizeof(int) * m_len);
+/*
+ * Converts rx into an index of the render string. If rx falls inside
+ * a wide character it returns the start of that character.
+ * It will receive the render pointer, the rx and a pointer for setting
+ * the column where the returned character starts.
+ */
+int render_rx_to_rbyte(row_render *r, int rx, int *col);
 
-        for (int k = matches_idx; k < m_len; k++) {
-          matches[k] = -1;
-        }
-      }
+/*
+ * Returns the index of the character after the one at cx.
+ * It will receive the row pointer and the current cx.
+ */
+int row_next_cx(erow *row, int cx);
 
-      matches[matches_idx++] = i - j;
+/*
+ * Returns the index of the character before the one at cx.
+ * It will receive the row pointer and the current cx.
+ */
+int row_prev_cx(erow *row, int cx);
+
+/*
+ * Changes the tab width and renders every row again.
+ * It will receive the new tab width.
+ */
+void set_tab_stop(int tab_stop);
+
+/*
+ * Notifies the caches which are indexed by row number
+ * that the contents of the row at the given index changed.
+ * It will receive the index and how many bytes the row grew by.
+ */
+void row_updated(int at, int delta);
+
+/*
+ * Inserts a character at the given row and the given
+ * position. It will receive the row pointer, position index,
+ * and the character.
+ */
+void insert_char_at_row(erow *row, int at, char c);
+
+/*
+ * Inserts a string at the given row and the given
+ * position. It will receive the row pointer, position index,
+ * the string and the length of the string.
+ */
+void insert_str_at_row(erow *row, int at, char *c, size_t len);
+
+/*
+ * Removes a character at the given row and the given position.
+ * It will receive the row pointer and the position index.
+ */
+void remove_char_at_row(erow *row, int at);
+
+/*
+ * Removes len characters at the given row and the given position.
+ * It will receive the row pointer, position index and the length.
+ */
+void remove_str_at_row(erow *row, int at, size_t len);
+
+/* --- utf-8 --- */
+
+/*
+ * Counts the bytes of the string which are not ASCII and the tabs,
+ * 16 bytes at a time when SSE2 is available.
+ * It will receive the string, the length and a pointer for setting
+ * the number of tabs, and returns the number of non ASCII bytes.
+ */
+int scan_row_bytes(const char *s, int len, int *tabs);
+
+/*
+ * Decodes one UTF-8 character at the start of the string.
+ * It will receive the string, the number of bytes available and
+ * a pointer for setting the code point, and returns the byte length
+ * of the character, or 0 if it isn't a valid UTF-8 sequence.
+ */
+int utf8_decode(const char *s, int len, unsigned int *cp);
+
+/*
+ * Returns the byte length of a UTF-8 character by its first byte.
+ */
+int utf8_seq_len(int lead);
+
+/*
+ * Returns how many terminal columns the given code point takes.
+ */
+int codepoint_width(unsigned int cp);
+
+/* --- syntax highlighting --- */
+
+/*
+ * Checks whether the given character separates two tokens.
+ */
+int is_separator(int c);
+
+/*
+ * Lexes the render string of the given render or segment into its hl
+ * array. It will receive the render pointer, the lexer state at the
+ * start and the render of the next segment, or NULL, where comment
+ * delimiters cut by the end of the segment are looked for.
+ * Returns the state at the end.
+ */
+int lex_highlight(row_render *row, int state, const char *next);
+
+/*
+ * Returns 1 if the given delimiter is at index i of the render,
+ * reading its end from the render of the next segment when it has one.
+ */
+int lex_match(row_render *row, int i, const char *s, int len,
+              const char *next);
+
+/*
+ * Lexes the given render, segment by segment for segmented ones.
+ * Segments which were lexed with the same start state are skipped.
+ * It will receive the render pointer and the lexer state at the start,
+ * and returns the state at the end without checking the line ending.
+ */
+int lex_render(row_render *r, int state);
+
+/*
+ * Lexes the given row, in its render cache when it has one and in the
+ * scratch render otherwise. It will receive the row pointer and the
+ * lexer state at the start of the row, and returns the state at the
+ * end of the row.
+ */
+int update_highlight(erow *row, int state);
+
+/*
+ * Marks the highlight of the row at the given index and every row
+ * after it as unverified, so they get re-lexed lazily.
+ */
+void invalidate_highlight(int at);
+
+/*
+ * Brings the highlight of every row up to the given index up to date.
+ * Rows whose start state and contents did not change since they were
+ * lexed are skipped, so the re-lexing stops where the state converges.
+ */
+void ensure_highlight(int upto);
+
+/*
+ * Maps a highlight type into an ANSI foreground color code.
+ */
+int syntax_to_color(int hl);
+
+/*
+ * Picks the syntax definition matching the current filename and
+ * drops every cached highlight.
+ */
+void select_syntax_highlight();
+
+/* --- undo history --- */
+
+/*
+ * Starts a new user action. Every record created until the next call
+ * is undone and redone together.
+ */
+void undo_begin_action();
+
+/*
+ * Records an insertion or a deletion of text inside a row.
+ * Consecutive keystrokes are coalesced into the previous record.
+ * It will receive the record type, the row index, the column,
+ * the text and the length of the text.
+ */
+void undo_record_text(int type, int row, int col, const char *s, size_t len);
+
+/*
+ * Records an insertion or a deletion of whole rows.
+ * Deleted rows are moved into the record instead of being freed.
+ * It will receive the record type, the index of the first row,
+ * the number of rows and the deleted rows (NULL for insertions).
+ * Returns 1 if the rows have been moved into the history, otherwise
+ * the caller still owns them.
+ */
+int undo_record_rows(int type, int at, int n, erow *rows);
+
+/*
+ * Records a reordering of the rows of a range.
+ * It will receive the index of the first row, the number of rows
+ * and the permutation, where row i of the range came from row perm[i].
+ */
+void undo_record_perm(int at, int n, const uint32_t *perm);
+
+/*
+ * Reads and writes the unaligned 32-bit values of the undo log.
+ */
+uint32_t read_u32(const unsigned char *p);
+void write_u32(unsigned char *p, uint32_t v);
+
+/*
+ * Returns the size of the record at the given offset of the log.
+ */
+size_t undo_record_size(size_t offset);
+
+/*
+ * Appends a new record to the log and returns its offset.
+ * It will receive the record type, row, column, length, and the payload
+ * with its length.
+ */
+size_t undo_append(int type, int row, int col, size_t len, const void *payload,
+                   size_t payload_len);
+
+/*
+ * Returns how many bytes the given rows take while they are held
+ * by the history.
+ */
+size_t erows_bytes(erow *rows, int n);
+
+/*
+ * Frees the rows held by the record at the given offset of the log.
+ * It will receive the offset and 0 if the row bytes should be left
+ * to the arena, which frees them all at once.
+ */
+void undo_free_record(size_t offset, int free_chars);
+
+/*
+ * Drops every record, including the redo ones.
+ * It will receive 0 if the row bytes should be left to the arena.
+ */
+void undo_clear(int free_chars);
+
+/*
+ * Drops the oldest records while the history is over its memory limit.
+ */
+void undo_trim();
+
+/*
+ * Reverts the last action. Returns 0 if there was nothing to undo.
+ */
+int editor_undo();
+
+/*
+ * Applies the last undone action again.
+ * Returns 0 if there was nothing to redo.
+ */
+int editor_redo();
+
+/*
+ * Moves n rows out of the document into the given array
+ * without freeing them. It will receive the index of the first row,
+ * the number of rows and the destination array.
+ */
+void take_erows(int at, int n, erow *dst);
+
+/*
+ * Moves n rows from the given array into the document.
+ * It will receive the index of the first row, the number of rows
+ * and the source array.
+ */
+void put_erows(int at, int n, erow *src);
+
+/* --- crash-recovery journal --- */
+
+/*
+ * Returns the journal path of the given file, which is a hidden
+ * .swp file next to it.
+ */
+char *journal_path(const char *filename);
+
+/*
+ * Opens the journal of the current file. If the journal holds edits
+ * made to the same version of the file, offers to replay them.
+ * It will receive 1 if the replay should be offered.
+ */
+void journal_open(int offer_replay);
+
+/*
+ * Writes the pending records and closes the journal.
+ * It will receive 1 if the journal file should be removed.
+ */
+void journal_close(int remove);
+
+/*
+ * Empties the journal and writes a new header for the current
+ * version of the file.
+ */
+void journal_reset();
+
+/*
+ * Puts the header for the given version of the file into the journal
+ * buffer, and while following the file, the record deleting the rows
+ * past the first base_rows of it.
+ */
+void journal_put_header(struct stat *st);
+
+/*
+ * Writes the journal again for the current version of a followed file
+ * which grew while the buffer has unsaved changes, keeping the records
+ * after the header. The new journal replaces the old one once it is
+ * complete, so a crash meanwhile leaves one or the other.
+ */
+void journal_rebase();
+
+/*
+ * Appends a record to the journal buffer.
+ * It will receive the record type, the row, the column, the length,
+ * and the inserted bytes (NULL for deletions).
+ */
+void journal_record(int type, int row, int col, const char *s, size_t len);
+
+/*
+ * Appends a variable-length integer to the journal buffer.
+ */
+void journal_put_varint(uint64_t v);
+
+/*
+ * Reads a variable-length integer from the given buffer.
+ * Returns the number of bytes read, or 0 if the buffer ends first.
+ */
+int journal_get_varint(const unsigned char *p, size_t len, uint64_t *v);
+
+/*
+ * Writes the pending records into the journal file.
+ * It will receive 1 if the file should be synced as well.
+ */
+void journal_flush(int sync);
+
+/*
+ * Called while waiting for input, writes the pending records
+ * and syncs the journal when the sync interval has passed.
+ */
+void journal_idle();
+
+/*
+ * Applies the records of the given journal contents to the document.
+ * Returns the length of the valid part of the journal.
+ */
+size_t journal_replay(const unsigned char *data, size_t len);
+
+/*
+ * Notes a hangup or a termination signal, which journal_signaled
+ * handles outside of the handler, as the signal may come in the middle
+ * of an edit growing the journal buffer.
+ */
+void handle_signal(int sig);
+
+/*
+ * Called while waiting for input, writes the journal and lets the
+ * editor get killed when a signal was noted by handle_signal.
+ */
+void journal_signaled();
+
+/* --- latency trace --- */
+
+/*
+ * Returns the monotonic time in nanoseconds, or 0 if tracing is off.
+ */
+uint64_t trace_now();
+
+/*
+ * Records a span of the given probe from start until now.
+ */
+void trace_event_end(int probe, uint64_t start);
+
+/*
+ * Records the statistics of a frame and resets the allocation counters.
+ * It will receive the start of the frame and the bytes written.
+ */
+void trace_frame_end(uint64_t start, size_t written);
+
+/*
+ * The counting malloc, realloc, calloc, strdup and strndup.
+ */
+void *trace_malloc(size_t size);
+void *trace_realloc(void *ptr, size_t size);
+void *trace_calloc(size_t count, size_t size);
+char *trace_strdup(const char *s);
+char *trace_strndup(const char *s, size_t n);
+
+/*
+ * Computes the p50 and p99 latencies in nanoseconds of the given probe
+ * over the latest events. Returns the number of events used.
+ */
+int trace_percentiles(int probe, uint64_t *p50, uint64_t *p99);
+
+/*
+ * Draws the p50/p99 latencies and the last frame statistics
+ * into the status message line.
+ */
+void draw_trace_overlay(struct ap_buf *buf);
+
+/*
+ * Writes the trace into the given file in the Chrome trace JSON format.
+ * Returns 0 on success, otherwise -1.
+ */
+int trace_dump(char *filename);
+
+/* --- memory accounting --- */
+
+/*
+ * Adds an allocation to the usage of a subsystem.
+ * It will receive the usage, the pointer and the bytes in use.
+ */
+void mem_account(mem_usage *usage, void *ptr, size_t used);
+
+/*
+ * Adds a block of the row arena to the usage of a subsystem, and takes
+ * it out of the arena usage, which is left with the unused arena bytes.
+ * It will receive the report, the subsystem, the capacity of the block,
+ * which is 0 for no block, and the bytes in use.
+ */
+void mem_account_block(mem_report *report, int subsystem, size_t cap,
+                       size_t used);
+
+/*
+ * Adds the render, cells, highlight and segments of a render.
+ */
+void mem_account_render(mem_report *report, row_render *r);
+
+/*
+ * Walks every data structure of the editor and fills the usage
+ * of each subsystem. Nothing is tracked on the hot paths, the
+ * numbers are computed only when they are asked for.
+ */
+void collect_mem_usage(mem_report *report);
+
+/*
+ * Formats a byte count with a K, M or G suffix into the given buffer.
+ */
+char *format_bytes(size_t bytes, char *buf, size_t size);
+
+/*
+ * Writes a table of the given report into the given stream.
+ */
+void print_mem_usage(FILE *f, mem_report *report);
+
+/*
+ * Shows the memory breakdown in the status line, or writes the
+ * full table into a file if a filename is given.
+ * Returns 0 on success, otherwise -1.
+ */
+int show_mem_usage(char *filename);
+
+/* --- editor operations --- */
+
+/*
+ * Converts all editor_rows elements into a one
+ * single buffer, and returns it. Also set the buflen
+ * parameter to the buffer length.
+ * It will receive the buflen parameter and returns a string.
+ */
+char *erows_to_str(size_t *buflen);
+
+/*
+ * Inserts a character in the editor screen by using
+ * the insert_char_at_row function.
+ * If the cursor is at the end of file it will append a row.
+ * It will receive the character.
+ */
+void insert_char(int c);
+
+/*
+ * Inserts a multi-byte UTF-8 character in the editor screen.
+ * It will read the remaining bytes of the character from the input.
+ * It will receive the first byte of the character.
+ */
+void insert_utf8_char(int lead);
+
+/*
+ * Inserts a new line in the editor screen at the cursor position.
+ * If there is any remaining character at the front of the cursor,
+ * it will put them on the new line.
+ */
+void insert_new_line();
+
+/*
+ * Deletes a character from the editor screen.
+ * It will delete the character of a row
+ * until there is no character left behind the cursor,
+ * after that it will append the remaining characters after
+ * the cursor to the previous row.
+ */
+void delete_char();
+
+/*
+ * Gives a prompt on the status message line for the user,
+ * and waits for the user to press enter, and the returns
+ * the value of that prompt. If user cancels the prompt
+ * with ESCAPE key it will return NULL pointer.
+ * It will receive the prompt and a default value for the prompt.
+ * Remember to include %s at the end of the prompt for the formatting
+ * to work properly.
+ */
+char *editor_prompt(char *prompt, char *default_value);
+
+/* --- appendable buffer --- */
+
+/*
+ * Append a string to the appendable buffer. It will receive
+ * the buffer struct pointer, new string and the new string length.
+ */
+void ap_buf_append(struct ap_buf *buf, const char *s, size_t len);
+
+/*
+ * Free the buffer of the appendable buffer struct. It will receive
+ * the buffer struct pointer.
+ */
+void free_ap_buf(struct ap_buf *buf);
+
+/* --- screen update --- */
+
+/*
+ * Draw tildes on the left side of the screen.
+ * It will receive the appendable buffer pointer.
+ */
+void draw_rows(struct ap_buf *buf);
+
+/*
+ * Draws the screen line at the given y position and clears the
+ * rest of it. It will not move to the next line.
+ * It will receive the appendable buffer pointer and the y position.
+ */
+void draw_row(struct ap_buf *buf, int y);
+
+/*
+ * Shifts the rows on the screen by the given amount of lines with
+ * the terminal scroll region, and only draws the lines which have
+ * been exposed by the scroll. A positive shift scrolls the text up.
+ * It will receive the appendable buffer pointer and the shift.
+ */
+void draw_scrolled_rows(struct ap_buf *buf, int shift);
+
+/*
+ * Draws len render characters of the given render starting at the
+ * start index, with the highlight colors applied.
+ * It will receive the appendable buffer pointer, the render pointer,
+ * the start index and the length.
+ */
+void draw_erow_span(struct ap_buf *buf, row_render *row, int start, int len);
+
+/*
+ * It will force write to the screen to clear it.
+ * This function will use the write function immediately,
+ * and it won't use the appendable buffer.
+ */
+void clear_screen();
+
+/*
+ * It will force write to the screen to move the cursor to the given position.
+ * This function will use the write function immediately,
+ * and it won't use the appendable buffer.
+ * It will receive the x and y of the position.
+ */
+void move_cursor(int x, int y);
+
+/*
+ * Updates the cursor position based on the given key,
+ * to left, right, up or down.
+ * It will update the cx and cy values in the editor config.
+ * It will receives the pressed key as a parameter.
+ */
+void update_cursor_pos(int key);
+
+/*
+ * Updates the coloff or rowoff variables from the config,
+ * when the cx or cy reaches to the edge of the screen.
+ */
+void update_scroll();
+
+/* --- soft wrap --- */
+
+/*
+ * Returns the number of screen lines the given row occupies
+ * in soft-wrap mode.
+ */
+int wrap_row_height(erow *row);
+
+/*
+ * Rebuilds the wrap index if rows have been inserted or deleted
+ * since it was built.
+ */
+void wrap_sync();
+
+/*
+ * Maps a screen line (counted from the top of the file) into a row.
+ * It will set sub to the wrapped line of that row.
+ * Without soft wrap each row is one screen line.
+ */
+int screen_line_to_row(int line, int *sub);
+
+/*
+ * Returns the screen line (counted from the top of the file)
+ * and the screen column of the cursor.
+ */
+int cursor_screen_line(int *col);
+
+/*
+ * Moves the cursor by the given amount of wrapped screen lines.
+ */
+void wrap_move_cursor(int lines);
+
+/*
+ * Toggles the soft-wrap mode.
+ */
+void toggle_wrap();
+
+/*
+ * Sets the status message based on the given formatted string.
+ * Also updates the status time.
+ * It will receive the formatted string alongside with the
+ * string arguments.
+ */
+void set_status_msg(const char *fmt, ...);
+
+/*
+ * Draws the status line in the bottom of the terminal screen.
+ * It will receive the appendable buffer pointer.
+ */
+void draw_status_line(struct ap_buf *buf);
+
+/*
+ * It will draw the status line for showing the status message
+ * below the main status line.
+ * It will receive the appendable buffer pointer.
+ */
+void draw_status_msg_line(struct ap_buf *buf);
+
+/*
+ * Refresh the screen by first hiding the cursor,
+ * then move the cursor to the top of screen
+ * and draw the leftside tildes (clears each line before drawing),
+ * and the move the cursor to the defined position in the config struct.
+ * If nothing but the vertical scroll changed since the last refresh,
+ * only the newly exposed lines are drawn.
+ * It will use the appendable buffer to do all of this with
+ * a single write to the screen.
+ */
+void refresh_screen();
+
+/* --- get screen info --- */
+
+/*
+ * Gets the cursor position in the screen and copy the
+ * values in the rows and cols parameters which it receives.
+ */
+int get_cursor_pos(int *rows, int *cols);
+
+/*
+ * Gets the terminal size and copy the values
+ * in the rows and cols parameters which it receives.
+ */
+int get_term_size(int *rows, int *cols);
+
+/* --- raw mode --- */
+
+/*
+ * Disables the raw mode in the terminal.
+ */
+void disable_raw_mode();
+
+/*
+ * Enables the raw mode in the terminal.
+ */
+void enable_raw_mode();
+
+/* --- key press event handlers --- */
+
+/*
+ * Reads each key press and returns the character which has been pressed.
+ */
+int read_input_key();
+
+/*
+ * Reads the pressed key, then assign the special keys to certain actions.
+ */
+void process_key_press();
+
+/* --- file i/o --- */
+
+/*
+ * Opens a file with the given filename, and then appends
+ * all the lines to the editor_row array.
+ * It will receive the filename as parameter.
+ * Returns -1 if the file can't be opened in headless mode.
+ */
+int editor_open(char *filename);
+
+/*
+ * Frees every row of the current file and resets the cursor,
+ * so another file can be opened.
+ */
+void editor_close();
+
+/*
+ * Saves the current buffer into the file.
+ */
+void editor_save();
+
+/*
+ * Writes the current buffer into the given file, compressed with gzip
+ * when its name ends with .gz. The rows are written one after the other
+ * through a buffer, so the whole text is never held.
+ * Returns the number of bytes written or -1 on failure.
+ */
+off_t write_file(char *filename);
+
+/*
+ * Writes all the given bytes into the file descriptor, going on after
+ * short writes and interruptions. Returns 0, or -1 on failure.
+ */
+int write_all(int fd, const char *buf, size_t len);
+
+/*
+ * Appends a row for every complete line of the given bytes, without
+ * the newline and the carriage returns before it.
+ * It will receive the bytes and their length, and returns the number
+ * of bytes consumed, which end with the last newline.
+ */
+size_t append_lines(char *buf, size_t len);
+
+/*
+ * Returns 1 if the file starts with the gzip magic bytes, leaving
+ * the file position at the start.
+ */
+int is_gzip_file(FILE *f);
+
+/*
+ * Appends the lines of a gzip file as rows, decompressing it straight
+ * into the rows through one buffer, so the whole text is never held.
+ * Returns -1 if the file is corrupt or truncated, keeping the rows
+ * decompressed until then.
+ */
+int load_gzip(char *filename);
+
+/*
+ * Writes the rows into a gzip file, compressing them as they are
+ * written. Returns the size of the compressed file or -1 on failure.
+ */
+off_t write_gzip(char *filename);
+
+/* --- grep view --- */
+
+/*
+ * Shows only the rows containing the given pattern, moving the cursor
+ * to the first of them at or after it. The rows are searched lazily.
+ * It will receive the pattern and its length.
+ */
+void filter_start(const char *pattern, size_t plen);
+
+/*
+ * Shows every row again, keeping the top row of the view on the top.
+ */
+void filter_stop();
+
+/*
+ * Searches the rows after the scanned part, up to the given row
+ * or until the view holds the given number of rows.
+ */
+void filter_scan(int until_row, int until_count);
+
+/*
+ * Returns the line of the view showing the given row, or the line
+ * where it would be inserted when the view doesn't show it.
+ */
+int filter_line(int row);
+
+/*
+ * Returns the row shown on the given line of the view, searching as far
+ * as needed. Lines after the last row map past the end of the file.
+ */
+int filter_line_to_row(int line);
+
+/*
+ * Adds the given row to the view when it isn't shown yet.
+ */
+void filter_reveal(int row);
+
+/*
+ * Moves the cursor by the given number of lines of the view,
+ * keeping its column.
+ */
+void filter_move_cursor(int lines);
+
+/*
+ * Keeps the view in step with the rows after n rows have been inserted
+ * or deleted at the given index. The inserted rows are searched,
+ * unless they are after the scanned part.
+ */
+void filter_insert_rows(int at, int n);
+void filter_delete_rows(int at, int n);
+
+/*
+ * Searches every row again, after the rows have been reordered.
+ */
+void filter_rescan();
+
+/*
+ * Called while waiting for input, searches the next chunk of rows.
+ * Returns 1 when the screen has to be drawn.
+ */
+int filter_idle();
+
+/* --- follow mode --- */
+
+/*
+ * Starts following the current file, which can't have unsaved changes.
+ * A last line without a newline is taken out of the rows until it is
+ * complete. Returns -1 with the error in the status message.
+ */
+int follow_start();
+
+/*
+ * Stops following the file and closes the inotify instance.
+ */
+void follow_stop();
+
+/*
+ * Watches the current file and its directory, dropping the watch
+ * of the file it was following before.
+ */
+void follow_watch();
+
+/*
+ * Called while waiting for input, looks at the followed file when
+ * inotify reported a change, or on every call without inotify.
+ * It appends the new lines, or reloads the file when it has been
+ * truncated or replaced. Returns 1 when the screen has to be drawn.
+ */
+int follow_poll();
+
+/*
+ * Appends the complete lines written after the offset as rows,
+ * holding back the last line until its newline is written. The view
+ * follows the new rows when the cursor is on the last row.
+ * Returns the number of rows appended.
+ */
+int follow_read();
+
+/*
+ * Loads the followed file again after it has been truncated or
+ * replaced, or stops following it when it has unsaved changes.
+ */
+void follow_reload();
+
+/*
+ * Returns the number of rows loading the first size bytes of the
+ * followed file would give, counting the lines after the offset.
+ */
+int follow_file_rows(off_t size);
+
+/* --- project grep --- */
+
+/*
+ * Replaces the current file, which can't have unsaved changes, with
+ * an unnamed buffer and starts searching every file under the given
+ * directory for the pattern on the worker threads. Their results are
+ * appended to the buffer as they come. Returns -1 with the error in
+ * the status message.
+ */
+int project_grep_start(const char *pattern, size_t plen, const char *dir);
+
+/*
+ * Stops the workers of the project grep and frees it, the results
+ * appended until then stay in the buffer.
+ */
+void project_grep_stop();
+
+/*
+ * Waits for the workers of the project grep to finish.
+ */
+void project_grep_join();
+
+/*
+ * Called while waiting for input, appends the results queued by
+ * the workers. Returns 1 when the screen has to be drawn.
+ */
+int project_grep_poll();
+
+/*
+ * Opens the file of the result under the cursor at its line.
+ * Returns -1 with the error in the status message.
+ */
+int project_grep_open();
+
+/*
+ * Runs the tasks of the project grep until there are none left,
+ * the thread function of the workers.
+ */
+void *grep_worker(void *arg);
+
+/*
+ * Pushes the given tasks onto the stack of the project grep
+ * and wakes the workers.
+ */
+void grep_push_tasks(grep_task *tasks, int n);
+
+/*
+ * Returns the path from the root of the search of a task path.
+ */
+const char *grep_relative(const char *path);
+
+/*
+ * Pushes the entries of a directory which aren't ignored, loading
+ * the .gitignore of the directory first. Only directories and regular
+ * files are searched, symbolic links and .git directories are skipped.
+ */
+void grep_read_dir(grep_task *task);
+
+/*
+ * Maps a file and queues a result for every line containing the
+ * pattern, unless it is a binary file.
+ */
+void grep_search_file(const char *path);
+
+/*
+ * Reads the .gitignore of a directory. Returns its rules, which
+ * apply before the given ones of the parent directory, or the rules
+ * of the parent when it has no .gitignore.
+ * It will receive the path of the directory, its path from the root
+ * of the search and the rules of its parent.
+ */
+ignore_rules *ignore_load(const char *dir, const char *rel,
+                          ignore_rules *parent);
+
+/*
+ * Returns 1 if an entry is ignored: the last matching pattern of the
+ * closest .gitignore with one decides. A leading ** followed by a slash
+ * matches in every directory, other ** only within one directory.
+ * It will receive the rules, the path of the entry from the root
+ * of the search, its name and 1 if it is a directory.
+ */
+int ignore_match(ignore_rules *rules, const char *rel, const char *name,
+                 int is_dir);
+
+/* --- hex view --- */
+
+/*
+ * Returns 1 if the file should be shown in the hex view: binary files
+ * are, unless another view is forced or there is no terminal.
+ * The file position is left at the start.
+ */
+int hex_wanted(FILE *f);
+
+/*
+ * Maps the file into the hex view, which takes constant time whatever
+ * its size, up to HEX_LINE_BYTES * INT_MAX bytes.
+ * Returns -1 if it can't be mapped.
+ */
+int hex_open(FILE *f);
+
+/*
+ * Unmaps the file of the hex view.
+ */
+void hex_close();
+
+/*
+ * Opens the current file again in the hex view, or as text.
+ * It can't have unsaved changes. Returns -1 with the error in the
+ * status message.
+ */
+int hex_reopen(int on);
+
+/*
+ * Returns the number of lines of the hex view.
+ */
+int hex_lines();
+
+/*
+ * Moves the cursor to the given offset, which is clamped to the file.
+ */
+void hex_goto(long long offset);
+
+/*
+ * Returns the screen column of the byte at the given index of a line.
+ */
+int hex_column(int cx);
+
+/*
+ * Draws a line of the hex view: its offset, its bytes in hex and as
+ * ASCII, with the bytes of the search match in reverse video.
+ */
+void hex_draw_line(struct ap_buf *buf, int line);
+
+/*
+ * Reads a search pattern of the hex view: an even number of hex digits,
+ * which may be separated by spaces, is read as bytes, anything else
+ * as text. Returns the bytes and sets their number.
+ */
+char *hex_parse_pattern(const char *s, size_t *len);
+
+/*
+ * Returns the offset of the next match of the pattern after the given
+ * offset, or of the previous one when backward is 1, wrapping around
+ * the file. Returns -1 if there is none.
+ */
+long long hex_find(long long from, int backward);
+
+/*
+ * Searches for a pattern read by hex_parse_pattern from the cursor
+ * and moves to the match. Returns -1 with the error in the status
+ * message when there is none.
+ */
+int hex_search(const char *s);
+
+/*
+ * Handles a key in the hex view. Returns 0 for the keys which work
+ * the same as with text, like quitting or running a command.
+ */
+int hex_key_press(int key);
+
+/*
+ * Runs a command in the hex view, which has its own goto, goto-byte
+ * and search, and refuses the commands which edit the file. Returns
+ * 1 for the commands which work the same as with text, otherwise the
+ * result of the command.
+ */
+int hex_command(int argc, char **argv);
+
+/* --- column mode --- */
+
+/*
+ * Shows the fields of the rows aligned in columns, with the widths
+ * sampled from some of the rows. It will receive the delimiter,
+ * 0 to detect it from the file name and the first row.
+ */
+void column_start(char delim);
+
+/*
+ * Shows the rows as text again.
+ */
+void column_stop();
+
+/*
+ * Returns the delimiter of the current file: tabs for .tsv files,
+ * commas for .csv files, otherwise the most frequent of the usual
+ * delimiters in the first row, or a comma.
+ */
+char column_detect_delimiter();
+
+/*
+ * Finds the fields of a line, testing 16 bytes at once for the
+ * delimiter and the double quote with SSE2. The delimiters between
+ * double quotes don't split fields.
+ * It will receive the line and its length, the delimiter, 1 if quotes
+ * are used and the starts array with its capacity, which grows as
+ * needed. Returns the number of fields.
+ */
+int column_scan(const char *s, int len, char delim, int quotes,
+                uint32_t **starts, int *cap);
+
+/*
+ * Returns the field index of the row at the given index, building it
+ * when it isn't in the cache.
+ */
+column_fields *row_fields(int at);
+
+/*
+ * Returns how many columns the given bytes take on the screen,
+ * one per character.
+ */
+int field_width(const char *s, int len);
+
+/*
+ * Returns the width and the screen column of the given column.
+ */
+int column_width(int col);
+int column_pos(int col);
+
+/*
+ * Samples the widths of the columns from up to COLUMN_SAMPLE_ROWS rows.
+ */
+void column_sample();
+
+/*
+ * Returns the field of the row holding the given index of chars.
+ * It will receive the field index and the index.
+ */
+int column_at(column_fields *f, int cx);
+
+/*
+ * Converts cx into rx and rx into cx in column mode, where the part
+ * of a field past the width of its column isn't shown.
+ * It will receive the index of the row and the current cx or rx.
+ */
+int column_cx_to_rx(int at, int cx);
+int column_rx_to_cx(int at, int rx);
+
+/*
+ * Draws the part of a row which is on the screen in columns, cutting
+ * the fields wider than their column with a '>'.
+ * It will receive the appendable buffer pointer and the row index.
+ */
+void column_draw_row(struct ap_buf *buf, int at);
+
+/*
+ * Moves the cursor to the start of the given field of its row, or by
+ * the given number of fields. Returns -1 when the row has no such field.
+ */
+int column_goto(int field);
+void column_move(int fields);
+
+/* --- folding --- */
+
+/*
+ * Returns 1 if the folds hide rows, which they don't in the grep view.
+ */
+int fold_active();
+
+/*
+ * Returns 0 if lines can be folded, otherwise -1 with the error in the
+ * status message, as folds are off with soft wrap and in the grep view.
+ */
+int fold_check();
+
+/*
+ * Finds the rows which fold under the given row, looking at them only
+ * now: after a row ending with an opening bracket, the rows up to the
+ * one with the matching closing bracket, otherwise the rows after it
+ * which are more indented, blank rows included except at the end.
+ * Returns the end of the hidden rows, excluded, or -1 when none fold.
+ */
+int fold_region(int row);
+
+/*
+ * Returns the indentation width of a row, or -1 if the row is blank.
+ */
+int row_indent(int row);
+
+/*
+ * Adds a fold hiding the rows from start to end, which replaces the
+ * folds overlapping it and its header.
+ */
+void fold_add(int start, int end);
+
+/*
+ * Removes the given fold.
+ */
+void fold_remove(int i);
+
+/*
+ * Counts the hidden rows again from the given fold on.
+ */
+void fold_sum(int from);
+
+/*
+ * Returns the index of the last fold starting at or before the given
+ * row, or -1.
+ */
+int fold_find(int row);
+
+/*
+ * Folds or unfolds the rows under the given row. Returns -1 with the
+ * error in the status message when no rows fold under it.
+ */
+int fold_toggle(int row);
+
+/*
+ * Folds the regions of the given nesting depth between two rows,
+ * 1 folding the outermost ones, and removes the other folds first
+ * when called for the whole file.
+ */
+void fold_all(int from, int to, int depth);
+
+/*
+ * Removes every fold.
+ */
+void fold_clear();
+
+/*
+ * Returns the number of rows hidden under the given row, or 0 if it
+ * isn't the header of a fold.
+ */
+int fold_hidden(int row);
+
+/*
+ * Returns the screen line of a row, the line of its header when it is
+ * hidden, and the row shown on a screen line. Lines after the last row
+ * map past the end of the file.
+ */
+int fold_line(int row);
+int fold_line_to_row(int line);
+
+/*
+ * Unfolds the fold hiding the given row, if there is one.
+ */
+void fold_reveal(int row);
+
+/*
+ * Moves the cursor by the given number of screen lines, over the
+ * hidden rows, keeping its column.
+ */
+void fold_move_cursor(int lines);
+
+/*
+ * Keeps the folds on their rows after n rows have been inserted or
+ * deleted at the given index. The folds whose rows or header are
+ * changed this way are removed.
+ */
+void fold_insert_rows(int at, int n);
+void fold_delete_rows(int at, int n);
+
+/* --- line ranges --- */
+
+/*
+ * Reorders the rows of a range by moving the row structs, the line
+ * bytes stay where they are, and records it as one edit.
+ * It will receive the index of the first row, the number of rows,
+ * the permutation, where row i of the range comes from row perm[i],
+ * and 1 if the inverse permutation should be applied instead.
+ */
+void permute_erows(int at, int n, const uint32_t *perm, int inverse);
+
+/*
+ * Reads the number at the start of a line the way sort -n does:
+ * blanks, an optional minus sign, digits and a decimal point.
+ * Lines without one count as 0.
+ */
+double leading_number(const char *s, int len);
+
+/*
+ * Compares the keys of two rows by the given sort flags, without the
+ * tie breaks. Returns a negative value, 0 or a positive value.
+ */
+int sort_key_compare(const sort_key *a, const sort_key *b, int flags);
+
+/*
+ * Compares two rows for sorting: by key, then by their bytes for
+ * numeric and case insensitive keys, then by their index.
+ */
+int sort_compare(const sort_key *a, const sort_key *b, int flags);
+
+/*
+ * Sorts the keys from start to end with a merge sort, using tmp
+ * as the scratch space. Returns the array holding the sorted keys.
+ */
+sort_key *merge_sort_keys(sort_key *keys, sort_key *tmp, int start, int end,
+                          int flags);
+
+/*
+ * Merges the sorted runs start..mid and mid..end of src into dst.
+ */
+void merge_sort_runs(const sort_key *src, sort_key *dst, int start, int mid,
+                     int end, int flags);
+
+/*
+ * Runs a sort job, the thread function of the parallel sort.
+ */
+void *sort_worker(void *arg);
+
+/*
+ * Runs the given sort jobs, each one on its own thread, the first one
+ * on the calling thread, and waits for them.
+ */
+void run_sort_jobs(sort_job *jobs, int n);
+
+/*
+ * Sorts the keys on up to one thread per core: every thread sorts
+ * a chunk, then the sorted runs are merged in pairs, every pair on
+ * its own thread. It will receive the keys, their number and the
+ * sort flags.
+ */
+void parallel_sort_keys(sort_key *keys, int n, int flags);
+
+/*
+ * Sorts the rows of a range by the given sort flags, dropping the
+ * rows with the same key as the row before them with SORT_UNIQUE.
+ * It will receive the index of the first row, the number of rows,
+ * the flags and the column of the column mode whose fields are the
+ * keys, or -1 to compare whole rows. Returns the number of rows dropped.
+ */
+int sort_rows(int at, int n, int flags, int column);
+
+/*
+ * Drops the rows of a range which are equal to an earlier row
+ * of the range, keeping the order of the others.
+ * Returns the number of rows dropped.
+ */
+int unique_rows(int at, int n);
+
+/*
+ * Reverses the order of the rows of a range.
+ */
+void reverse_rows(int at, int n);
+
+/*
+ * Shuffles the rows of a range randomly.
+ */
+void shuffle_rows(int at, int n);
+
+/*
+ * Reads the optional 1-based first and last lines of a range command,
+ * which default to the whole file. It will receive the arguments
+ * and pointers for setting the index of the first row and the number
+ * of rows. Returns -1 with the error in the status message when the
+ * range is not a number or is out of the file.
+ */
+int command_range(int argc, char **argv, int *at, int *n);
+
+/* --- commands --- */
+
+/*
+ * Splits a command line into arguments. Arguments are separated
+ * by spaces, can be quoted with double quotes, and \n, \t, \"
+ * and \\ escapes are expanded.
+ * It will receive the line and the arguments array with its size,
+ * and returns the number of arguments.
+ */
+int split_command(char *line, char **argv, int max);
+
+/*
+ * Runs one editing command on the current file. The commands are
+ * goto <line> [col], goto <percent>%, goto-byte <offset>, search <text>,
+ * replace <text> <replacement>,
+ * insert <text>, delete [count], delete-line [count], save [filename],
+ * mem [filename], trace <filename>, follow [on|off], grep [pattern],
+ * grep-dir <pattern> [directory], hex [on|off],
+ * columns [on|off] [delimiter], column <n>, fold [line],
+ * unfold [line], fold-all [depth], unfold-all,
+ * sort [-niur] [-k<n>] [first last], unique [first last],
+ * reverse [first last],
+ * shuffle [first last] and
+ * set <tab-stop|undo-limit|intern|cold-budget> <value>.
+ * It will receive the command line.
+ * Returns 0 on success, otherwise -1 with the error in the status message.
+ */
+int run_command(char *line);
+
+/*
+ * Prompts for a command and runs it.
+ */
+void editor_command();
+
+/*
+ * Inserts the given text at the cursor and moves the cursor
+ * after it. A newline in the text splits the row.
+ */
+void insert_text(char *s, size_t len);
+
+/*
+ * Deletes the given number of bytes after the cursor, joining
+ * the next row when the end of a row is reached.
+ */
+void delete_text(int count);
+
+/*
+ * Replaces every occurrence of a pattern in the current file.
+ * Returns the number of replacements.
+ */
+int replace_all(char *pattern, size_t plen, char *with, size_t wlen);
+
+/* --- headless mode --- */
+
+/*
+ * Applies the commands of a script to every given file without
+ * a terminal. The script is read once, then each file is opened,
+ * edited and closed in turn.
+ * It will receive the script path ("-" reads the standard input),
+ * the number of files and the file names.
+ * With --mem-stats the memory usage of the largest file is printed
+ * at exit. Returns the number of files which failed.
+ */
+int run_script(char *script, int nfiles, char **files);
+
+/* --- error handling --- */
+
+/*
+ * Clears the screen, moves the cursor to the top,
+ * and prints the error on the screen and then sends the exit signal.
+ * It will receive the error string.
+ */
+void die(const char *s);
+
+/* --- init function --- */
+
+/*
+ * Initializes the editor configuration.
+ */
+void init();
+
+/* --- Main function --- */
+
+// the benchmarks include this file and provide their own main
+#ifndef EDITOR_NO_MAIN
+int main(int argc, char *argv[]) {
+  int arg = 1;
+
+  int follow = 0;
+
+  if (argc > arg && strcmp(argv[arg], "--mem-stats") == 0) {
+    config.mem_stats = 1;
+    arg++;
+  }
+
+  if (argc > arg && strcmp(argv[arg], "--follow") == 0) {
+    follow = 1;
+    arg++;
+  }
+
+  if (argc >= arg + 2 && (strcmp(argv[arg], "-s") == 0 ||
+                          strcmp(argv[arg], "--script") == 0)) {
+    config.headless = 1;
+    init();
+    return run_script(argv[arg + 1], argc - arg - 2, &argv[arg + 2]) == 0 ? 0
+                                                                          : 1;
+  }
+
+  enable_raw_mode();
+  init();
+
+  set_status_msg("HELP: Ctrl-S = save | Ctrl-Q = quit");
+
+  if (argc > arg) {
+    editor_open(argv[arg]);
+
+    if (follow)
+      follow_start();
+  }
+
+  while (1) {
+    refresh_screen();
+    process_key_press();
+  }
+
+  return 0;
+}
+#endif
+
+/* ------ Function definitions ------ */
+
+void clear_screen() { write(STDIN_FILENO, "\x1b[2J", 4); }
+
+void move_cursor(int x, int y) {
+  char temp_buf[32];
+  snprintf(temp_buf, sizeof(temp_buf), "\x1b[%d;%dH", y + 1, x + 1);
+  write(STDIN_FILENO, temp_buf, strlen(temp_buf));
+}
+
+void fenwick_reset(fenwick *f, int size) {
+  if (size + 1 > f->cap) {
+    f->cap = size + 1;
+    f->tree = realloc(f->tree, sizeof(long long) * f->cap);
+  }
+
+  memset(f->tree, 0, sizeof(long long) * (size + 1));
+  f->size = size;
+}
+
+void fenwick_free(fenwick *f) {
+  free(f->tree);
+  f->tree = NULL;
+  f->size = 0;
+  f->cap = 0;
+}
+
+void fenwick_add(fenwick *f, int at, long long delta) {
+  for (int i = at + 1; i <= f->size; i += i & -i) {
+    f->tree[i] += delta;
+  }
+}
+
+void fenwick_push(fenwick *f, long long value) {
+  if (f->size + 2 > f->cap) {
+    f->cap = f->cap ? f->cap * 2 : 16;
+    f->tree = realloc(f->tree, sizeof(long long) * f->cap);
+  }
+
+  int i = ++f->size;
+
+  // the new node covers its own value and the nodes below it
+  f->tree[i] = value + fenwick_prefix(f, i - 1) - fenwick_prefix(f, i - (i & -i));
+}
+
+void fenwick_build(fenwick *f) {
+  for (int i = 1; i <= f->size; i++) {
+    int parent = i + (i & -i);
+
+    if (parent <= f->size)
+      f->tree[parent] += f->tree[i];
+  }
+}
+
+long long fenwick_prefix(fenwick *f, int at) {
+  long long sum = 0;
+
+  for (int i = at; i > 0; i -= i & -i) {
+    sum += f->tree[i];
+  }
+
+  return sum;
+}
+
+int fenwick_search(fenwick *f, long long target) {
+  int pos = 0;
+  int step = 1;
+
+  while (step * 2 <= f->size)
+    step *= 2;
+
+  for (; step > 0; step /= 2) {
+    if (pos + step <= f->size && f->tree[pos + step] <= target) {
+      pos += step;
+      target -= f->tree[pos];
+    }
+  }
+
+  return pos;
+}
+
+void offsets_sync() {
+  if (!config.offsets_dirty)
+    return;
+
+  fenwick *f = &config.offset_index;
+  fenwick_reset(f, (config.numrows + OFFSET_BLOCK_ROWS - 1) / OFFSET_BLOCK_ROWS);
+
+  for (int i = 0; i < config.numrows; i++) {
+    f->tree[i / OFFSET_BLOCK_ROWS + 1] += config.editor_rows[i].size + 1;
+  }
+
+  fenwick_build(f);
+  config.offsets_dirty = 0;
+}
+
+long long row_offset(int at) {
+  offsets_sync();
+
+  int first = at - at % OFFSET_BLOCK_ROWS;
+  long long offset = fenwick_prefix(&config.offset_index, at / OFFSET_BLOCK_ROWS);
+
+  for (int i = first; i < at; i++) {
+    offset += config.editor_rows[i].size + 1;
+  }
+
+  return offset;
+}
+
+int offset_to_row(long long offset, int *col) {
+  offsets_sync();
+
+  fenwick *f = &config.offset_index;
+  *col = 0;
+
+  if (offset < 0)
+    offset = 0;
+  if (offset >= fenwick_prefix(f, f->size))
+    return config.numrows;
+
+  int block = fenwick_search(f, offset);
+  int at = block * OFFSET_BLOCK_ROWS;
+  offset -= fenwick_prefix(f, block);
+
+  // an offset on the newline of a row is the end of that row
+  while (offset > config.editor_rows[at].size) {
+    offset -= config.editor_rows[at].size + 1;
+    at++;
+  }
+
+  *col = offset;
+  return at;
+}
+
+int *compute_lps(char *pattern, size_t len) {
+  int i = 1;
+  int j = 0;
+  int *lps = malloc(sizeof(int) * len);
+  lps[0] = 0;
+
+  while (i < len) {
+    if (pattern[i] == pattern[j]) {
+      j++;
+      lps[i] = j;
+      i++;
+    } else {
+      if (j != 0) {
+        j = lps[j - 1];
+      } else {
+        i++;
+      }
+    }
+  }
+
+  return lps;
+}
+
+int *kmp_matching(char *str, char *pattern, size_t slen, size_t plen,
+                  int *matches_len) {
+  int matches_idx = 0;
+  int m_len = 5;
+  int *matches = malloc(sizeof(int) * m_len);
+
+  for (int i = 0; i < m_len; i++) {
+    matches[i] = -1;
+  }
+
+  int *lps = compute_lps(pattern, plen);
+
+  int i = 0;
+  int j = 0;
+
+  while ((slen - i) >= (plen - j)) {
+    if (i >= slen) {
+      free(lps);
+      return matches;
+    }
+
+    if (str[i] == pattern[j]) {
+      j++;
+      i++;
+    }
+
+    if (j == plen) {
+      if (matches_idx >= m_len - 1) {
+        m_len *= 2;
+        matches = realloc(matches, sizeof(int) * m_len);
+
+        for (int k = matches_idx; k < m_len; k++) {
+          matches[k] = -1;
+        }
+      }
+
+      matches[matches_idx++] = i - j;
       j = 0;
     } else if (i < slen && str[i] != pattern[j]) {
       if (j != 0) {
         j = lps[j - 1];
       } else {
-        i++;
+        i++;
+      }
+    }
+  }
+
+  free(lps);
+  *matches_len = matches_idx;
+  return matches;
+}
+
+void editor_search() {
+  char *pattern = editor_prompt("Search: %s", "");
+
+  if (pattern == NULL)
+    return;
+
+  search_pattern(pattern, strlen(pattern));
+  free(pattern);
+  move_cursor_to_search_match(0);
+}
+
+void search_pattern(char *pattern, size_t plen) {
+  if (plen == 0)
+    return;
+
+  if (config.search_matches) {
+    free(config.search_matches);
+  }
+
+  int matches_len = 10;
+  int found_match = 0;
+  config.search_matches = malloc(sizeof(search_match) * matches_len);
+
+  for (int i = 0; i < config.numrows; i++) {
+    erow *row = &config.editor_rows[i];
+    int m_len;
+    int *matches =
+        kmp_matching(row_peek(row), pattern, row->size, plen, &m_len);
+
+    if (m_len == 0) {
+      free(matches);
+      continue;
+    }
+
+    for (int j = 0; j < m_len; j++) {
+      search_match new_match;
+      new_match.cx = matches[j] + plen;
+      new_match.cy = i;
+
+      if (matches_len - 1 <= found_match) {
+        matches_len *= 2;
+        config.search_matches =
+            realloc(config.search_matches, sizeof(search_match) * matches_len);
+      }
+
+      config.search_matches[found_match++] = new_match;
+    }
+
+    free(matches);
+  }
+
+  config.search_match_found = found_match;
+  config.current_search_idx = -1;
+}
+
+void move_cursor_to_search_match(int match_idx) {
+  if (match_idx < 0 || match_idx + 1 > config.search_match_found)
+    return;
+
+  search_match match = config.search_matches[match_idx];
+  config.cx = match.cx;
+  config.cy = match.cy;
+  config.current_search_idx = match_idx;
+}
+
+void increment_search() {
+  int new_idx = (config.current_search_idx + 1) % config.search_match_found;
+
+  move_cursor_to_search_match(new_idx);
+}
+
+void decrement_search() {
+  int new_idx =
+      config.current_search_idx == 0
+          ? config.search_match_found - 1
+          : (config.current_search_idx - 1) % config.search_match_found;
+
+  move_cursor_to_search_match(new_idx);
+}
+
+const char *find_pattern(const char *s, size_t len, const char *p,
+                         size_t plen) {
+  if (plen == 0)
+    return s;
+  if (plen > len)
+    return NULL;
+
+  size_t i = 0;
+
+#ifdef __SSE2__
+  __m128i first = _mm_set1_epi8(p[0]);
+  __m128i last = _mm_set1_epi8(p[plen - 1]);
+
+  for (; i + plen - 1 + 16 <= len; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)&s[i]);
+    __m128i b = _mm_loadu_si128((const __m128i *)&s[i + plen - 1]);
+    unsigned int mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+
+    while (mask != 0) {
+      int k = __builtin_ctz(mask);
+
+      if (memcmp(&s[i + k], p, plen) == 0)
+        return &s[i + k];
+      mask &= mask - 1;
+    }
+  }
+#endif
+
+  // the positions left over, or every position without SSE2
+  return memmem(&s[i], len - i, p, plen);
+}
+
+int arena_class(size_t size) {
+  if (size <= 256)
+    return size == 0 ? 0 : (size + 15) / 16 - 1;
+
+  // finds the power of two right below the size
+  int shift = 8;
+  while (((size_t)2 << shift) < size)
+    shift++;
+
+  size_t step = (size_t)1 << (shift - 2);
+  return 16 + (shift - 8) * 4 +
+         (size - ((size_t)1 << shift) + step - 1) / step - 1;
+}
+
+size_t arena_class_size(int c) {
+  if (c < 16)
+    return (size_t)(c + 1) * 16;
+
+  int shift = 8 + (c - 16) / 4;
+  return ((size_t)1 << shift) + ((c - 16) % 4 + 1) * ((size_t)1 << (shift - 2));
+}
+
+size_t arena_packed_size(size_t size) {
+  size_t unit = (size_t)1 << ARENA_UNIT_SHIFT;
+  return (size + unit - 1) & ~(unit - 1);
+}
+
+uint32_t arena_carve(size_t size) {
+  struct row_arena *a = &config.arena;
+
+  // the rest of the current chunk is left unused
+  if (a->nchunks == 0 || a->used + size > ARENA_CHUNK_SIZE) {
+    if (a->nchunks == ARENA_MAX_CHUNKS)
+      die("arena");
+
+    if (a->nchunks == a->chunkcap) {
+      a->chunkcap = a->chunkcap ? a->chunkcap * 2 : 64;
+      a->chunks = realloc(a->chunks, sizeof(char *) * a->chunkcap);
+    }
+
+    a->chunks[a->nchunks++] = malloc(ARENA_CHUNK_SIZE);
+    a->reserved += ARENA_CHUNK_SIZE;
+    a->used = 0;
+  }
+
+  uint32_t off = ((uint32_t)(a->nchunks - 1) << ARENA_UNIT_BITS) |
+                 (uint32_t)(a->used >> ARENA_UNIT_SHIFT);
+  a->used += size;
+  return off;
+}
+
+char *arena_ptr(uint32_t off) {
+  size_t unit = off & ((1 << ARENA_UNIT_BITS) - 1);
+  return config.arena.chunks[off >> ARENA_UNIT_BITS] +
+         (unit << ARENA_UNIT_SHIFT);
+}
+
+char *arena_block(uint32_t off, int cap) {
+  return cap > ARENA_MAX_CLASS ? arena_large_ptr(off) : arena_ptr(off);
+}
+
+uint32_t arena_alloc(size_t size, int *cap) {
+  struct row_arena *a = &config.arena;
+
+  if (size > ARENA_MAX_CLASS) {
+    *cap = size;
+    return arena_alloc_large(size);
+  }
+
+  int c = arena_class(size);
+  uint32_t off = a->free_list[c];
+  *cap = arena_class_size(c);
+
+  // a free block holds the offset of the next one
+  if (off != ARENA_NONE) {
+    memcpy(&a->free_list[c], arena_ptr(off), sizeof(uint32_t));
+    return off;
+  }
+
+  if (a->slab_left[c] < (uint32_t)*cap) {
+    a->slab_left[c] = (uint32_t)*cap * ARENA_SLAB_BLOCKS;
+    a->slab[c] = arena_carve(a->slab_left[c]);
+  }
+
+  off = a->slab[c];
+  a->slab[c] += *cap >> ARENA_UNIT_SHIFT;
+  a->slab_left[c] -= *cap;
+  return off;
+}
+
+uint32_t arena_alloc_packed(size_t size) {
+  if (size > ARENA_MAX_CLASS)
+    return arena_alloc_large(size);
+
+  return arena_carve(arena_packed_size(size));
+}
+
+uint32_t arena_alloc_large(size_t size) {
+  struct row_arena *a = &config.arena;
+  uint32_t id;
+
+  if (a->nfree_large > 0) {
+    id = a->free_large[--a->nfree_large];
+  } else {
+    if (a->nlarge == a->largecap) {
+      a->largecap = a->largecap ? a->largecap * 2 : 64;
+      a->large = realloc(a->large, sizeof(char *) * a->largecap);
+      a->free_large = realloc(a->free_large, sizeof(uint32_t) * a->largecap);
+    }
+
+    id = a->nlarge++;
+  }
+
+  char *block = malloc(ARENA_LARGE_HEADER + size);
+  memcpy(block, &size, sizeof(size));
+  a->large[id] = block;
+  a->reserved += malloc_usable_size(block);
+  return id;
+}
+
+void arena_realloc_large(uint32_t id, size_t size) {
+  struct row_arena *a = &config.arena;
+
+  a->reserved -= malloc_usable_size(a->large[id]);
+  a->large[id] = realloc(a->large[id], ARENA_LARGE_HEADER + size);
+  memcpy(a->large[id], &size, sizeof(size));
+  a->reserved += malloc_usable_size(a->large[id]);
+}
+
+void arena_free_large(uint32_t id) {
+  struct row_arena *a = &config.arena;
+
+  a->reserved -= malloc_usable_size(a->large[id]);
+  free(a->large[id]);
+  a->large[id] = NULL;
+  a->free_large[a->nfree_large++] = id;
+}
+
+char *arena_large_ptr(uint32_t id) {
+  return config.arena.large[id] + ARENA_LARGE_HEADER;
+}
+
+size_t arena_large_cap(uint32_t id) {
+  size_t cap;
+  memcpy(&cap, config.arena.large[id], sizeof(cap));
+  return cap;
+}
+
+void arena_free(uint32_t off, int cap) {
+  struct row_arena *a = &config.arena;
+
+  if (cap == 0)
+    return;
+
+  if (cap > ARENA_MAX_CLASS) {
+    arena_free_large(off);
+    return;
+  }
+
+  // a packed block goes to the biggest class it can hold, blocks smaller
+  // than the first class are only reclaimed when the arena is reset
+  int c = arena_class(cap);
+  if (arena_class_size(c) > (size_t)cap)
+    c--;
+  if (c < 0)
+    return;
+
+  memcpy(arena_ptr(off), &a->free_list[c], sizeof(uint32_t));
+  a->free_list[c] = off;
+}
+
+void arena_reset() {
+  struct row_arena *a = &config.arena;
+
+  for (int i = 0; i < a->nchunks; i++) {
+    free(a->chunks[i]);
+  }
+
+  for (int i = 0; i < a->nlarge; i++) {
+    free(a->large[i]);
+  }
+
+  free(a->chunks);
+  free(a->large);
+  free(a->free_large);
+  memset(a, 0, sizeof(*a));
+
+  for (int c = 0; c < ARENA_CLASSES; c++) {
+    a->free_list[c] = ARENA_NONE;
+  }
+}
+
+uint32_t intern_hash(const char *s, size_t len) {
+  uint64_t h = len * 0x9e3779b97f4a7c15ULL;
+  size_t i = 0;
+
+  for (; i + 8 <= len; i += 8) {
+    uint64_t v;
+    memcpy(&v, &s[i], sizeof(v));
+    h = (h ^ v) * 0xff51afd7ed558ccdULL;
+    h ^= h >> 32;
+  }
+
+  for (; i < len; i++) {
+    h = (h ^ (unsigned char)s[i]) * 0x100000001b3ULL;
+  }
+
+  h ^= h >> 29;
+  return (uint32_t)h;
+}
+
+int intern_erow(erow *row, char *s, size_t len) {
+  struct intern_table *t = &config.interned;
+
+  if (len <= ROW_INLINE_SIZE || INTERN_HEADER + len + 1 > ARENA_MAX_CLASS)
+    return 0;
+
+  // the table is kept at most three quarters full
+  if ((t->count + 1) * 4 > t->cap * 3)
+    intern_grow();
+
+  uint32_t hash = intern_hash(s, len);
+  uint32_t mask = t->cap - 1;
+  uint32_t i = hash & mask;
+
+  for (; t->slots[i].line != ARENA_NONE; i = (i + 1) & mask) {
+    if (t->slots[i].hash != hash)
+      continue;
+
+    char *line = arena_ptr(t->slots[i].line);
+    uint32_t header[3];
+    memcpy(header, line, INTERN_HEADER);
+
+    if (header[2] == len && memcmp(&line[INTERN_HEADER], s, len) == 0) {
+      header[0]++;
+      memcpy(line, header, sizeof(uint32_t));
+      row->off = t->slots[i].line;
+      row->flags |= ROW_INTERNED;
+      return 1;
+    }
+  }
+
+  uint32_t header[3] = {1, hash, len};
+  uint32_t off = arena_alloc_packed(INTERN_HEADER + len + 1);
+  char *line = arena_ptr(off);
+
+  memcpy(line, header, INTERN_HEADER);
+  memcpy(&line[INTERN_HEADER], s, len);
+  line[INTERN_HEADER + len] = '\0';
+  t->slots[i] = (intern_slot){off, hash};
+  t->count++;
+
+  row->off = off;
+  row->flags |= ROW_INTERNED;
+  return 1;
+}
+
+void intern_release(uint32_t line) {
+  struct intern_table *t = &config.interned;
+  char *p = arena_ptr(line);
+  uint32_t header[3];
+  memcpy(header, p, INTERN_HEADER);
+
+  if (--header[0] > 0) {
+    memcpy(p, header, sizeof(uint32_t));
+    return;
+  }
+
+  uint32_t mask = t->cap - 1;
+  uint32_t i = header[1] & mask;
+
+  while (t->slots[i].line != line)
+    i = (i + 1) & mask;
+
+  // the lines after it in the same run move back when their home
+  // slot isn't between the freed slot and theirs, so probing still
+  // finds them without tombstones
+  for (uint32_t j = (i + 1) & mask; t->slots[j].line != ARENA_NONE;
+       j = (j + 1) & mask) {
+    uint32_t home = t->slots[j].hash & mask;
+
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      t->slots[i] = t->slots[j];
+      i = j;
+    }
+  }
+
+  t->slots[i].line = ARENA_NONE;
+  t->count--;
+  arena_free(line, arena_packed_size(INTERN_HEADER + header[2] + 1));
+}
+
+void intern_grow() {
+  struct intern_table *t = &config.interned;
+  int cap = t->cap ? t->cap * 2 : 1024;
+  intern_slot *slots = malloc(sizeof(intern_slot) * cap);
+
+  for (int i = 0; i < cap; i++) {
+    slots[i].line = ARENA_NONE;
+  }
+
+  for (int i = 0; i < t->cap; i++) {
+    if (t->slots[i].line == ARENA_NONE)
+      continue;
+
+    uint32_t j = t->slots[i].hash & (cap - 1);
+    while (slots[j].line != ARENA_NONE)
+      j = (j + 1) & (cap - 1);
+    slots[j] = t->slots[i];
+  }
+
+  free(t->slots);
+  t->slots = slots;
+  t->cap = cap;
+}
+
+void intern_reset() {
+  free(config.interned.slots);
+  memset(&config.interned, 0, sizeof(config.interned));
+}
+
+size_t lz_bound(size_t len) { return len + len / 255 + 16; }
+
+size_t lz_compress(const char *src, size_t len, char *dst) {
+  uint32_t table[1 << LZ_HASH_BITS];
+  size_t anchor = 0;
+  size_t i = 0;
+  char *op = dst;
+
+  memset(table, 0, sizeof(table));
+
+  while (i + LZ_MIN_MATCH <= len) {
+    uint32_t v;
+    memcpy(&v, &src[i], sizeof(v));
+
+    uint32_t h = (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+    uint32_t cand = table[h];
+    table[h] = i;
+
+    uint32_t c;
+    memcpy(&c, &src[cand], sizeof(c));
+
+    if (cand >= i || i - cand > LZ_MAX_OFFSET || c != v) {
+      // the step grows over bytes which don't compress
+      i += 1 + ((i - anchor) >> 6);
+      continue;
+    }
+
+    // the match is extended 8 bytes at a time, the first differing
+    // byte being the lowest set byte of the xor on little-endian
+    size_t mlen = LZ_MIN_MATCH;
+    while (i + mlen + 8 <= len) {
+      uint64_t x, y;
+      memcpy(&x, &src[cand + mlen], sizeof(x));
+      memcpy(&y, &src[i + mlen], sizeof(y));
+
+      if (x != y) {
+        mlen += __builtin_ctzll(x ^ y) >> 3;
+        break;
+      }
+
+      mlen += 8;
+    }
+
+    if (i + mlen + 8 > len) {
+      while (i + mlen < len && src[cand + mlen] == src[i + mlen])
+        mlen++;
+    }
+
+    size_t lit = i - anchor;
+    size_t m = mlen - LZ_MIN_MATCH;
+    *op++ = (lit < 15 ? lit : 15) << 4 | (m < 15 ? m : 15);
+
+    if (lit >= 15)
+      op = lz_put_length(op, lit - 15);
+
+    memcpy(op, &src[anchor], lit);
+    op += lit;
+    *op++ = (i - cand) & 0xff;
+    *op++ = (i - cand) >> 8;
+
+    if (m >= 15)
+      op = lz_put_length(op, m - 15);
+
+    i += mlen;
+    anchor = i;
+  }
+
+  // the last sequence only has literals
+  size_t lit = len - anchor;
+  *op++ = (lit < 15 ? lit : 15) << 4;
+
+  if (lit >= 15)
+    op = lz_put_length(op, lit - 15);
+
+  memcpy(op, &src[anchor], lit);
+  return op + lit - dst;
+}
+
+char *lz_put_length(char *op, size_t n) {
+  for (; n >= 255; n -= 255) {
+    *op++ = (char)255;
+  }
+
+  *op++ = n;
+  return op;
+}
+
+int lz_decompress(const char *src, size_t clen, char *dst, size_t len) {
+  const unsigned char *ip = (const unsigned char *)src;
+  const unsigned char *end = ip + clen;
+  size_t o = 0;
+
+  while (ip < end) {
+    int token = *ip++;
+    size_t lit = token >> 4;
+    unsigned char b;
+
+    if (lit == 15) {
+      do {
+        if (ip == end)
+          return -1;
+        b = *ip++;
+        lit += b;
+      } while (b == 255);
+    }
+
+    if (lit > (size_t)(end - ip) || lit > len - o)
+      return -1;
+
+    if (lit <= LZ_WILD)
+      memcpy(&dst[o], ip, LZ_WILD);
+    else
+      memcpy(&dst[o], ip, lit);
+    ip += lit;
+    o += lit;
+
+    if (ip == end)
+      break;
+
+    if (end - ip < 2)
+      return -1;
+
+    size_t off = ip[0] | ip[1] << 8;
+    size_t mlen = (token & 15) + LZ_MIN_MATCH;
+    ip += 2;
+
+    if ((token & 15) == 15) {
+      do {
+        if (ip == end)
+          return -1;
+        b = *ip++;
+        mlen += b;
+      } while (b == 255);
+    }
+
+    if (off == 0 || off > o || mlen > len - o)
+      return -1;
+
+    // the match may overlap the bytes it writes, which words only
+    // do when they are longer than the offset
+    if (off >= 8) {
+      for (size_t k = 0; k < mlen; k += 8) {
+        memcpy(&dst[o + k], &dst[o - off + k], 8);
+      }
+    } else {
+      for (size_t k = 0; k < mlen; k++) {
+        dst[o + k] = dst[o - off + k];
+      }
+    }
+
+    o += mlen;
+  }
+
+  return o == len ? 0 : -1;
+}
+
+char *cold_fetch(int id) {
+  struct cold_store *cs = &config.cold;
+  cold_block *b = &cs->blocks[id];
+
+  cs->tick++;
+
+  if (id == cs->building) {
+    cs->hits++;
+    return cs->buf;
+  }
+
+  if (b->slot >= 0) {
+    cs->hits++;
+    cs->cache_used[b->slot] = cs->tick;
+    return cs->cache[b->slot];
+  }
+
+  cs->misses++;
+
+  int slot = 0;
+  for (int i = 0; i < COLD_CACHE_BLOCKS; i++) {
+    if (cs->cache_block[i] < 0) {
+      slot = i;
+      break;
+    }
+
+    if (cs->cache_used[i] < cs->cache_used[slot])
+      slot = i;
+  }
+
+  if (cs->cache_block[slot] >= 0)
+    cs->blocks[cs->cache_block[slot]].slot = -1;
+
+  if (cs->cache[slot] == NULL)
+    cs->cache[slot] = malloc(COLD_BLOCK_SIZE + LZ_WILD);
+
+  // corrupt bytes must never reach the rows, or a save would write them,
+  // so the editor stops with the edits kept in the journal
+  if (lz_decompress(b->data, b->csize, cs->cache[slot], b->size) == -1) {
+    errno = EIO;
+    die("cold block");
+  }
+
+  cs->cache_block[slot] = id;
+  cs->cache_used[slot] = cs->tick;
+  b->slot = slot;
+  return cs->cache[slot];
+}
+
+void cold_put(erow *row, const char *s, size_t len) {
+  struct cold_store *cs = &config.cold;
+
+  if (cs->building >= 0 && cs->buf_len + len + 1 > COLD_BLOCK_SIZE)
+    cold_flush();
+
+  if (cs->building < 0) {
+    if (cs->nfree > 0) {
+      cs->building = cs->free[--cs->nfree];
+    } else {
+      if (cs->nblocks == cs->cap) {
+        cs->cap = cs->cap ? cs->cap * 2 : 64;
+        cs->blocks = realloc(cs->blocks, sizeof(cold_block) * cs->cap);
+        cs->free = realloc(cs->free, sizeof(int) * cs->cap);
+      }
+
+      cs->building = cs->nblocks++;
+    }
+
+    if (cs->buf == NULL)
+      cs->buf = malloc(COLD_BLOCK_SIZE);
+
+    memset(&cs->blocks[cs->building], 0, sizeof(cold_block));
+    cs->blocks[cs->building].slot = -1;
+  }
+
+  cold_block *b = &cs->blocks[cs->building];
+  b->refs++;
+  b->live += len + 1;
+
+  // rows are followed by a null byte in the block as well
+  memcpy(&cs->buf[cs->buf_len], s, len);
+  cs->buf[cs->buf_len + len] = '\0';
+
+  row->off = cs->building;
+  row->pos = cs->buf_len;
+  row->flags = (row->flags & ~(ROW_PACKED | ROW_WARM)) | ROW_COLD;
+  cs->buf_len += len + 1;
+}
+
+void cold_flush() {
+  struct cold_store *cs = &config.cold;
+  int id = cs->building;
+
+  if (id < 0)
+    return;
+
+  cold_block *b = &cs->blocks[id];
+  b->size = cs->buf_len;
+  cs->building = -1;
+  cs->buf_len = 0;
+
+  if (b->refs == 0) {
+    cold_free_block(id);
+    return;
+  }
+
+  if (cs->zbuf == NULL)
+    cs->zbuf = malloc(lz_bound(COLD_BLOCK_SIZE));
+
+  b->csize = lz_compress(cs->buf, b->size, cs->zbuf);
+  b->data = malloc(b->csize + LZ_WILD);
+  memcpy(b->data, cs->zbuf, b->csize);
+  cs->compressed += b->csize;
+}
+
+void cold_freeze(erow *row) {
+  erow old = *row;
+
+  free_erow_render(row);
+  cold_put(row, row_peek(&old), old.size);
+  row_release(&old);
+}
+
+void cold_thaw(erow *row) {
+  erow old = *row;
+  char *chars = cold_fetch(row->off) + row->pos;
+  int cap;
+
+  row->off = arena_alloc(row->size + 1, &cap);
+  row->flags = (row->flags & ~ROW_COLD) | ROW_WARM;
+  memcpy(row_chars(row), chars, row->size + 1);
+  row_release(&old);
+  config.cold.hot += row->size;
+}
+
+void cold_unref(int id, int size) {
+  struct cold_store *cs = &config.cold;
+  cold_block *b = &cs->blocks[id];
+
+  b->refs--;
+  b->live -= size + 1;
+
+  if (b->refs == 0 && id != cs->building)
+    cold_free_block(id);
+}
+
+void cold_free_block(int id) {
+  struct cold_store *cs = &config.cold;
+  cold_block *b = &cs->blocks[id];
+
+  if (b->slot >= 0)
+    cs->cache_block[b->slot] = -1;
+
+  cs->compressed -= b->csize;
+  free(b->data);
+  b->data = NULL;
+  b->csize = 0;
+  b->slot = -1;
+  cs->free[cs->nfree++] = id;
+}
+
+void cold_sweep() {
+  struct cold_store *cs = &config.cold;
+  int sub;
+
+  if (cs->budget == 0 || cs->hot <= cs->limit)
+    return;
+
+  int first = screen_line_to_row(config.rowoff, &sub) - COLD_MARGIN;
+  int last =
+      screen_line_to_row(config.rowoff + config.rows - 1, &sub) + COLD_MARGIN;
+  size_t hot = 0;
+
+  for (int i = 0; i < config.numrows; i++) {
+    erow *row = &config.editor_rows[i];
+
+    if (row->flags & ROW_COLD) {
+      cold_block *b = &cs->blocks[row->off];
+
+      if ((int)row->off != cs->building && b->live * 2 < b->size)
+        cold_freeze(row);
+      continue;
+    }
+
+    if (row->size <= ROW_INLINE_SIZE || (row->flags & ROW_INTERNED))
+      continue;
+
+    if ((i >= first && i <= last) || i == config.cy ||
+        (row->flags & ROW_WARM) || row->size > COLD_ROW_MAX) {
+      row->flags &= ~ROW_WARM;
+      hot += row->size;
+      continue;
+    }
+
+    cold_freeze(row);
+  }
+
+  cold_flush();
+
+  // the next sweep waits for a quarter of the budget to be thawed,
+  // so rows which can't be compressed aren't looked at on every frame
+  cs->hot = hot;
+  cs->limit = hot + cs->budget / 4 > cs->budget ? hot + cs->budget / 4
+                                                 : cs->budget;
+}
+
+void cold_reset() {
+  struct cold_store *cs = &config.cold;
+
+  for (int i = 0; i < cs->nblocks; i++) {
+    free(cs->blocks[i].data);
+  }
+
+  for (int i = 0; i < COLD_CACHE_BLOCKS; i++) {
+    free(cs->cache[i]);
+  }
+
+  free(cs->blocks);
+  free(cs->free);
+  free(cs->buf);
+  free(cs->zbuf);
+
+  size_t budget = cs->budget;
+  memset(cs, 0, sizeof(*cs));
+  cs->budget = budget;
+  cs->limit = budget;
+  cs->building = -1;
+
+  for (int i = 0; i < COLD_CACHE_BLOCKS; i++) {
+    cs->cache_block[i] = -1;
+  }
+}
+
+char *row_chars(erow *row) {
+  if (row->flags & ROW_COLD)
+    cold_thaw(row);
+
+  if (row->flags & ROW_INTERNED)
+    return arena_ptr(row->off) + INTERN_HEADER;
+
+  if (row->size <= ROW_INLINE_SIZE)
+    return row->data;
+
+  if (row->size + 1 > ARENA_MAX_CLASS)
+    return arena_large_ptr(row->off);
+
+  return arena_ptr(row->off);
+}
+
+char *row_peek(erow *row) {
+  if (row->flags & ROW_COLD)
+    return cold_fetch(row->off) + row->pos;
+
+  return row_chars(row);
+}
+
+int row_cap(erow *row) {
+  size_t need = row->size + 1;
+
+  if (row->size <= ROW_INLINE_SIZE ||
+      (row->flags & (ROW_INTERNED | ROW_COLD)))
+    return 0;
+
+  if (need > ARENA_MAX_CLASS)
+    return arena_large_cap(row->off);
+
+  if (row->flags & ROW_PACKED)
+    return arena_packed_size(need);
+
+  return arena_class_size(arena_class(need));
+}
+
+void row_release(erow *row) {
+  if (row->flags & ROW_INTERNED)
+    intern_release(row->off);
+  else if (row->flags & ROW_COLD)
+    cold_unref(row->off, row->size);
+  else
+    arena_free(row->off, row_cap(row));
+}
+
+char *row_unshare(erow *row) {
+  if (row->flags & ROW_INTERNED)
+    return row_resize(row, row->size);
+
+  return row_chars(row);
+}
+
+void init_erow(erow *row, char *s, size_t len, int packed) {
+  int tabs = 0;
+  int wide = scan_row_bytes(s, len, &tabs);
+  int cap;
+
+  row->size = len;
+  row->flags = (tabs == 0 ? ROW_TAB_FREE : 0) | (wide == 0 ? ROW_ASCII : 0);
+  row->hl_start = HL_STATE_NONE;
+  row->hl_open = HL_STATE_NORMAL;
+  row->cache = 0;
+
+  // identical lines of a file share one copy in interning mode
+  if (packed && config.intern && intern_erow(row, s, len))
+    return;
+
+  // past three quarters of the budget, the rest of the file is
+  // compressed as it is loaded, leaving room for the rows thawed later
+  if (packed && config.cold.budget > 0 &&
+      config.cold.hot >= config.cold.budget / 4 * 3 &&
+      len > ROW_INLINE_SIZE && len <= COLD_ROW_MAX) {
+    cold_put(row, s, len);
+    return;
+  }
+
+  if (len > ROW_INLINE_SIZE)
+    config.cold.hot += len;
+
+  if (!packed)
+    row->flags |= ROW_WARM;
+
+  if (len > ROW_INLINE_SIZE && packed && len + 1 <= ARENA_MAX_CLASS) {
+    row->off = arena_alloc_packed(len + 1);
+    row->flags |= ROW_PACKED;
+  } else if (len > ROW_INLINE_SIZE) {
+    row->off = arena_alloc(len + 1, &cap);
+  }
+
+  char *chars = row_chars(row);
+  memcpy(chars, s, len);
+  chars[len] = '\0';
+}
+
+char *row_resize(erow *row, int size) {
+  char *chars = row_chars(row);
+  erow old = *row;
+  int cap = row_cap(row);
+  int keep = size < row->size ? size : row->size;
+  size_t want = size + 1;
+
+  if (size <= ROW_INLINE_SIZE) {
+    // the bytes share their place with the offset of the block,
+    // so they go back into the row through a copy
+    if (old.size > ROW_INLINE_SIZE) {
+      char bytes[ROW_INLINE_SIZE];
+      memcpy(bytes, chars, keep);
+      row_release(&old);
+      memcpy(row->data, bytes, keep);
+    }
+
+    chars = row->data;
+  } else if (want > ARENA_MAX_CLASS && cap > ARENA_MAX_CLASS) {
+    // long rows get a quarter more, so typing into them doesn't move
+    // them on every key, and keep their block until less than half
+    // of it is used
+    if (want > (size_t)cap || want * 2 < (size_t)cap)
+      arena_realloc_large(row->off, want + want / 4);
+
+    chars = arena_large_ptr(row->off);
+  } else if (cap == 0 || cap > ARENA_MAX_CLASS || want > ARENA_MAX_CLASS ||
+             (row->flags & ROW_PACKED) ||
+             arena_class(want) != arena_class(row->size + 1)) {
+    // the capacity follows from the size, so the row moves as soon as
+    // it needs another size class, and an interned line is never changed
+    int ncap;
+    uint32_t off =
+        arena_alloc(want > ARENA_MAX_CLASS ? want + want / 4 : want, &ncap);
+    char *moved = arena_block(off, ncap);
+
+    memcpy(moved, chars, keep);
+    row_release(&old);
+    row->off = off;
+    chars = moved;
+  }
+
+  row->flags = (row->flags & ~(ROW_PACKED | ROW_INTERNED)) | ROW_WARM;
+  row->size = size;
+  chars[size] = '\0';
+  return chars;
+}
+
+void row_scan_inserted(erow *row, const char *s, size_t len) {
+  if (!(row->flags & (ROW_TAB_FREE | ROW_ASCII)))
+    return;
+
+  int tabs = 0;
+  int wide = scan_row_bytes(s, len, &tabs);
+
+  if (tabs > 0)
+    row->flags &= ~ROW_TAB_FREE;
+  if (wide > 0)
+    row->flags &= ~ROW_ASCII;
+}
+
+void insert_erows(int at, int n, erow *rows) {
+  if (at < 0 || at > config.numrows || n == 0)
+    return;
+
+  put_erows(at, n, rows);
+  undo_record_rows(UNDO_INS_ROWS, at, n, NULL);
+}
+
+void reserve_erows(int n) {
+  if (n <= config.rowcap)
+    return;
+
+  int cap = config.rowcap ? config.rowcap : 16;
+  while (cap < n)
+    cap *= 2;
+
+  config.editor_rows = realloc(config.editor_rows, sizeof(erow) * cap);
+  config.rowcap = cap;
+}
+
+void append_erow(char *s, size_t len) {
+  reserve_erows(config.numrows + 1);
+
+  // rows loaded from a file are packed back to back
+  erow new_row;
+  init_erow(&new_row, s, len, 1);
+  config.editor_rows[config.numrows] = new_row;
+  undo_record_rows(UNDO_INS_ROWS, config.numrows, 1, NULL);
+  journal_record(JOURNAL_INS_ROW, config.numrows, 0, s, len);
+  invalidate_highlight(config.numrows);
+
+  if (config.wrap && !config.wrap_dirty)
+    fenwick_push(&config.wrap_index,
+                 wrap_row_height(&config.editor_rows[config.numrows]));
+
+  // the new row starts a block or joins the last one
+  if (!config.offsets_dirty && config.numrows % OFFSET_BLOCK_ROWS == 0)
+    fenwick_push(&config.offset_index, len + 1);
+  else if (!config.offsets_dirty)
+    fenwick_add(&config.offset_index, config.numrows / OFFSET_BLOCK_ROWS,
+                len + 1);
+
+  config.numrows++;
+  config.modified++;
+}
+
+void insert_erow(int at, char *s, size_t len) {
+  uint64_t trace_start = trace_now();
+
+  if (at < 0 || at > config.numrows)
+    return;
+
+  // s may point into a row stored inline, which the move below shifts
+  erow new_row;
+  init_erow(&new_row, s, len, 0);
+
+  reserve_erows(config.numrows + 1);
+
+  memmove(&config.editor_rows[at + 1], &config.editor_rows[at],
+          sizeof(erow) * (config.numrows - at));
+
+  config.editor_rows[at] = new_row;
+  update_erow(&config.editor_rows[at]);
+  undo_record_rows(UNDO_INS_ROWS, at, 1, NULL);
+  journal_record(JOURNAL_INS_ROW, at, 0, row_chars(&config.editor_rows[at]),
+                 len);
+  invalidate_highlight(at);
+  config.wrap_dirty = 1;
+  config.offsets_dirty = 1;
+  config.columns.gen++;
+
+  config.numrows++;
+  config.modified++;
+  filter_insert_rows(at, 1);
+  fold_insert_rows(at, 1);
+
+  trace_event_end(PROBE_EDIT, trace_start);
+}
+
+void delete_erow(int at) {
+  uint64_t trace_start = trace_now();
+
+  if (at < 0 || at >= config.numrows)
+    return;
+
+  erow *row = &config.editor_rows[at];
+  journal_record(JOURNAL_DEL_ROWS, at, 0, NULL, 1);
+
+  // the history keeps the row bytes instead of a copy of them
+  free_erow_render(row);
+  if (!undo_record_rows(UNDO_DEL_ROWS, at, 1, row))
+    row_release(row);
+
+  memmove(&config.editor_rows[at], &config.editor_rows[at + 1],
+          sizeof(erow) * (config.numrows - at - 1));
+  config.numrows--;
+  filter_delete_rows(at, 1);
+  fold_delete_rows(at, 1);
+  invalidate_highlight(at);
+  config.wrap_dirty = 1;
+  config.offsets_dirty = 1;
+  config.columns.gen++;
+  config.screen_dirty = 1;
+  config.modified++;
+
+  trace_event_end(PROBE_EDIT, trace_start);
+}
+
+void delete_erows(int at, int n) {
+  uint64_t trace_start = trace_now();
+
+  if (at < 0 || n <= 0 || at + n > config.numrows)
+    return;
+
+  erow *rows = &config.editor_rows[at];
+  journal_record(JOURNAL_DEL_ROWS, at, 0, NULL, n);
+
+  for (int i = 0; i < n; i++) {
+    free_erow_render(&rows[i]);
+  }
+
+  if (!undo_record_rows(UNDO_DEL_ROWS, at, n, rows)) {
+    for (int i = 0; i < n; i++) {
+      row_release(&rows[i]);
+    }
+  }
+
+  memmove(rows, &rows[n], sizeof(erow) * (config.numrows - at - n));
+  config.numrows -= n;
+  filter_delete_rows(at, n);
+  fold_delete_rows(at, n);
+  invalidate_highlight(at);
+  config.wrap_dirty = 1;
+  config.offsets_dirty = 1;
+  config.columns.gen++;
+  config.screen_dirty = 1;
+  config.modified++;
+
+  trace_event_end(PROBE_EDIT, trace_start);
+}
+
+int row_cx_to_rx(erow *row, int cx) {
+  // in column mode the fields are laid out in columns
+  if (config.columns.active)
+    return column_cx_to_rx(row - config.editor_rows, cx);
+
+  // rows with one column per byte need no render
+  if ((row->flags & (ROW_TAB_FREE | ROW_ASCII)) == (ROW_TAB_FREE | ROW_ASCII))
+    return cx;
+
+  return render_cx_to_rx(erow_render(row), cx);
+}
+
+int row_rx_to_cx(erow *row, int rx) {
+  if (config.columns.active)
+    return column_rx_to_cx(row - config.editor_rows, rx);
+
+  if ((row->flags & (ROW_TAB_FREE | ROW_ASCII)) == (ROW_TAB_FREE | ROW_ASCII))
+    return rx > row->size ? row->size : rx;
+
+  return render_rx_to_cx(erow_render(row), rx);
+}
+
+int row_width(erow *row) {
+  if ((row->flags & (ROW_TAB_FREE | ROW_ASCII)) == (ROW_TAB_FREE | ROW_ASCII))
+    return row->size;
+
+  // segmented rows are measured once and keep their render
+  if ((row->flags & ROW_HAS_RENDER) || row->size > SEGMENT_SIZE * 2)
+    return erow_render(row)->width;
+
+  return scratch_render(row)->width;
+}
+
+int render_cx_to_rx(row_render *r, int cx) {
+  if (r->nsegs > 0) {
+    erow_segment *seg = &r->segs[find_segment_by_cx(r, cx)];
+    return seg->rx + render_cx_to_rx(&seg->r, cx - seg->cx);
+  }
+
+  // finds the number of cells which start before cx
+  int lo = 0;
+  int hi = r->ncells;
+
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+
+    if (r->cells[mid].cx < cx)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if (lo == 0)
+    return cx;
+
+  cell_entry *prev = &r->cells[lo - 1];
+
+  // cx is inside a multi-byte character
+  if (cx < prev->cx + prev->len)
+    return render_cx_to_rx(r, prev->cx);
+
+  return prev->rx + (cx - prev->cx - prev->len);
+}
+
+int render_rx_to_cx(row_render *r, int rx) {
+  if (r->nsegs > 0) {
+    erow_segment *seg = &r->segs[find_segment_by_rx(r, rx)];
+    int cx = seg->cx + render_rx_to_cx(&seg->r, rx - seg->rx);
+    return cx > r->size ? r->size : cx;
+  }
+
+  // finds the number of cells which end at or before rx
+  int lo = 0;
+  int hi = r->ncells;
+
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+
+    if (r->cells[mid].rx <= rx)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  int base_cx = lo > 0 ? r->cells[lo - 1].cx + r->cells[lo - 1].len : 0;
+  int base_rx = lo > 0 ? r->cells[lo - 1].rx : 0;
+
+  // rx is inside the next cell
+  if (lo < r->ncells && base_rx + (r->cells[lo].cx - base_cx) <= rx)
+    return r->cells[lo].cx;
+
+  int cx = base_cx + (rx - base_rx);
+  return cx > r->size ? r->size : cx;
+}
+
+int render_rx_to_rbyte(row_render *r, int rx, int *col) {
+  int lo = 0;
+  int hi = r->ncells;
+
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+
+    if (r->cells[mid].rx <= rx)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  int base_cx = lo > 0 ? r->cells[lo - 1].cx + r->cells[lo - 1].len : 0;
+  int base_rbyte = lo > 0 ? r->cells[lo - 1].rbyte : 0;
+  int base_rx = lo > 0 ? r->cells[lo - 1].rx : 0;
+
+  if (lo < r->ncells) {
+    int gap = r->cells[lo].cx - base_cx;
+
+    if (base_rx + gap <= rx) {
+      *col = base_rx + gap;
+      return base_rbyte + gap;
+    }
+  }
+
+  *col = rx;
+  int rbyte = base_rbyte + (rx - base_rx);
+  return rbyte > r->rsize ? r->rsize : rbyte;
+}
+
+int row_next_cx(erow *row, int cx) {
+  char *chars = row_chars(row);
+
+  if (cx >= row->size)
+    return row->size;
+
+  cx++;
+  while (cx < row->size && (chars[cx] & 0xc0) == 0x80)
+    cx++;
+
+  return cx;
+}
+
+int row_prev_cx(erow *row, int cx) {
+  char *chars = row_chars(row);
+
+  if (cx <= 0)
+    return 0;
+
+  cx--;
+  while (cx > 0 && (chars[cx] & 0xc0) == 0x80)
+    cx--;
+
+  return cx;
+}
+
+void set_tab_stop(int tab_stop) {
+  if (tab_stop < 1 || tab_stop > 32)
+    return;
+
+  config.tab_stop = tab_stop;
+
+  for (int i = 0; i < config.numrows; i++) {
+    update_erow(&config.editor_rows[i]);
+  }
+
+  invalidate_highlight(0);
+  config.wrap_dirty = 1;
+}
+
+void row_updated(int at, int delta) {
+  invalidate_highlight(at);
+
+  // the field index of the row is built again when it is needed
+  if (config.columns.active)
+    config.columns.cache[at % COLUMN_CACHE_SLOTS].row = -1;
+
+  if (!config.offsets_dirty)
+    fenwick_add(&config.offset_index, at / OFFSET_BLOCK_ROWS, delta);
+
+  // only the height of the edited row changes in the wrap index
+  if (config.wrap && !config.wrap_dirty) {
+    long long height = wrap_row_height(&config.editor_rows[at]);
+    long long old_height = fenwick_prefix(&config.wrap_index, at + 1) -
+                           fenwick_prefix(&config.wrap_index, at);
+
+    if (height != old_height)
+      fenwick_add(&config.wrap_index, at, height - old_height);
+  }
+}
+
+void insert_char_at_row(erow *row, int at, char c) {
+  uint64_t trace_start = trace_now();
+
+  if (at < 0 || at > row->size)
+    at = row->size;
+
+  undo_record_text(UNDO_INS_TEXT, row - config.editor_rows, at, &c, 1);
+  journal_record(JOURNAL_INS_TEXT, row - config.editor_rows, at, &c, 1);
+
+  int old_size = row->size;
+  char *chars = row_resize(row, old_size + 1);
+  memmove(&chars[at + 1], &chars[at], old_size - at);
+  chars[at] = c;
+  row_scan_inserted(row, &c, 1);
+  update_erow_edit(row, at, 0, 1);
+  row_updated(row - config.editor_rows, 1);
+  config.modified++;
+
+  trace_event_end(PROBE_EDIT, trace_start);
+}
+
+void insert_str_at_row(erow *row, int at, char *c, size_t len) {
+  uint64_t trace_start = trace_now();
+
+  if (at < 0 || at > row->size)
+    return;
+
+  undo_record_text(UNDO_INS_TEXT, row - config.editor_rows, at, c, len);
+  journal_record(JOURNAL_INS_TEXT, row - config.editor_rows, at, c, len);
+
+  int old_size = row->size;
+  char *chars = row_resize(row, old_size + len);
+
+  memmove(&chars[at + len], &chars[at], old_size - at);
+  memcpy(&chars[at], c, len);
+
+  row_scan_inserted(row, c, len);
+  update_erow_edit(row, at, 0, len);
+  row_updated(row - config.editor_rows, len);
+  config.modified++;
+
+  trace_event_end(PROBE_EDIT, trace_start);
+}
+
+void remove_char_at_row(erow *row, int at) {
+  uint64_t trace_start = trace_now();
+
+  if (at < 0 || at >= row->size)
+    return;
+
+  char *chars = row_unshare(row);
+  undo_record_text(UNDO_DEL_TEXT, row - config.editor_rows, at, &chars[at], 1);
+  journal_record(JOURNAL_DEL_TEXT, row - config.editor_rows, at, NULL, 1);
+
+  memmove(&chars[at], &chars[at + 1], row->size - at - 1);
+  row_resize(row, row->size - 1);
+  update_erow_edit(row, at, 1, 0);
+  row_updated(row - config.editor_rows, -1);
+  config.modified++;
+
+  trace_event_end(PROBE_EDIT, trace_start);
+}
+
+void remove_str_at_row(erow *row, int at, size_t len) {
+  uint64_t trace_start = trace_now();
+
+  if (at < 0 || at >= row->size)
+    return;
+
+  if (len > (size_t)(row->size - at))
+    len = (size_t)(row->size - at);
+
+  char *chars = row_unshare(row);
+  undo_record_text(UNDO_DEL_TEXT, row - config.editor_rows, at, &chars[at],
+                   len);
+  journal_record(JOURNAL_DEL_TEXT, row - config.editor_rows, at, NULL, len);
+
+  memmove(&chars[at], &chars[at + len], row->size - at - len);
+  row_resize(row, row->size - len);
+  update_erow_edit(row, at, len, 0);
+  row_updated(row - config.editor_rows, -(int)len);
+  config.modified++;
+
+  trace_event_end(PROBE_EDIT, trace_start);
+}
+
+row_render *erow_render(erow *row) {
+  struct render_cache *rc = &config.renders;
+  row_render *r;
+
+  // the bytes of an inline row move with the rows array
+  if (row->flags & ROW_HAS_RENDER) {
+    r = rc->slots[row->cache];
+    r->chars = row_chars(row);
+    r->size = row->size;
+    return r;
+  }
+
+  if (rc->nfree > 0) {
+    row->cache = rc->free[--rc->nfree];
+  } else {
+    if (rc->nslots == rc->cap) {
+      rc->cap = rc->cap ? rc->cap * 2 : 256;
+      rc->slots = realloc(rc->slots, sizeof(row_render *) * rc->cap);
+      rc->free = realloc(rc->free, sizeof(int) * rc->cap);
+    }
+
+    row->cache = rc->nslots++;
+  }
+
+  r = calloc(1, sizeof(row_render));
+  r->chars = row_chars(row);
+  r->size = row->size;
+  render_row(r);
+  rc->slots[row->cache] = r;
+  rc->live++;
+  row->flags |= ROW_HAS_RENDER;
+
+  // the flags of an edited row may be stale, the render tells for sure
+  if (r->nsegs == 0 && r->ncells == 0)
+    row->flags |= ROW_TAB_FREE | ROW_ASCII;
+
+  // the row may have been lexed without a render already
+  if (config.syntax != NULL && row->hl_start != HL_STATE_NONE)
+    lex_render(r, row->hl_start);
+
+  return r;
+}
+
+row_render *scratch_render(erow *row) {
+  row_render *r = &config.scratch;
+
+  r->chars = row_peek(row);
+  r->size = row->size;
+  render_row(r);
+  return r;
+}
+
+void trim_render_cache() {
+  int sub;
+
+  if (config.renders.live <= RENDER_CACHE_LIMIT)
+    return;
+
+  int first = screen_line_to_row(config.rowoff, &sub);
+  int last = screen_line_to_row(config.rowoff + config.rows - 1, &sub);
+
+  for (int i = 0; i < config.numrows; i++) {
+    erow *row = &config.editor_rows[i];
+
+    if ((row->flags & ROW_HAS_RENDER) && (i < first || i > last) &&
+        i != config.cy)
+      free_erow_render(row);
+  }
+}
+
+void free_render_cache() {
+  struct render_cache *rc = &config.renders;
+
+  for (int i = 0; i < rc->nslots; i++) {
+    if (rc->slots[i] != NULL) {
+      free_render(rc->slots[i]);
+      free(rc->slots[i]);
+    }
+  }
+
+  free(rc->slots);
+  free(rc->free);
+  memset(rc, 0, sizeof(*rc));
+
+  free_render(&config.scratch);
+}
+
+void update_erow(erow *row) {
+  if (row->flags & ROW_HAS_RENDER)
+    render_row(erow_render(row));
+
+  row->hl_start = HL_STATE_NONE;
+  config.screen_dirty = 1;
+}
+
+void update_erow_edit(erow *row, int at, int removed, int inserted) {
+  if (!(row->flags & ROW_HAS_RENDER) || row->size <= SEGMENT_SIZE * 2) {
+    update_erow(row);
+    return;
+  }
+
+  row_render *r = erow_render(row);
+
+  if (r->nsegs == 0) {
+    update_erow(row);
+    return;
+  }
+
+  // the segments are still in the coordinates from before the edit
+  int delta = inserted - removed;
+  int first = find_segment_by_cx(r, at);
+  int last = removed > 0 ? find_segment_by_cx(r, at + removed - 1) : first;
+  int start = r->segs[first].cx;
+  int rx = r->segs[first].rx;
+  int end = r->segs[last].cx + r->segs[last].r.size + delta;
+
+  for (int i = first; i <= last; i++) {
+    free_render(&r->segs[i].r);
+  }
+
+  memmove(&r->segs[first], &r->segs[last + 1],
+          sizeof(erow_segment) * (r->nsegs - last - 1));
+  r->nsegs -= last - first + 1;
+
+  for (int i = first; i < r->nsegs; i++) {
+    r->segs[i].cx += delta;
+  }
+
+  if (end > start)
+    build_segments(r, first, start, end, rx);
+
+  sync_segments(r, first);
+  row->hl_start = HL_STATE_NONE;
+  config.screen_dirty = 1;
+}
+
+void build_segments(row_render *r, int seg, int start, int end, int rx) {
+  int count = 0;
+
+  // the first pass counts the pieces, the second one fills them
+  for (int pass = 0; pass < 2; pass++) {
+    int cx = start;
+    int n = 0;
+
+    while (cx < end) {
+      int piece_end = end;
+
+      if (end - cx > SEGMENT_SIZE * 2) {
+        piece_end = cx + SEGMENT_SIZE;
+
+        // never splits a UTF-8 character
+        while (piece_end < end && (r->chars[piece_end] & 0xc0) == 0x80)
+          piece_end++;
+      }
+
+      if (pass == 1) {
+        erow_segment *s = &r->segs[seg + n];
+        memset(s, 0, sizeof(erow_segment));
+        s->cx = cx;
+        s->rx = rx;
+        s->r.size = piece_end - cx;
+        s->r.chars = &r->chars[cx];
+        s->r.phase = rx % config.tab_stop;
+        s->r.hl_start = HL_STATE_NONE;
+        s->r.hl_open = HL_STATE_NORMAL;
+        render_row(&s->r);
+        rx += s->r.width;
+      }
+
+      cx = piece_end;
+      n++;
+    }
+
+    if (pass == 0) {
+      count = n;
+      r->segs = realloc(r->segs, sizeof(erow_segment) * (r->nsegs + count));
+      memmove(&r->segs[seg + count], &r->segs[seg],
+              sizeof(erow_segment) * (r->nsegs - seg));
+      r->nsegs += count;
+    }
+  }
+}
+
+void sync_segments(row_render *r, int from) {
+  int rx = from > 0 ? r->segs[from - 1].rx + r->segs[from - 1].r.width : 0;
+  int rsize = 0;
+
+  for (int i = 0; i < r->nsegs; i++) {
+    erow_segment *s = &r->segs[i];
+
+    // chars may have been moved by realloc
+    s->r.chars = &r->chars[s->cx];
+
+    if (i >= from) {
+      s->rx = rx;
+
+      // tabs of a segment depend on the column it starts at
+      if (rx % config.tab_stop != s->r.phase) {
+        s->r.phase = rx % config.tab_stop;
+
+        if (memchr(s->r.chars, '\t', s->r.size) != NULL)
+          render_row(&s->r);
+      }
+
+      rx += s->r.width;
+    }
+
+    rsize += s->r.rsize;
+  }
+
+  r->rsize = rsize;
+  r->width = rx;
+}
+
+void free_erow_render(erow *row) {
+  struct render_cache *rc = &config.renders;
+
+  if (!(row->flags & ROW_HAS_RENDER))
+    return;
+
+  free_render(rc->slots[row->cache]);
+  free(rc->slots[row->cache]);
+  rc->slots[row->cache] = NULL;
+  rc->free[rc->nfree++] = row->cache;
+  rc->live--;
+  row->flags &= ~ROW_HAS_RENDER;
+}
+
+void free_render(row_render *r) {
+  for (int i = 0; i < r->nsegs; i++) {
+    free_render(&r->segs[i].r);
+  }
+
+  free(r->segs);
+  arena_free(r->roff, r->rcap);
+  free(r->cells);
+  free(r->hl);
+  r->segs = NULL;
+  r->nsegs = 0;
+  r->render = NULL;
+  r->rcap = 0;
+  r->cells = NULL;
+  r->ncells = 0;
+  r->hl = NULL;
+  r->rsize = 0;
+  r->width = 0;
+}
+
+int find_segment_by_cx(row_render *r, int cx) {
+  int lo = 0;
+  int hi = r->nsegs - 1;
+
+  while (lo < hi) {
+    int mid = lo + (hi - lo + 1) / 2;
+
+    if (r->segs[mid].cx <= cx)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+
+  return lo;
+}
+
+int find_segment_by_rx(row_render *r, int rx) {
+  int lo = 0;
+  int hi = r->nsegs - 1;
+
+  while (lo < hi) {
+    int mid = lo + (hi - lo + 1) / 2;
+
+    if (r->segs[mid].rx <= rx)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+
+  return lo;
+}
+
+void render_row(row_render *row) {
+  uint64_t trace_start = trace_now();
+
+  if (row->size > SEGMENT_SIZE * 2) {
+    free_render(row);
+    build_segments(row, 0, 0, row->size, 0);
+    sync_segments(row, 0);
+    row->hl_start = HL_STATE_NONE;
+    trace_event_end(PROBE_RENDER_ROW, trace_start);
+    return;
+  }
+
+  if (row->nsegs > 0)
+    free_render(row);
+
+  int tabs = 0;
+  int wide = scan_row_bytes(row->chars, row->size, &tabs);
+
+  // an invalid byte is rendered as the 3 bytes long replacement character
+  size_t rneed = row->size + (tabs * (config.tab_stop - 1)) + wide * 2 + 1;
+
+  // the block is reused unless it is too small or much too big
+  if (row->rcap == 0 || rneed > (size_t)row->rcap ||
+      rneed * 2 < (size_t)row->rcap) {
+    arena_free(row->roff, row->rcap);
+    row->roff = arena_alloc(rneed, &row->rcap);
+    row->render = arena_block(row->roff, row->rcap);
+  }
+
+  // the cell index is rebuilt on every edit of the row, pure ASCII rows
+  // only have cells for their tabs
+  int max_cells = tabs + wide;
+  if (max_cells == 0) {
+    free(row->cells);
+    row->cells = NULL;
+  } else {
+    row->cells = realloc(row->cells, sizeof(cell_entry) * max_cells);
+  }
+
+  int j = 0;
+  int t = 0;
+  int col = 0;
+  int i = 0;
+  while (i < row->size) {
+    unsigned char c = row->chars[i];
+
+    if (c == '\t') {
+      row->render[j++] = ' ';
+      col++;
+
+      while ((col + row->phase) % config.tab_stop != 0) {
+        row->render[j++] = ' ';
+        col++;
+      }
+
+      row->cells[t++] = (cell_entry){i, 1, j, col};
+      i++;
+    } else if (c < 0x80) {
+      row->render[j++] = c;
+      col++;
+      i++;
+    } else {
+      unsigned int cp;
+      int len = utf8_decode(&row->chars[i], row->size - i, &cp);
+
+      if (len == 0) {
+        memcpy(&row->render[j], "\xef\xbf\xbd", 3);
+        j += 3;
+        col++;
+        len = 1;
+      } else {
+        memcpy(&row->render[j], &row->chars[i], len);
+        j += len;
+        col += codepoint_width(cp);
+      }
+
+      row->cells[t++] = (cell_entry){i, len, j, col};
+      i += len;
+    }
+  }
+
+  if (t != max_cells && t > 0)
+    row->cells = realloc(row->cells, sizeof(cell_entry) * t);
+  row->ncells = t;
+  row->width = col;
+
+  row->render[j] = '\0';
+  row->rsize = j;
+  row->hl_start = HL_STATE_NONE;
+
+  trace_event_end(PROBE_RENDER_ROW, trace_start);
+}
+
+int scan_row_bytes(const char *s, int len, int *tabs) {
+  int wide = 0;
+  int t = 0;
+  int i = 0;
+
+#ifdef __SSE2__
+  __m128i tab = _mm_set1_epi8('\t');
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)&s[i]);
+
+    // the mask has a bit for each byte with the high bit set
+    wide += __builtin_popcount(_mm_movemask_epi8(v));
+    t += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, tab)));
+  }
+#endif
+
+  for (; i < len; i++) {
+    if ((unsigned char)s[i] >= 0x80)
+      wide++;
+    else if (s[i] == '\t')
+      t++;
+  }
+
+  *tabs = t;
+  return wide;
+}
+
+int utf8_seq_len(int lead) {
+  if (lead < 0x80)
+    return 1;
+  if ((lead & 0xe0) == 0xc0)
+    return 2;
+  if ((lead & 0xf0) == 0xe0)
+    return 3;
+  if ((lead & 0xf8) == 0xf0)
+    return 4;
+
+  return 0;
+}
+
+int utf8_decode(const char *s, int len, unsigned int *cp) {
+  const unsigned char *u = (const unsigned char *)s;
+  int n = utf8_seq_len(u[0]);
+
+  if (n == 0 || n > len)
+    return 0;
+
+  unsigned int c = n == 1 ? u[0] : u[0] & (0x7f >> n);
+
+  for (int i = 1; i < n; i++) {
+    if ((u[i] & 0xc0) != 0x80)
+      return 0;
+
+    c = (c << 6) | (u[i] & 0x3f);
+  }
+
+  // rejects overlong forms, surrogates and code points out of range
+  static const unsigned int min_cp[] = {0, 0, 0x80, 0x800, 0x10000};
+  if (c < min_cp[n] || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff))
+    return 0;
+
+  *cp = c;
+  return n;
+}
+
+int codepoint_width(unsigned int cp) {
+  static const unsigned int zero_width[][2] = {
+      {0x0300, 0x036f}, {0x0483, 0x0489}, {0x0591, 0x05bd}, {0x0610, 0x061a},
+      {0x064b, 0x065f}, {0x0e31, 0x0e31}, {0x0e34, 0x0e3a}, {0x1ab0, 0x1aff},
+      {0x1dc0, 0x1dff}, {0x200b, 0x200f}, {0x20d0, 0x20ff}, {0xfe00, 0xfe0f},
+      {0xfe20, 0xfe2f}, {0xfeff, 0xfeff}};
+  static const unsigned int double_width[][2] = {
+      {0x1100, 0x115f},   {0x2e80, 0x303e},   {0x3041, 0x33ff},
+      {0x3400, 0x4dbf},   {0x4e00, 0x9fff},   {0xa000, 0xa4cf},
+      {0xac00, 0xd7a3},   {0xf900, 0xfaff},   {0xfe30, 0xfe4f},
+      {0xff00, 0xff60},   {0xffe0, 0xffe6},   {0x1f300, 0x1f64f},
+      {0x1f900, 0x1f9ff}, {0x20000, 0x3fffd}};
+
+  if (cp < 0x300)
+    return 1;
+
+  for (unsigned int i = 0; i < sizeof(zero_width) / sizeof(zero_width[0]);
+       i++) {
+    if (cp >= zero_width[i][0] && cp <= zero_width[i][1])
+      return 0;
+  }
+
+  for (unsigned int i = 0;
+       i < sizeof(double_width) / sizeof(double_width[0]); i++) {
+    if (cp >= double_width[i][0] && cp <= double_width[i][1])
+      return 2;
+  }
+
+  return 1;
+}
+
+int is_separator(int c) {
+  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];{}&|!?:", c) != NULL;
+}
+
+int lex_match(row_render *row, int i, const char *s, int len,
+              const char *next) {
+  for (int k = 0; k < len; k++) {
+    int at = i + k;
+    char c = at < row->rsize ? row->render[at]
+             : next != NULL  ? next[at - row->rsize]
+                             : '\0';
+
+    // the null byte ending the next render stops the loop as well
+    if (c != s[k])
+      return 0;
+  }
+
+  return 1;
+}
+
+int lex_highlight(row_render *row, int state, const char *next) {
+  editor_syntax *syntax = config.syntax;
+
+  row->hl = realloc(row->hl, row->rsize);
+  memset(row->hl, HL_NORMAL, row->rsize);
+  row->hl_start = state;
+
+  int i = state >> HL_STATE_SKIP;
+  state &= (1 << HL_STATE_SKIP) - 1;
+
+  if (state == HL_STATE_COMMENT) {
+    memset(row->hl, HL_COMMENT, row->rsize);
+    row->hl_open = HL_STATE_COMMENT;
+    return row->hl_open;
+  }
+
+  // the end of a comment delimiter started in the segment before
+  if (i > row->rsize)
+    i = row->rsize;
+  memset(row->hl, HL_MLCOMMENT, i);
+
+  char **keywords = syntax->keywords;
+  char *scs = syntax->singleline_comment_start;
+  char *mcs = syntax->multiline_comment_start;
+  char *mce = syntax->multiline_comment_end;
+
+  int scs_len = scs ? strlen(scs) : 0;
+  int mcs_len = mcs ? strlen(mcs) : 0;
+  int mce_len = mce ? strlen(mce) : 0;
+
+  int prev_sep = 1;
+  int in_string = 0;
+  int in_comment = state == HL_STATE_MLCOMMENT;
+  int in_line_comment = 0;
+  int escaped = 0;
+
+  if (state == HL_STATE_DQ_STRING || state == HL_STATE_DQ_ESCAPE)
+    in_string = '"';
+  else if (state == HL_STATE_SQ_STRING || state == HL_STATE_SQ_ESCAPE)
+    in_string = '\'';
+
+  // the byte after a backslash ending the segment before
+  if ((state == HL_STATE_DQ_ESCAPE || state == HL_STATE_SQ_ESCAPE) &&
+      i < row->rsize) {
+    row->hl[i] = HL_STRING;
+    i++;
+  }
+
+  while (i < row->rsize) {
+    unsigned char c = row->render[i];
+    unsigned char prev_hl = i > 0 ? row->hl[i - 1] : HL_NORMAL;
+
+    if (scs_len && !in_string && !in_comment) {
+      if (lex_match(row, i, scs, scs_len, next)) {
+        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
+        in_line_comment = 1;
+        break;
+      }
+    }
+
+    if (mcs_len && mce_len && !in_string) {
+      if (in_comment) {
+        row->hl[i] = HL_MLCOMMENT;
+
+        if (lex_match(row, i, mce, mce_len, next)) {
+          int n = i + mce_len <= row->rsize ? mce_len : row->rsize - i;
+          memset(&row->hl[i], HL_MLCOMMENT, n);
+          i += mce_len;
+          in_comment = 0;
+          prev_sep = 1;
+        } else {
+          i++;
+        }
+
+        continue;
+      } else if (lex_match(row, i, mcs, mcs_len, next)) {
+        int n = i + mcs_len <= row->rsize ? mcs_len : row->rsize - i;
+        memset(&row->hl[i], HL_MLCOMMENT, n);
+        i += mcs_len;
+        in_comment = 1;
+        continue;
+      }
+    }
+
+    if (syntax->flags & HL_HIGHLIGHT_STRINGS) {
+      if (in_string) {
+        row->hl[i] = HL_STRING;
+
+        if (c == '\\' && i + 1 < row->rsize) {
+          row->hl[i + 1] = HL_STRING;
+          i += 2;
+          continue;
+        }
+
+        // the escaped byte starts the next segment
+        if (c == '\\') {
+          escaped = 1;
+          i++;
+          continue;
+        }
+
+        if (c == in_string)
+          in_string = 0;
+
+        i++;
+        prev_sep = 1;
+        continue;
+      } else if (c == '"' || c == '\'') {
+        in_string = c;
+        row->hl[i] = HL_STRING;
+        i++;
+        continue;
+      }
+    }
+
+    if (syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+      if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
+          (c == '.' && prev_hl == HL_NUMBER)) {
+        row->hl[i] = HL_NUMBER;
+        i++;
+        prev_sep = 0;
+        continue;
+      }
+    }
+
+    if (prev_sep) {
+      int j;
+
+      for (j = 0; keywords[j]; j++) {
+        int klen = strlen(keywords[j]);
+        int type2 = keywords[j][klen - 1] == '|';
+
+        if (type2)
+          klen--;
+
+        if (i + klen <= row->rsize &&
+            !strncmp(&row->render[i], keywords[j], klen) &&
+            is_separator(i + klen < row->rsize
+                             ? (unsigned char)row->render[i + klen]
+                             : '\0')) {
+          memset(&row->hl[i], type2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
+          i += klen;
+          break;
+        }
+      }
+
+      if (keywords[j] != NULL) {
+        prev_sep = 0;
+        continue;
+      }
+    }
+
+    prev_sep = is_separator(c);
+    i++;
+  }
+
+  if (in_line_comment)
+    row->hl_open = HL_STATE_COMMENT;
+  else if (in_comment)
+    row->hl_open = HL_STATE_MLCOMMENT;
+  else if (in_string == '"')
+    row->hl_open = escaped ? HL_STATE_DQ_ESCAPE : HL_STATE_DQ_STRING;
+  else if (in_string == '\'')
+    row->hl_open = escaped ? HL_STATE_SQ_ESCAPE : HL_STATE_SQ_STRING;
+  else
+    row->hl_open = HL_STATE_NORMAL;
+
+  // a delimiter ending in the next segment
+  if (i > row->rsize && !in_line_comment)
+    row->hl_open |= (i - row->rsize) << HL_STATE_SKIP;
+
+  return row->hl_open;
+}
+
+int lex_render(row_render *r, int state) {
+  int open = state;
+
+  if (r->nsegs == 0)
+    return lex_highlight(r, state, NULL);
+
+  for (int i = 0; i < r->nsegs; i++) {
+    row_render *seg = &r->segs[i].r;
+    row_render *next = i + 1 < r->nsegs ? &r->segs[i + 1].r : NULL;
+
+    // only edited segments, the ones before them, whose end may be read
+    // differently, and the ones after them whose start state changed
+    // are lexed again
+    if (seg->hl_start != open ||
+        (next != NULL && next->hl_start == HL_STATE_NONE))
+      lex_highlight(seg, open, next != NULL ? next->render : NULL);
+
+    open = seg->hl_open;
+  }
+
+  return open;
+}
+
+int update_highlight(erow *row, int state) {
+  // rows out of the screen are lexed without keeping their render,
+  // only their end state is needed to lex the rows after them, but
+  // segmented rows keep it so their segments aren't lexed twice
+  row_render *r = (row->flags & ROW_HAS_RENDER) || row->size > SEGMENT_SIZE * 2
+                      ? erow_render(row)
+                      : scratch_render(row);
+  int open = lex_render(r, state);
+
+  row->hl_start = state;
+
+  // a string only stays open when the row ends with a backslash
+  if (open == HL_STATE_MLCOMMENT)
+    row->hl_open = HL_STATE_MLCOMMENT;
+  else if (open == HL_STATE_DQ_ESCAPE)
+    row->hl_open = HL_STATE_DQ_STRING;
+  else if (open == HL_STATE_SQ_ESCAPE)
+    row->hl_open = HL_STATE_SQ_STRING;
+  else
+    row->hl_open = HL_STATE_NORMAL;
+
+  return row->hl_open;
+}
+
+void invalidate_highlight(int at) {
+  if (at < config.hl_frontier)
+    config.hl_frontier = at < 0 ? 0 : at;
+}
+
+void ensure_highlight(int upto) {
+  if (config.syntax == NULL)
+    return;
+
+  if (upto >= config.numrows)
+    upto = config.numrows - 1;
+
+  while (config.hl_frontier <= upto) {
+    int at = config.hl_frontier;
+    erow *row = &config.editor_rows[at];
+    int state =
+        at > 0 ? config.editor_rows[at - 1].hl_open : HL_STATE_NORMAL;
+
+    // rows that were lexed with the same start state and haven't been
+    // edited since are still valid, which is where re-lexing converges
+    if (row->hl_start != state)
+      update_highlight(row, state);
+
+    config.hl_frontier++;
+  }
+}
+
+int syntax_to_color(int hl) {
+  switch (hl) {
+  case HL_COMMENT:
+  case HL_MLCOMMENT:
+    return 36;
+  case HL_KEYWORD1:
+    return 33;
+  case HL_KEYWORD2:
+    return 32;
+  case HL_STRING:
+    return 35;
+  case HL_NUMBER:
+    return 31;
+  default:
+    return 37;
+  }
+}
+
+void select_syntax_highlight() {
+  config.syntax = NULL;
+
+  if (config.filename != NULL) {
+    char *ext = strrchr(config.filename, '.');
+
+    for (unsigned int j = 0; j < HLDB_ENTRIES && config.syntax == NULL; j++) {
+      editor_syntax *s = &HLDB[j];
+
+      for (int i = 0; s->filematch[i]; i++) {
+        int is_ext = s->filematch[i][0] == '.';
+
+        if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+            (!is_ext && strstr(config.filename, s->filematch[i]))) {
+          config.syntax = s;
+          break;
+        }
+      }
+    }
+  }
+
+  for (int i = 0; i < config.numrows; i++) {
+    config.editor_rows[i].hl_start = HL_STATE_NONE;
+  }
+
+  config.hl_frontier = 0;
+  config.screen_dirty = 1;
+}
+
+uint32_t read_u32(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+void write_u32(unsigned char *p, uint32_t v) { memcpy(p, &v, sizeof(v)); }
+
+size_t undo_record_size(size_t offset) {
+  unsigned char *rec = &config.undo.log[offset];
+  size_t payload = rec[0] == UNDO_INS_TEXT || rec[0] == UNDO_DEL_TEXT
+                       ? read_u32(&rec[10])
+                   : rec[0] == UNDO_PERM_ROWS
+                       ? sizeof(uint32_t) * read_u32(&rec[10])
+                       : sizeof(erow *);
+
+  return UNDO_HEADER_SIZE + payload + UNDO_TRAILER_SIZE;
+}
+
+size_t erows_bytes(erow *rows, int n) {
+  size_t bytes = sizeof(erow) * n;
+
+  // short rows have their bytes inline, interned lines are shared
+  // and cold rows are counted with their block
+  for (int i = 0; i < n; i++) {
+    if (rows[i].size > ROW_INLINE_SIZE &&
+        !(rows[i].flags & (ROW_INTERNED | ROW_COLD)))
+      bytes += rows[i].size + 1;
+  }
+
+  return bytes;
+}
+
+void undo_begin_action() { config.undo.action++; }
+
+size_t undo_append(int type, int row, int col, size_t len, const void *payload,
+                   size_t payload_len) {
+  struct undo_history *h = &config.undo;
+  size_t size = UNDO_HEADER_SIZE + payload_len + UNDO_TRAILER_SIZE;
+
+  // a new action makes the undone ones unreachable
+  for (size_t off = h->len; off < h->end; off += undo_record_size(off)) {
+    undo_free_record(off, 1);
+  }
+  h->end = h->len;
+
+  if (h->end + size > h->cap) {
+    h->cap = h->cap ? h->cap * 2 : 4096;
+    while (h->end + size > h->cap)
+      h->cap *= 2;
+    h->log = realloc(h->log, h->cap);
+  }
+
+  size_t off = h->end;
+  unsigned char *rec = &h->log[off];
+  rec[0] = type;
+  rec[1] = h->len > 0 && h->action == h->last_action ? UNDO_CHAIN : 0;
+  write_u32(&rec[2], row);
+  write_u32(&rec[6], col);
+  write_u32(&rec[10], len);
+  memcpy(&rec[UNDO_HEADER_SIZE], payload, payload_len);
+  write_u32(&rec[size - UNDO_TRAILER_SIZE], size);
+
+  h->len = h->end = off + size;
+  h->last_action = h->action;
+  h->sealed = 0;
+  return off;
+}
+
+void undo_record_text(int type, int row, int col, const char *s, size_t len) {
+  struct undo_history *h = &config.undo;
+
+  if (h->paused)
+    return;
+
+  if (h->len > 0 && h->len == h->end && !h->sealed) {
+    size_t last_size = read_u32(&h->log[h->len - UNDO_TRAILER_SIZE]);
+    size_t last = h->len - last_size;
+    unsigned char *rec = &h->log[last];
+    uint32_t rcol = read_u32(&rec[6]);
+    uint32_t rlen = read_u32(&rec[10]);
+    int mode = 0;
+
+    // 1 appends to the text of the record, 2 prepends to it
+    if (rec[0] == type && read_u32(&rec[2]) == (uint32_t)row) {
+      if (type == UNDO_INS_TEXT && (uint32_t)col == rcol + rlen)
+        mode = 1;
+      else if (type == UNDO_DEL_TEXT && (uint32_t)col == rcol)
+        mode = 1;
+      else if (type == UNDO_DEL_TEXT && col + len == rcol)
+        mode = 2;
+    }
+
+    if (mode != 0) {
+      if (h->len + len > h->cap) {
+        while (h->len + len > h->cap)
+          h->cap *= 2;
+        h->log = realloc(h->log, h->cap);
+        rec = &h->log[last];
+      }
+
+      unsigned char *text = &rec[UNDO_HEADER_SIZE];
+
+      if (mode == 1) {
+        memcpy(&text[rlen], s, len);
+      } else {
+        memmove(&text[len], text, rlen);
+        memcpy(text, s, len);
+        write_u32(&rec[6], col);
+      }
+
+      write_u32(&rec[10], rlen + len);
+      write_u32(&text[rlen + len], last_size + len);
+      h->len = h->end = h->len + len;
+      h->last_action = h->action;
+      undo_trim();
+      return;
+    }
+  }
+
+  undo_append(type, row, col, len, s, len);
+  undo_trim();
+}
+
+int undo_record_rows(int type, int at, int n, erow *rows) {
+  struct undo_history *h = &config.undo;
+
+  if (h->paused)
+    return 0;
+
+  if (h->len > 0 && h->len == h->end && !h->sealed) {
+    size_t last = h->len - read_u32(&h->log[h->len - UNDO_TRAILER_SIZE]);
+    unsigned char *rec = &h->log[last];
+    uint32_t rrow = read_u32(&rec[2]);
+    uint32_t rlen = read_u32(&rec[10]);
+
+    // rows inserted next to or inside the last inserted range
+    if (rec[0] == UNDO_INS_ROWS && type == UNDO_INS_ROWS &&
+        (uint32_t)at >= rrow && (uint32_t)at <= rrow + rlen) {
+      write_u32(&rec[10], rlen + n);
+      h->last_action = h->action;
+      return 0;
+    }
+
+    // rows deleted right after or right before the last deleted range
+    if (rec[0] == UNDO_DEL_ROWS && type == UNDO_DEL_ROWS &&
+        ((uint32_t)at == rrow || (uint32_t)(at + n) == rrow)) {
+      erow *ref;
+      memcpy(&ref, &rec[UNDO_HEADER_SIZE], sizeof(ref));
+
+      uint32_t cap = read_u32(&rec[6]);
+
+      if (rlen + n > cap) {
+        while (cap < rlen + n)
+          cap *= 2;
+        ref = realloc(ref, sizeof(erow) * cap);
+        write_u32(&rec[6], cap);
+      }
+
+      if ((uint32_t)at == rrow) {
+        memcpy(&ref[rlen], rows, sizeof(erow) * n);
+      } else {
+        memmove(&ref[n], ref, sizeof(erow) * rlen);
+        memcpy(ref, rows, sizeof(erow) * n);
+        write_u32(&rec[2], at);
+      }
+
+      memcpy(&rec[UNDO_HEADER_SIZE], &ref, sizeof(ref));
+      write_u32(&rec[10], rlen + n);
+      h->ref_bytes += erows_bytes(rows, n);
+      h->last_action = h->action;
+      undo_trim();
+      return 1;
+    }
+  }
+
+  erow *ref = NULL;
+
+  if (type == UNDO_DEL_ROWS) {
+    ref = malloc(sizeof(erow) * n);
+    memcpy(ref, rows, sizeof(erow) * n);
+    h->ref_bytes += erows_bytes(rows, n);
+  }
+
+  undo_append(type, at, type == UNDO_DEL_ROWS ? n : 0, n, &ref, sizeof(ref));
+  undo_trim();
+  return type == UNDO_DEL_ROWS;
+}
+
+void undo_record_perm(int at, int n, const uint32_t *perm) {
+  if (config.undo.paused)
+    return;
+
+  undo_append(UNDO_PERM_ROWS, at, 0, n, perm, sizeof(uint32_t) * n);
+  undo_trim();
+}
+
+void undo_free_record(size_t offset, int free_chars) {
+  unsigned char *rec = &config.undo.log[offset];
+
+  if (rec[0] != UNDO_INS_ROWS && rec[0] != UNDO_DEL_ROWS)
+    return;
+
+  erow *ref;
+  memcpy(&ref, &rec[UNDO_HEADER_SIZE], sizeof(ref));
+
+  if (ref == NULL)
+    return;
+
+  int n = read_u32(&rec[10]);
+  config.undo.ref_bytes -= erows_bytes(ref, n);
+
+  for (int i = 0; i < n && free_chars; i++) {
+    row_release(&ref[i]);
+  }
+
+  free(ref);
+  ref = NULL;
+  memcpy(&rec[UNDO_HEADER_SIZE], &ref, sizeof(ref));
+}
+
+void undo_clear(int free_chars) {
+  struct undo_history *h = &config.undo;
+
+  for (size_t off = 0; off < h->end; off += undo_record_size(off)) {
+    undo_free_record(off, free_chars);
+  }
+
+  h->len = 0;
+  h->end = 0;
+  h->sealed = 1;
+}
+
+void undo_trim() {
+  struct undo_history *h = &config.undo;
+
+  if (h->end + h->ref_bytes <= h->limit)
+    return;
+
+  // drops down to three quarters of the limit, so the log
+  // isn't moved on every new record
+  size_t target = h->limit / 4 * 3;
+  size_t off = 0;
+
+  while (off < h->len && (h->end - off) + h->ref_bytes > target) {
+    undo_free_record(off, 1);
+    off += undo_record_size(off);
+  }
+
+  if (off == 0)
+    return;
+
+  memmove(h->log, &h->log[off], h->end - off);
+  h->len -= off;
+  h->end -= off;
+
+  if (h->end > 0)
+    h->log[1] &= ~UNDO_CHAIN;
+}
+
+int editor_undo() {
+  struct undo_history *h = &config.undo;
+
+  if (h->len == 0)
+    return 0;
+
+  h->paused = 1;
+
+  int chain;
+  do {
+    size_t off = h->len - read_u32(&h->log[h->len - UNDO_TRAILER_SIZE]);
+    unsigned char *rec = &h->log[off];
+    int row = read_u32(&rec[2]);
+    int col = read_u32(&rec[6]);
+    int n = read_u32(&rec[10]);
+    erow *ref;
+    uint32_t *perm;
+
+    switch (rec[0]) {
+    case UNDO_INS_TEXT:
+      remove_str_at_row(&config.editor_rows[row], col, n);
+      config.cx = col;
+      break;
+    case UNDO_DEL_TEXT:
+      insert_str_at_row(&config.editor_rows[row], col,
+                        (char *)&rec[UNDO_HEADER_SIZE], n);
+      config.cx = col + n;
+      break;
+    case UNDO_INS_ROWS:
+      ref = malloc(sizeof(erow) * n);
+      take_erows(row, n, ref);
+      h->ref_bytes += erows_bytes(ref, n);
+      memcpy(&rec[UNDO_HEADER_SIZE], &ref, sizeof(ref));
+      config.cx = 0;
+      break;
+    case UNDO_DEL_ROWS:
+      memcpy(&ref, &rec[UNDO_HEADER_SIZE], sizeof(ref));
+      h->ref_bytes -= erows_bytes(ref, n);
+      put_erows(row, n, ref);
+      free(ref);
+      ref = NULL;
+      memcpy(&rec[UNDO_HEADER_SIZE], &ref, sizeof(ref));
+      config.cx = 0;
+      break;
+    case UNDO_PERM_ROWS:
+      perm = malloc(sizeof(uint32_t) * n);
+      memcpy(perm, &rec[UNDO_HEADER_SIZE], sizeof(uint32_t) * n);
+      permute_erows(row, n, perm, 1);
+      free(perm);
+      config.cx = 0;
+      break;
+    }
+
+    config.cy = row;
+    chain = rec[1] & UNDO_CHAIN;
+    h->len = off;
+  } while (chain && h->len > 0);
+
+  h->paused = 0;
+  h->sealed = 1;
+  undo_trim();
+  return 1;
+}
+
+int editor_redo() {
+  struct undo_history *h = &config.undo;
+
+  if (h->len == h->end)
+    return 0;
+
+  h->paused = 1;
+
+  do {
+    size_t off = h->len;
+    unsigned char *rec = &h->log[off];
+    int row = read_u32(&rec[2]);
+    int col = read_u32(&rec[6]);
+    int n = read_u32(&rec[10]);
+    erow *ref;
+    uint32_t *perm;
+
+    switch (rec[0]) {
+    case UNDO_INS_TEXT:
+      insert_str_at_row(&config.editor_rows[row], col,
+                        (char *)&rec[UNDO_HEADER_SIZE], n);
+      config.cx = col + n;
+      break;
+    case UNDO_DEL_TEXT:
+      remove_str_at_row(&config.editor_rows[row], col, n);
+      config.cx = col;
+      break;
+    case UNDO_INS_ROWS:
+      memcpy(&ref, &rec[UNDO_HEADER_SIZE], sizeof(ref));
+      h->ref_bytes -= erows_bytes(ref, n);
+      put_erows(row, n, ref);
+      free(ref);
+      ref = NULL;
+      memcpy(&rec[UNDO_HEADER_SIZE], &ref, sizeof(ref));
+      config.cx = 0;
+      break;
+    case UNDO_DEL_ROWS:
+      ref = malloc(sizeof(erow) * n);
+      take_erows(row, n, ref);
+      h->ref_bytes += erows_bytes(ref, n);
+      memcpy(&rec[UNDO_HEADER_SIZE], &ref, sizeof(ref));
+      write_u32(&rec[6], n);
+      config.cx = 0;
+      break;
+    case UNDO_PERM_ROWS:
+      perm = malloc(sizeof(uint32_t) * n);
+      memcpy(perm, &rec[UNDO_HEADER_SIZE], sizeof(uint32_t) * n);
+      permute_erows(row, n, perm, 0);
+      free(perm);
+      config.cx = 0;
+      break;
+    }
+
+    config.cy = row;
+    h->len = off + undo_record_size(off);
+  } while (h->len < h->end && (h->log[h->len + 1] & UNDO_CHAIN));
+
+  h->paused = 0;
+  h->sealed = 1;
+  undo_trim();
+  return 1;
+}
+
+void take_erows(int at, int n, erow *dst) {
+  journal_record(JOURNAL_DEL_ROWS, at, 0, NULL, n);
+  memcpy(dst, &config.editor_rows[at], sizeof(erow) * n);
+  memmove(&config.editor_rows[at], &config.editor_rows[at + n],
+          sizeof(erow) * (config.numrows - at - n));
+  config.numrows -= n;
+
+  // only the chars are kept while the rows are out of the document
+  for (int i = 0; i < n; i++) {
+    free_erow_render(&dst[i]);
+  }
+
+  filter_delete_rows(at, n);
+
+  fold_delete_rows(at, n);
+  invalidate_highlight(at);
+  config.wrap_dirty = 1;
+  config.offsets_dirty = 1;
+  config.columns.gen++;
+  config.screen_dirty = 1;
+  config.modified++;
+}
+
+void put_erows(int at, int n, erow *src) {
+  reserve_erows(config.numrows + n);
+  memmove(&config.editor_rows[at + n], &config.editor_rows[at],
+          sizeof(erow) * (config.numrows - at));
+  memcpy(&config.editor_rows[at], src, sizeof(erow) * n);
+  config.numrows += n;
+
+  for (int i = 0; i < n; i++) {
+    erow *row = &config.editor_rows[at + i];
+    update_erow(row);
+    journal_record(JOURNAL_INS_ROW, at + i, 0, row_chars(row), row->size);
+  }
+
+  filter_insert_rows(at, n);
+
+  fold_insert_rows(at, n);
+  invalidate_highlight(at);
+  config.wrap_dirty = 1;
+  config.offsets_dirty = 1;
+  config.columns.gen++;
+  config.screen_dirty = 1;
+  config.modified++;
+}
+
+char *journal_path(const char *filename) {
+  const char *base = strrchr(filename, '/');
+  int dirlen = base ? base - filename + 1 : 0;
+  base = base ? base + 1 : filename;
+
+  char *path = malloc(dirlen + strlen(base) + 6);
+  sprintf(path, "%.*s.%s.swp", dirlen, filename, base);
+  return path;
+}
+
+void journal_open(int offer_replay) {
+  struct journal *j = &config.journal;
+  struct stat st;
+
+  if (config.filename == NULL || stat(config.filename, &st) == -1)
+    return;
+
+  j->path = journal_path(config.filename);
+  j->fd = open(j->path, O_RDWR | O_CREAT, 0600);
+
+  if (j->fd == -1) {
+    free(j->path);
+    j->path = NULL;
+    return;
+  }
+
+  if (j->buf == NULL) {
+    j->cap = JOURNAL_BATCH_SIZE * 2;
+    j->buf = malloc(j->cap);
+  }
+
+  struct stat jst;
+  unsigned char *data = NULL;
+  size_t header = 0;
+  size_t valid = 0;
+
+  if (offer_replay && fstat(j->fd, &jst) != -1 && jst.st_size > 4) {
+    data = malloc(jst.st_size);
+
+    if (pread(j->fd, data, jst.st_size, 0) == jst.st_size &&
+        memcmp(data, JOURNAL_MAGIC, 4) == 0) {
+      uint64_t size, mtime;
+      int n = journal_get_varint(data + 4, jst.st_size - 4, &size);
+      int m = n ? journal_get_varint(data + 4 + n, jst.st_size - 4 - n, &mtime)
+                : 0;
+
+      // the journal only applies to the version of the file it started from
+      if (m && size == (uint64_t)st.st_size &&
+          mtime == (uint64_t)st.st_mtime && jst.st_size > 4 + n + m)
+        header = 4 + n + m;
+    }
+  }
+
+  if (header > 0) {
+    char *answer = editor_prompt(
+        "Found unsaved changes of this file, recover them? (y/n) %s", "");
+
+    if (answer != NULL && (answer[0] == 'y' || answer[0] == 'Y')) {
+      j->paused = 1;
+      config.undo.paused = 1;
+      valid = header + journal_replay(data + header, jst.st_size - header);
+      config.undo.paused = 0;
+      j->paused = 0;
+      set_status_msg("Recovered the unsaved changes from %s.", j->path);
+    }
+
+    free(answer);
+  }
+
+  free(data);
+
+  if (valid > 0) {
+    // a torn record at the end would make the next records unreadable
+    if (ftruncate(j->fd, valid) == -1)
+      die("ftruncate");
+    lseek(j->fd, 0, SEEK_END);
+  } else {
+    journal_reset();
+  }
+}
+
+void journal_close(int remove) {
+  struct journal *j = &config.journal;
+
+  if (j->fd == -1)
+    return;
+
+  if (remove) {
+    unlink(j->path);
+    j->len = 0;
+  } else {
+    journal_flush(1);
+  }
+
+  close(j->fd);
+  free(j->path);
+  j->fd = -1;
+  j->path = NULL;
+}
+
+void journal_reset() {
+  struct journal *j = &config.journal;
+  struct stat st;
+
+  if (j->fd == -1 || stat(config.filename, &st) == -1)
+    return;
+
+  j->base_rows = config.follow.active ? config.follow.lines : 0;
+  journal_put_header(&st);
+
+  if (ftruncate(j->fd, 0) == -1)
+    die("ftruncate");
+  lseek(j->fd, 0, SEEK_SET);
+  journal_flush(1);
+}
+
+void journal_put_header(struct stat *st) {
+  struct journal *j = &config.journal;
+
+  j->len = 0;
+  memcpy(j->buf, JOURNAL_MAGIC, 4);
+  j->len = 4;
+  journal_put_varint(st->st_size);
+  journal_put_varint(st->st_mtime);
+
+  // the rows loaded from this version past the ones the edits apply to
+  int rows = config.follow.active ? follow_file_rows(st->st_size) : 0;
+
+  if (rows > j->base_rows) {
+    int paused = j->paused;
+
+    j->paused = 0;
+    journal_record(JOURNAL_DEL_ROWS, j->base_rows, 0, NULL,
+                   rows - j->base_rows);
+    j->paused = paused;
+  }
+
+  j->base = j->len;
+}
+
+void journal_rebase() {
+  struct journal *j = &config.journal;
+  struct stat st;
+
+  if (j->fd == -1 || stat(config.filename, &st) == -1)
+    return;
+
+  journal_flush(0);
+
+  size_t base = j->base;
+  off_t end = lseek(j->fd, 0, SEEK_END);
+  size_t size = end > (off_t)base ? end - base : 0;
+  char *records = malloc(size + 1);
+  char *path = malloc(strlen(j->path) + 2);
+  sprintf(path, "%s~", j->path);
+
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+
+  if (fd == -1 || pread(j->fd, records, size, base) != (ssize_t)size) {
+    if (fd != -1) {
+      close(fd);
+      unlink(path);
+    }
+    free(records);
+    free(path);
+    return;
+  }
+
+  journal_put_header(&st);
+
+  if (write_all(fd, j->buf, j->len) == -1 ||
+      write_all(fd, records, size) == -1 || fdatasync(fd) == -1 ||
+      rename(path, j->path) == -1) {
+    // the old journal stays, without the rows appended since
+    close(fd);
+    unlink(path);
+    j->base = base;
+  } else {
+    close(j->fd);
+    j->fd = fd;
+    lseek(j->fd, 0, SEEK_END);
+    j->unsynced = 0;
+    j->last_sync = time(NULL);
+  }
+
+  j->len = 0;
+  free(records);
+  free(path);
+}
+
+void journal_put_varint(uint64_t v) {
+  struct journal *j = &config.journal;
+
+  do {
+    unsigned char byte = v & 0x7f;
+    v >>= 7;
+    j->buf[j->len++] = byte | (v ? 0x80 : 0);
+  } while (v);
+}
+
+int journal_get_varint(const unsigned char *p, size_t len, uint64_t *v) {
+  *v = 0;
+
+  for (size_t i = 0; i < len && i < 10; i++) {
+    *v |= (uint64_t)(p[i] & 0x7f) << (7 * i);
+    if (!(p[i] & 0x80))
+      return i + 1;
+  }
+
+  return 0;
+}
+
+void journal_record(int type, int row, int col, const char *s, size_t len) {
+  struct journal *j = &config.journal;
+
+  if (j->fd == -1 || j->paused)
+    return;
+
+  // 4 variable-length integers take at most 40 bytes
+  size_t need = j->len + 41 + (s ? len : 0);
+
+  if (need > j->cap) {
+    while (need > j->cap)
+      j->cap *= 2;
+    j->buf = realloc(j->buf, j->cap);
+  }
+
+  j->buf[j->len++] = type;
+  journal_put_varint(row);
+  journal_put_varint(col);
+  journal_put_varint(len);
+
+  if (s != NULL) {
+    memcpy(&j->buf[j->len], s, len);
+    j->len += len;
+  }
+
+  if (j->len >= JOURNAL_BATCH_SIZE)
+    journal_flush(0);
+}
+
+void journal_flush(int sync) {
+  struct journal *j = &config.journal;
+
+  if (j->fd == -1)
+    return;
+
+  size_t done = 0;
+
+  while (done < j->len) {
+    ssize_t n = write(j->fd, &j->buf[done], j->len - done);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    done += n;
+  }
+
+  if (done > 0)
+    j->unsynced = 1;
+  j->len = 0;
+
+  if (sync && j->unsynced) {
+    fdatasync(j->fd);
+    j->unsynced = 0;
+    j->last_sync = time(NULL);
+  }
+}
+
+void journal_idle() {
+  struct journal *j = &config.journal;
+
+  if (j->fd == -1 || (j->len == 0 && !j->unsynced))
+    return;
+
+  journal_flush(time(NULL) - j->last_sync >= JOURNAL_SYNC_INTERVAL);
+}
+
+size_t journal_replay(const unsigned char *data, size_t len) {
+  size_t off = 0;
+
+  while (off < len) {
+    uint64_t v[3];
+    size_t pos = off + 1;
+    int ok = 1;
+
+    for (int i = 0; i < 3 && ok; i++) {
+      int n = journal_get_varint(data + pos, len - pos, &v[i]);
+      ok = n > 0;
+      pos += n;
+    }
+
+    int type = data[off];
+    uint64_t row = v[0], col = v[1], n = v[2];
+
+    if (!ok || ((type == JOURNAL_INS_TEXT || type == JOURNAL_INS_ROW ||
+                 type == JOURNAL_PERM_ROWS) &&
+                n > len - pos))
+      break;
+
+    // stops at the first record which doesn't fit the document
+    if (type == JOURNAL_INS_TEXT && row < (uint64_t)config.numrows &&
+        col <= (uint64_t)config.editor_rows[row].size) {
+      insert_str_at_row(&config.editor_rows[row], col, (char *)data + pos, n);
+      pos += n;
+    } else if (type == JOURNAL_DEL_TEXT && row < (uint64_t)config.numrows &&
+               col + n <= (uint64_t)config.editor_rows[row].size) {
+      remove_str_at_row(&config.editor_rows[row], col, n);
+    } else if (type == JOURNAL_INS_ROW && row <= (uint64_t)config.numrows) {
+      insert_erow(row, (char *)data + pos, n);
+      pos += n;
+    } else if (type == JOURNAL_DEL_ROWS && row + n <= (uint64_t)config.numrows) {
+      delete_erows(row, n);
+    } else if (type == JOURNAL_PERM_ROWS && n % sizeof(uint32_t) == 0 &&
+               row + n / sizeof(uint32_t) <= (uint64_t)config.numrows) {
+      int count = n / sizeof(uint32_t);
+      uint32_t *perm = malloc(n + 1);
+      char *seen = calloc(count + 1, 1);
+      int valid = 1;
+
+      // a damaged record could move a row twice
+      memcpy(perm, data + pos, n);
+      for (int i = 0; i < count && valid; i++) {
+        valid = perm[i] < (uint32_t)count && !seen[perm[i]];
+        if (valid)
+          seen[perm[i]] = 1;
+      }
+
+      if (valid)
+        permute_erows(row, count, perm, 0);
+
+      free(perm);
+      free(seen);
+
+      if (!valid)
+        break;
+      pos += n;
+    } else {
+      break;
+    }
+
+    off = pos;
+  }
+
+  return off;
+}
+
+void handle_signal(int sig) {
+  config.pending_signal = sig;
+}
+
+void journal_signaled() {
+  int sig = config.pending_signal;
+
+  if (sig == 0)
+    return;
+
+  journal_flush(1);
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+char *probe_names[PROBE_COUNT] = {"input", "key", "edit", "render_row",
+                                  "draw_rows", "write", "frame"};
+
+uint64_t trace_now() {
+  if (config.trace.events == NULL)
+    return 0;
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void trace_event_end(int probe, uint64_t start) {
+  struct trace *t = &config.trace;
+
+  if (t->events == NULL)
+    return;
+
+  trace_event *e = &t->events[t->nevents++ & (TRACE_EVENTS - 1)];
+  e->start = start;
+  e->dur = trace_now() - start;
+  e->probe = probe;
+}
+
+void trace_frame_end(uint64_t start, size_t written) {
+  struct trace *t = &config.trace;
+
+  if (t->frames == NULL)
+    return;
+
+  trace_frame *f = &t->frames[t->nframes++ & (TRACE_FRAMES - 1)];
+  f->start = start;
+  f->allocs = t->allocs;
+  f->alloc_bytes = t->alloc_bytes;
+  f->written = written;
+  t->allocs = 0;
+  t->alloc_bytes = 0;
+}
+
+void *trace_malloc(size_t size) {
+  config.trace.allocs++;
+  config.trace.alloc_bytes += size;
+  return (malloc)(size);
+}
+
+void *trace_realloc(void *ptr, size_t size) {
+  config.trace.allocs++;
+  config.trace.alloc_bytes += size;
+  return (realloc)(ptr, size);
+}
+
+void *trace_calloc(size_t count, size_t size) {
+  config.trace.allocs++;
+  config.trace.alloc_bytes += count * size;
+  return (calloc)(count, size);
+}
+
+char *trace_strdup(const char *s) {
+  config.trace.allocs++;
+  config.trace.alloc_bytes += strlen(s) + 1;
+  return (strdup)(s);
+}
+
+char *trace_strndup(const char *s, size_t n) {
+  config.trace.allocs++;
+  config.trace.alloc_bytes += strnlen(s, n) + 1;
+  return (strndup)(s, n);
+}
+
+int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+int trace_percentiles(int probe, uint64_t *p50, uint64_t *p99) {
+  struct trace *t = &config.trace;
+  uint64_t durs[TRACE_WINDOW];
+  int n = 0;
+  uint64_t window = t->nevents < TRACE_WINDOW ? t->nevents : TRACE_WINDOW;
+
+  for (uint64_t i = t->nevents - window; i < t->nevents; i++) {
+    trace_event *e = &t->events[i & (TRACE_EVENTS - 1)];
+    if (e->probe == (uint32_t)probe)
+      durs[n++] = e->dur;
+  }
+
+  *p50 = 0;
+  *p99 = 0;
+
+  if (n == 0)
+    return 0;
+
+  qsort(durs, n, sizeof(uint64_t), compare_u64);
+  *p50 = durs[n / 2];
+  *p99 = durs[n * 99 / 100];
+  return n;
+}
+
+void draw_trace_overlay(struct ap_buf *buf) {
+  char line[256];
+  int len = 0;
+
+  // latencies are shown as p50/p99 in microseconds
+  for (int p = 0; p < PROBE_COUNT && len < (int)sizeof(line); p++) {
+    uint64_t p50, p99;
+
+    if (trace_percentiles(p, &p50, &p99) == 0)
+      continue;
+
+    len += snprintf(&line[len], sizeof(line) - len, "%s %llu/%llu ",
+                    probe_names[p], (unsigned long long)p50 / 1000,
+                    (unsigned long long)p99 / 1000);
+  }
+
+  struct trace *t = &config.trace;
+
+  if (t->nframes > 0 && len < (int)sizeof(line)) {
+    trace_frame *f = &t->frames[(t->nframes - 1) & (TRACE_FRAMES - 1)];
+    len += snprintf(&line[len], sizeof(line) - len, "| %u allocs %uB, %uB out",
+                    f->allocs, f->alloc_bytes, f->written);
+  }
+
+  if (len > (int)sizeof(line) - 1)
+    len = sizeof(line) - 1;
+  if (len > config.cols)
+    len = config.cols;
+
+  ap_buf_append(buf, line, len);
+}
+
+int trace_dump(char *filename) {
+  struct trace *t = &config.trace;
+
+  if (t->events == NULL)
+    return -1;
+
+  FILE *f = fopen(filename, "w");
+
+  if (!f)
+    return -1;
+
+  fprintf(f, "{\"traceEvents\":[\n");
+
+  uint64_t first = t->nevents > TRACE_EVENTS ? t->nevents - TRACE_EVENTS : 0;
+  int comma = 0;
+
+  // complete events with timestamps and durations in microseconds
+  for (uint64_t i = first; i < t->nevents; i++) {
+    trace_event *e = &t->events[i & (TRACE_EVENTS - 1)];
+    fprintf(f,
+            "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+            "\"pid\":1,\"tid\":1}",
+            comma ? ",\n" : "", probe_names[e->probe], e->start / 1000.0,
+            e->dur / 1000.0);
+    comma = 1;
+  }
+
+  first = t->nframes > TRACE_FRAMES ? t->nframes - TRACE_FRAMES : 0;
+
+  // the frame statistics as counters
+  for (uint64_t i = first; i < t->nframes; i++) {
+    trace_frame *fr = &t->frames[i & (TRACE_FRAMES - 1)];
+    fprintf(f,
+            "%s{\"name\":\"frame\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":1,"
+            "\"args\":{\"allocs\":%u,\"alloc_bytes\":%u,\"written\":%u}}",
+            comma ? ",\n" : "", fr->start / 1000.0, fr->allocs,
+            fr->alloc_bytes, fr->written);
+    comma = 1;
+  }
+
+  fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+  return fclose(f) == 0 ? 0 : -1;
+}
+
+char *mem_names[MEM_COUNT] = {"chars",   "render", "editor_rows",
+                              "search",  "undo",   "journal",
+                              "trace",   "wrap",   "offsets",
+                              "columns", "folds",  "intern",
+                              "cold",    "arena"};
+
+void mem_account(mem_usage *usage, void *ptr, size_t used) {
+  if (ptr == NULL)
+    return;
+
+  usage->allocs++;
+  usage->bytes += malloc_usable_size(ptr);
+  usage->used += used;
+}
+
+void mem_account_block(mem_report *report, int subsystem, size_t cap,
+                       size_t used) {
+  if (cap == 0)
+    return;
+
+  report->usage[subsystem].allocs++;
+  report->usage[subsystem].bytes += cap;
+  report->usage[subsystem].used += used;
+  report->usage[MEM_ARENA].bytes -= cap;
+}
+
+void mem_account_render(mem_report *report, row_render *r) {
+  mem_usage *usage = &report->usage[MEM_RENDER];
+
+  mem_account_block(report, MEM_RENDER, r->rcap, r->rsize + 1);
+  mem_account(usage, r->cells, sizeof(cell_entry) * r->ncells);
+  mem_account(usage, r->hl, r->rsize);
+  mem_account(usage, r->segs, sizeof(erow_segment) * r->nsegs);
+
+  for (int i = 0; i < r->nsegs; i++) {
+    mem_account_render(report, &r->segs[i].r);
+  }
+}
+
+void collect_mem_usage(mem_report *report) {
+  mem_usage *usage = report->usage;
+  memset(usage, 0, sizeof(mem_usage) * MEM_COUNT);
+
+  // the arena starts with every byte it took from the heap, and each
+  // block is taken out of it
+  struct row_arena *a = &config.arena;
+  usage[MEM_ARENA].allocs = a->nchunks + a->nlarge - a->nfree_large;
+  usage[MEM_ARENA].bytes = a->reserved;
+
+  for (int i = 0; i < config.numrows; i++) {
+    erow *row = &config.editor_rows[i];
+    mem_account_block(report, MEM_CHARS, row_cap(row), row->size + 1);
+  }
+
+  // only the rows which have been drawn keep a render
+  struct render_cache *rc = &config.renders;
+  mem_account(&usage[MEM_RENDER], rc->slots, sizeof(row_render *) * rc->nslots);
+
+  for (int i = 0; i < rc->nslots; i++) {
+    mem_account(&usage[MEM_RENDER], rc->slots[i], sizeof(row_render));
+
+    if (rc->slots[i] != NULL)
+      mem_account_render(report, rc->slots[i]);
+  }
+
+  mem_account_render(report, &config.scratch);
+
+  // interned lines are counted once, however many rows share them
+  struct intern_table *t = &config.interned;
+  mem_account(&usage[MEM_INTERN], t->slots, sizeof(intern_slot) * t->count);
+
+  for (int i = 0; i < t->cap; i++) {
+    if (t->slots[i].line == ARENA_NONE)
+      continue;
+
+    uint32_t size;
+    memcpy(&size, arena_ptr(t->slots[i].line) + 2 * sizeof(uint32_t),
+           sizeof(size));
+    mem_account_block(report, MEM_INTERN,
+                      arena_packed_size(INTERN_HEADER + size + 1), size + 1);
+  }
+
+  // cold blocks are counted compressed, and the rows still pointing
+  // into them are what is used of their decompressed size
+  struct cold_store *cs = &config.cold;
+  report->cold_blocks = 0;
+  report->cold_size = 0;
+  report->cold_hits = cs->hits;
+  report->cold_misses = cs->misses;
+  mem_account(&usage[MEM_COLD], cs->blocks, sizeof(cold_block) * cs->nblocks);
+  mem_account(&usage[MEM_COLD], cs->free, sizeof(int) * cs->nfree);
+  mem_account(&usage[MEM_COLD], cs->buf, cs->buf_len);
+  mem_account(&usage[MEM_COLD], cs->zbuf, 0);
+
+  for (int i = 0; i < cs->nblocks; i++) {
+    cold_block *b = &cs->blocks[i];
+
+    if (b->data == NULL)
+      continue;
+
+    mem_account(&usage[MEM_COLD], b->data,
+                (size_t)b->csize * b->live / b->size);
+    report->cold_blocks++;
+    report->cold_size += b->size;
+  }
+
+  for (int i = 0; i < COLD_CACHE_BLOCKS; i++) {
+    int id = cs->cache_block[i];
+    mem_account(&usage[MEM_COLD], cs->cache[i],
+                id >= 0 ? cs->blocks[id].size : 0);
+  }
+
+  mem_account(&usage[MEM_ROWS], config.editor_rows,
+              sizeof(erow) * config.numrows);
+
+  if (config.search_match_found > 0)
+    mem_account(&usage[MEM_SEARCH], config.search_matches,
+                sizeof(search_match) * config.search_match_found);
+
+  if (config.filter.active)
+    mem_account(&usage[MEM_SEARCH], config.filter.rows,
+                sizeof(int) * config.filter.count);
+
+  // the log and the rows its records hold out of the document
+  struct undo_history *h = &config.undo;
+  mem_account(&usage[MEM_UNDO], h->log, h->end);
+
+  for (size_t off = 0; off < h->end; off += undo_record_size(off)) {
+    unsigned char *rec = &h->log[off];
+
+    if (rec[0] != UNDO_INS_ROWS && rec[0] != UNDO_DEL_ROWS)
+      continue;
+
+    erow *ref;
+    memcpy(&ref, &rec[UNDO_HEADER_SIZE], sizeof(ref));
+
+    if (ref == NULL)
+      continue;
+
+    int n = read_u32(&rec[10]);
+    mem_account(&usage[MEM_UNDO], ref, sizeof(erow) * n);
+
+    for (int i = 0; i < n; i++) {
+      mem_account_block(report, MEM_UNDO, row_cap(&ref[i]), ref[i].size + 1);
+    }
+  }
+
+  mem_account(&usage[MEM_JOURNAL], config.journal.buf, config.journal.len);
+  mem_account(&usage[MEM_TRACE], config.trace.events,
+              sizeof(trace_event) * TRACE_EVENTS);
+  mem_account(&usage[MEM_TRACE], config.trace.frames,
+              sizeof(trace_frame) * TRACE_FRAMES);
+  mem_account(&usage[MEM_OFFSETS], config.offset_index.tree,
+              sizeof(long long) * (config.offset_index.size + 1));
+  mem_account(&usage[MEM_WRAP], config.wrap_index.tree,
+              sizeof(long long) * (config.wrap_index.size + 1));
+
+  mem_account(&usage[MEM_FOLDS], config.folds.ranges,
+              sizeof(fold_range) * config.folds.count);
+  mem_account(&usage[MEM_FOLDS], config.folds.hidden,
+              sizeof(int) * (config.folds.count + 1));
+
+  struct columns *c = &config.columns;
+  if (c->active) {
+    mem_account(&usage[MEM_COLUMNS], c->widths, sizeof(int) * c->count);
+    mem_account(&usage[MEM_COLUMNS], c->pos, sizeof(int) * (c->count + 1));
+    mem_account(&usage[MEM_COLUMNS], c->cache,
+                sizeof(column_fields) * COLUMN_CACHE_SLOTS);
+
+    for (int i = 0; i < COLUMN_CACHE_SLOTS; i++) {
+      mem_account(&usage[MEM_COLUMNS], c->cache[i].starts,
+                  sizeof(uint32_t) * c->cache[i].cap);
+    }
+  }
+
+  // the heap keeps freed chunks and the per-chunk headers as well
+  struct mallinfo2 mi = mallinfo2();
+  report->heap_used = mi.uordblks + mi.hblkhd;
+  report->heap_free = mi.fordblks;
+  report->heap_mapped = mi.arena + mi.hblkhd;
+}
+
+char *format_bytes(size_t bytes, char *buf, size_t size) {
+  if (bytes >= 1 << 30)
+    snprintf(buf, size, "%.1fG", bytes / (double)(1 << 30));
+  else if (bytes >= 1 << 20)
+    snprintf(buf, size, "%.1fM", bytes / (double)(1 << 20));
+  else if (bytes >= 1 << 10)
+    snprintf(buf, size, "%.1fK", bytes / (double)(1 << 10));
+  else
+    snprintf(buf, size, "%zuB", bytes);
+
+  return buf;
+}
+
+void print_mem_usage(FILE *f, mem_report *report) {
+  mem_usage *usage = report->usage;
+  mem_usage total = {0, 0, 0};
+
+  fprintf(f, "%-12s %10s %14s %14s %14s\n", "subsystem", "allocs", "bytes",
+          "used", "slack");
+
+  for (int i = 0; i < MEM_COUNT; i++) {
+    fprintf(f, "%-12s %10zu %14zu %14zu %14zu\n", mem_names[i],
+            usage[i].allocs, usage[i].bytes, usage[i].used,
+            usage[i].bytes - usage[i].used);
+    total.allocs += usage[i].allocs;
+    total.bytes += usage[i].bytes;
+    total.used += usage[i].used;
+  }
+
+  fprintf(f, "%-12s %10zu %14zu %14zu %14zu\n", "total", total.allocs,
+          total.bytes, total.used, total.bytes - total.used);
+
+  fprintf(f, "heap: %zu bytes in use, %zu bytes free, %zu bytes mapped\n",
+          report->heap_used, report->heap_free, report->heap_mapped);
+  fprintf(f, "cold: %zu blocks holding %zu bytes, %llu hits, %llu misses\n",
+          report->cold_blocks, report->cold_size,
+          (unsigned long long)report->cold_hits,
+          (unsigned long long)report->cold_misses);
+}
+
+int show_mem_usage(char *filename) {
+  mem_report report;
+  mem_usage *usage = report.usage;
+  collect_mem_usage(&report);
+
+  if (filename != NULL) {
+    FILE *f = fopen(filename, "w");
+
+    if (!f)
+      return -1;
+
+    print_mem_usage(f, &report);
+    return fclose(f) == 0 ? 0 : -1;
+  }
+
+  char msg[160] = "";
+  int len = 0;
+  size_t slack = 0;
+  char num[16];
+
+  for (int i = 0; i < MEM_COUNT && len < (int)sizeof(msg); i++) {
+    slack += usage[i].bytes - usage[i].used;
+
+    if (usage[i].bytes == 0)
+      continue;
+
+    len += snprintf(&msg[len], sizeof(msg) - len, "%s %s ", mem_names[i],
+                    format_bytes(usage[i].bytes, num, sizeof(num)));
+  }
+
+  char free_num[16];
+  set_status_msg("%sslack %s heap free %s", msg,
+                 format_bytes(slack, num, sizeof(num)),
+                 format_bytes(report.heap_free, free_num, sizeof(free_num)));
+  return 0;
+}
+
+void ap_buf_append(struct ap_buf *buf, const char *s, size_t len) {
+  char *new = realloc(buf->b, buf->len + len);
+
+  if (new == NULL)
+    return;
+
+  memcpy(&new[buf->len], s, len);
+  buf->b = new;
+  buf->len += len;
+}
+
+void free_ap_buf(struct ap_buf *buf) { free(buf->b); }
+
+int get_cursor_pos(int *rows, int *cols) {
+  char buf[32];
+  unsigned int i = 0;
+
+  // the 'n' command (Device Status Report) will
+  // give the terminal status information
+  // and with the argument '6' it will give the
+  // cursor position and it can be read from the
+  // standard input.
+  if (write(STDIN_FILENO, "\x1b[6n", 4) != 4)
+    return -1;
+
+  while (i < sizeof(buf) - 1) {
+    if (read(STDIN_FILENO, &buf[i], 1) != 1 || buf[i] == 'R')
+      break;
+    i++;
+  }
+
+  buf[i] = '\0';
+
+  if (buf[0] != '\x1b' || buf[1] != '[')
+    return -1;
+
+  if (sscanf(&buf[2], "%d;%d", rows, cols) != 2)
+    return -1;
+
+  return 0;
+}
+
+int get_term_size(int *rows, int *cols) {
+  struct winsize w;
+
+  if (ioctl(STDIN_FILENO, TIOCGWINSZ, &w) != -1 && w.ws_col != 0) {
+    *cols = w.ws_col;
+    *rows = w.ws_row;
+    return 0;
+  } else {
+    if (write(STDIN_FILENO, "\x1b[999C\x1b[999B", 12) != 12)
+      return -1;
+    return get_cursor_pos(rows, cols);
+  }
+}
+
+void draw_rows(struct ap_buf *buf) {
+  int sub;
+  ensure_highlight(screen_line_to_row(config.rowoff + config.rows - 1, &sub));
+
+  for (int y = 0; y < config.rows; y++) {
+    draw_row(buf, y);
+    ap_buf_append(buf, "\r\n", 2);
+  }
+}
+
+void draw_row(struct ap_buf *buf, int y) {
+  int sub;
+  int filerow = screen_line_to_row(y + config.rowoff, &sub);
+
+  if (config.hex.active) {
+    hex_draw_line(buf, y + config.rowoff);
+  } else if (config.columns.active && filerow < config.numrows) {
+    column_draw_row(buf, filerow);
+  } else if (filerow >= config.numrows) {
+    if (config.numrows == 0 && y == config.rows / 3) {
+      char welcome[80];
+      int welcome_len = snprintf(welcome, sizeof(welcome),
+                                 "Text Editor In C - Version %s", VERSION);
+
+      if (welcome_len > config.cols) {
+        welcome_len = config.cols;
+      }
+
+      ap_buf_append(buf, "~", 1);
+      for (int i = 0; i < (config.cols - welcome_len) / 2; i++) {
+        ap_buf_append(buf, " ", 1);
+      }
+
+      ap_buf_append(buf, welcome, welcome_len);
+    } else {
+
+      ap_buf_append(buf, "~", 1);
+    }
+  } else {
+    row_render *r = erow_render(&config.editor_rows[filerow]);
+    int start = config.wrap ? sub * config.cols : config.coloff;
+
+    int len = r->width - start;
+    if (len < 0)
+      len = 0;
+    if (len > config.cols)
+      len = config.cols;
+
+    draw_erow_span(buf, r, start, len);
+
+    // a folded row ends with the number of rows it hides
+    int hidden = fold_hidden(filerow);
+
+    if (hidden > 0) {
+      char mark[32];
+      int mark_len = snprintf(mark, sizeof(mark), " ... %d line%s", hidden,
+                              hidden > 1 ? "s" : "");
+
+      if (len + mark_len <= config.cols) {
+        ap_buf_append(buf, "\x1b[2m", 4);
+        ap_buf_append(buf, mark, mark_len);
+        ap_buf_append(buf, "\x1b[m", 3);
+      }
+    }
+  }
+
+  // clears the line
+  ap_buf_append(buf, "\x1b[K", 3);
+}
+
+void draw_scrolled_rows(struct ap_buf *buf, int shift) {
+  char temp_buf[32];
+  int first, last, sub;
+
+  ensure_highlight(screen_line_to_row(config.rowoff + config.rows - 1, &sub));
+
+  if (shift != 0) {
+    // restricts the scroll to the text area, so the status lines stay
+    snprintf(temp_buf, sizeof(temp_buf), "\x1b[1;%dr", config.rows);
+    ap_buf_append(buf, temp_buf, strlen(temp_buf));
+
+    // 'S' scrolls the region up and 'T' scrolls it down
+    snprintf(temp_buf, sizeof(temp_buf), "\x1b[%d%c",
+             shift > 0 ? shift : -shift, shift > 0 ? 'S' : 'T');
+    ap_buf_append(buf, temp_buf, strlen(temp_buf));
+
+    // resets the scroll region to the whole screen
+    ap_buf_append(buf, "\x1b[r", 3);
+  }
+
+  if (shift > 0) {
+    first = config.rows - shift;
+    last = config.rows;
+  } else {
+    first = 0;
+    last = -shift;
+  }
+
+  for (int y = first; y < last; y++) {
+    snprintf(temp_buf, sizeof(temp_buf), "\x1b[%d;1H", y + 1);
+    ap_buf_append(buf, temp_buf, strlen(temp_buf));
+    draw_row(buf, y);
+  }
+
+  snprintf(temp_buf, sizeof(temp_buf), "\x1b[%d;1H", config.rows + 1);
+  ap_buf_append(buf, temp_buf, strlen(temp_buf));
+}
+
+void draw_erow_span(struct ap_buf *buf, row_render *row, int start, int len) {
+  int end = start + len;
+  int col;
+
+  // only the segments overlapping the visible columns are drawn
+  if (row->nsegs > 0) {
+    for (int k = find_segment_by_rx(row, start);
+         k < row->nsegs && row->segs[k].rx < end; k++) {
+      erow_segment *seg = &row->segs[k];
+      int from = start > seg->rx ? start - seg->rx : 0;
+      int to = end - seg->rx;
+
+      if (to > seg->r.width)
+        to = seg->r.width;
+
+      if (to > from)
+        draw_erow_span(buf, &seg->r, from, to - from);
+    }
+
+    return;
+  }
+
+  int i = render_rx_to_rbyte(row, start, &col);
+  int highlighted = config.syntax != NULL && row->hl_start != HL_STATE_NONE;
+  int current_color = -1;
+
+  while (i < row->rsize && col < end) {
+    unsigned char c = row->render[i];
+    int n = 1;
+    int w = 1;
+
+    if (c >= 0x80) {
+      unsigned int cp;
+      n = utf8_decode(&row->render[i], row->rsize - i, &cp);
+      w = codepoint_width(cp);
+    }
+
+    if (col < start || col + w > end) {
+      // a wide character cut by the edge of the screen
+      for (int k = col < start ? start : col; k < col + w && k < end; k++) {
+        ap_buf_append(buf, " ", 1);
+      }
+    } else if (iscntrl(c)) {
+      char sym = c <= 26 ? '@' + c : '?';
+      ap_buf_append(buf, "\x1b[7m", 4);
+      ap_buf_append(buf, &sym, 1);
+      ap_buf_append(buf, "\x1b[m", 3);
+
+      // the reset above drops the current color as well
+      if (current_color != -1) {
+        char color_buf[16];
+        int clen =
+            snprintf(color_buf, sizeof(color_buf), "\x1b[%dm", current_color);
+        ap_buf_append(buf, color_buf, clen);
+      }
+    } else if (!highlighted || row->hl[i] == HL_NORMAL) {
+      if (current_color != -1) {
+        ap_buf_append(buf, "\x1b[39m", 5);
+        current_color = -1;
+      }
+
+      ap_buf_append(buf, &row->render[i], n);
+    } else {
+      int color = syntax_to_color(row->hl[i]);
+
+      if (color != current_color) {
+        char color_buf[16];
+        int clen = snprintf(color_buf, sizeof(color_buf), "\x1b[%dm", color);
+        ap_buf_append(buf, color_buf, clen);
+        current_color = color;
+      }
+
+      ap_buf_append(buf, &row->render[i], n);
+    }
+
+    i += n;
+    col += w;
+  }
+
+  if (current_color != -1)
+    ap_buf_append(buf, "\x1b[39m", 5);
+}
+
+void update_scroll() {
+  config.rx = 0;
+
+  // the hex view always fits the width of the screen
+  if (config.hex.active) {
+    config.coloff = 0;
+
+    if (config.cy < config.rowoff)
+      config.rowoff = config.cy;
+    if (config.cy >= config.rowoff + config.rows)
+      config.rowoff = config.cy - config.rows + 1;
+    return;
+  }
+
+  if (config.filter.active)
+    filter_reveal(config.cy);
+  else if (config.folds.count > 0)
+    fold_reveal(config.cy);
+
+  if (config.cy < config.numrows) {
+    config.rx = row_cx_to_rx(&config.editor_rows[config.cy], config.cx);
+  }
+
+  if (config.wrap) {
+    int col;
+    int line = cursor_screen_line(&col);
+
+    config.coloff = 0;
+
+    if (line < config.rowoff)
+      config.rowoff = line;
+
+    if (line >= config.rowoff + config.rows)
+      config.rowoff = line - config.rows + 1;
+
+    return;
+  }
+
+  int line = config.filter.active     ? filter_line(config.cy)
+             : config.folds.count > 0 ? fold_line(config.cy)
+                                      : config.cy;
+
+  if (line < config.rowoff) {
+    config.rowoff = line;
+  }
+
+  if (line >= config.rowoff + config.rows) {
+    config.rowoff = line - config.rows + 1;
+  }
+
+  if (config.rx < config.coloff) {
+    config.coloff = config.rx;
+  }
+
+  if (config.rx >= config.coloff + config.cols) {
+    config.coloff = config.rx - config.cols + 1;
+  }
+}
+
+int wrap_row_height(erow *row) {
+  int width = row_width(row);
+  return width == 0 ? 1 : (width + config.cols - 1) / config.cols;
+}
+
+void wrap_sync() {
+  if (!config.wrap_dirty)
+    return;
+
+  fenwick *f = &config.wrap_index;
+  fenwick_reset(f, config.numrows);
+
+  for (int i = 0; i < config.numrows; i++) {
+    f->tree[i + 1] = wrap_row_height(&config.editor_rows[i]);
+  }
+
+  fenwick_build(f);
+  config.wrap_dirty = 0;
+}
+
+int screen_line_to_row(int line, int *sub) {
+  *sub = 0;
+
+  if (config.filter.active)
+    return filter_line_to_row(line);
+
+  if (config.folds.count > 0)
+    return fold_line_to_row(line);
+
+  if (!config.wrap)
+    return line;
+
+  wrap_sync();
+
+  long long total = fenwick_prefix(&config.wrap_index, config.numrows);
+
+  if (line >= total)
+    return config.numrows + (line - total);
+
+  int at = fenwick_search(&config.wrap_index, line);
+  *sub = line - fenwick_prefix(&config.wrap_index, at);
+  return at;
+}
+
+int cursor_screen_line(int *col) {
+  if (config.hex.active) {
+    *col = hex_column(config.cx);
+    return config.cy;
+  }
+
+  if (!config.wrap) {
+    *col = config.rx - config.coloff;
+    if (config.filter.active)
+      return filter_line(config.cy);
+    return config.folds.count > 0 ? fold_line(config.cy) : config.cy;
+  }
+
+  wrap_sync();
+
+  int line = fenwick_prefix(&config.wrap_index, config.cy);
+
+  if (config.cy >= config.numrows) {
+    *col = 0;
+    return line;
+  }
+
+  int sub = config.rx / config.cols;
+  int height = wrap_row_height(&config.editor_rows[config.cy]);
+
+  // the cursor after the last character of a full line
+  // stays on the last column
+  if (sub >= height)
+    sub = height - 1;
+
+  *col = config.rx - sub * config.cols;
+  if (*col >= config.cols)
+    *col = config.cols - 1;
+
+  return line + sub;
+}
+
+void wrap_move_cursor(int lines) {
+  int col, sub;
+  long long line = cursor_screen_line(&col) + (long long)lines;
+  long long total = fenwick_prefix(&config.wrap_index, config.numrows);
+
+  if (line < 0)
+    line = 0;
+  if (line > total)
+    line = total;
+
+  config.cy = screen_line_to_row(line, &sub);
+
+  if (config.cy >= config.numrows) {
+    config.cy = config.numrows;
+    config.cx = 0;
+    return;
+  }
+
+  config.cx = row_rx_to_cx(&config.editor_rows[config.cy],
+                           sub * config.cols + col);
+}
+
+void toggle_wrap() {
+  int sub;
+
+  if (config.filter.active) {
+    set_status_msg("Soft wrap is off in the grep view.");
+    return;
+  }
+
+  if (config.columns.active) {
+    set_status_msg("Soft wrap is off in column mode.");
+    return;
+  }
+
+  if (config.folds.count > 0) {
+    set_status_msg("Soft wrap is off while lines are folded.");
+    return;
+  }
+
+  if (config.wrap) {
+    config.rowoff = screen_line_to_row(config.rowoff, &sub);
+    config.wrap = 0;
+    fenwick_free(&config.wrap_index);
+  } else {
+    int top = config.rowoff < config.numrows ? config.rowoff : config.numrows;
+
+    config.wrap = 1;
+    config.wrap_dirty = 1;
+    wrap_sync();
+    config.rowoff = fenwick_prefix(&config.wrap_index, top);
+  }
+
+  config.coloff = 0;
+  config.screen_dirty = 1;
+  set_status_msg("Soft wrap %s", config.wrap ? "on" : "off");
+}
+
+void set_status_msg(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(config.status_msg, sizeof(config.status_msg), fmt, ap);
+  va_end(ap);
+  config.status_time = time(NULL);
+}
+
+void draw_status_line(struct ap_buf *buf) {
+  ap_buf_append(buf, "\x1b[7m", 4);
+
+  char status[160], rstatus[80];
+
+  int len = snprintf(status, sizeof(status), "%.20s %s - %d lines",
+                     config.filename ? config.filename : "[No Name]",
+                     config.modified ? "(modified)" : "", config.numrows);
+
+  // the count is a lower bound until every row has been searched
+  struct filter *f = &config.filter;
+  if (f->active)
+    len += snprintf(&status[len], sizeof(status) - len, ", %d%s shown for %.20s",
+                    f->count, f->scanned < config.numrows ? "+" : "",
+                    f->pattern);
+
+  // the results are counted as they are appended
+  struct project_grep *g = &config.project;
+  if (g->active)
+    len += snprintf(&status[len], sizeof(status) - len,
+                    ", grep %.20s in %d/%d files%s", g->pattern,
+                    g->matched_seen, g->files_seen, g->done ? "" : "+");
+
+  struct hex_view *h = &config.hex;
+  if (h->active)
+    len += snprintf(&status[len], sizeof(status) - len,
+                    ", %zu bytes in hex (read-only)", h->size);
+
+  if (fold_active())
+    len += snprintf(&status[len], sizeof(status) - len, ", %d folds",
+                    config.folds.count);
+
+  if (config.columns.active && config.cy < config.numrows) {
+    column_fields *fields = row_fields(config.cy);
+    len += snprintf(&status[len], sizeof(status) - len, ", field %d/%d",
+                    column_at(fields, config.cx) + 1, fields->count);
+  }
+
+  long long offset = h->active
+                         ? (long long)config.cy * HEX_LINE_BYTES + config.cx
+                         : row_offset(config.cy) + config.cx;
+  int rlen = snprintf(rstatus, sizeof(rstatus), "byte %lld  %d/%d", offset,
+                      config.cy + 1, h->active ? hex_lines() : config.numrows);
+
+  if (len > config.cols)
+    len = config.cols;
+
+  ap_buf_append(buf, status, len);
+
+  while (len < config.cols) {
+    if (config.cols - len == rlen) {
+      ap_buf_append(buf, rstatus, rlen);
+      break;
+    } else {
+      ap_buf_append(buf, " ", 1);
+      len++;
+    }
+  }
+
+  ap_buf_append(buf, "\x1b[m", 3);
+  ap_buf_append(buf, "\r\n", 2);
+}
+
+void draw_status_msg_line(struct ap_buf *buf) {
+  ap_buf_append(buf, "\x1b[K", 3);
+
+  if (config.trace.overlay) {
+    draw_trace_overlay(buf);
+    return;
+  }
+  int msg_len = strlen(config.status_msg);
+
+  if (msg_len > config.cols)
+    msg_len = config.cols;
+
+  if (msg_len && time(NULL) - config.status_time < 7) {
+    ap_buf_append(buf, config.status_msg, msg_len);
+  }
+}
+
+void refresh_screen() {
+  uint64_t trace_start = trace_now();
+  struct ap_buf buf = AP_BUF_INIT;
+
+  update_scroll();
+  trim_render_cache();
+  cold_sweep();
+
+  // begins the synchronized output, so the terminal
+  // shows the whole frame at once
+  ap_buf_append(&buf, "\x1b[?2026h", 8);
+
+  // hides the cursor
+  ap_buf_append(&buf, "\x1b[?25l", 6);
+
+  int shift = config.rowoff - config.prev_rowoff;
+  uint64_t draw_start = trace_now();
+
+  if (!config.screen_dirty && config.coloff == config.prev_coloff &&
+      shift < config.rows && shift > -config.rows) {
+    draw_scrolled_rows(&buf, shift);
+  } else {
+    // moves cursor to the top
+    ap_buf_append(&buf, "\x1b[H", 3);
+
+    draw_rows(&buf);
+  }
+
+  trace_event_end(PROBE_DRAW_ROWS, draw_start);
+
+  config.prev_rowoff = config.rowoff;
+  config.prev_coloff = config.coloff;
+  config.screen_dirty = 0;
+
+  draw_status_line(&buf);
+  draw_status_msg_line(&buf);
+
+  // moves cursor to the defined position in the config struct
+  int col;
+  int line = cursor_screen_line(&col);
+  char temp_buf[32];
+  snprintf(temp_buf, sizeof(temp_buf), "\x1b[%d;%dH", line - config.rowoff + 1,
+           col + 1);
+  ap_buf_append(&buf, temp_buf, strlen(temp_buf));
+
+  // shows the cursor
+  ap_buf_append(&buf, "\x1b[?25h", 6);
+
+  // ends the synchronized output
+  ap_buf_append(&buf, "\x1b[?2026l", 8);
+
+  uint64_t write_start = trace_now();
+  write(STDIN_FILENO, buf.b, buf.len);
+  trace_event_end(PROBE_WRITE, write_start);
+
+  trace_event_end(PROBE_FRAME, trace_start);
+  trace_frame_end(trace_start, buf.len);
+  free_ap_buf(&buf);
+}
+
+void disable_raw_mode() {
+  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &config.orig_termios) == -1)
+    die("tcsetattr");
+}
+
+void enable_raw_mode() {
+  if (tcgetattr(STDIN_FILENO, &config.orig_termios) == -1)
+    die("tcgetattr");
+
+  atexit(disable_raw_mode);
+
+  struct termios raw = config.orig_termios;
+
+  raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+  raw.c_oflag &= ~(OPOST);
+  raw.c_cflag |= (CS8);
+  raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+  raw.c_cc[VMIN] = 0;
+  raw.c_cc[VTIME] = 1;
+
+  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
+    die("tcsetattr");
+}
+
+char *erows_to_str(size_t *buflen) {
+  char *buffer = NULL;
+
+  size_t total_len = 0;
+
+  for (int i = 0; i < config.numrows; i++) {
+    erow row = config.editor_rows[i];
+    total_len += row.size + 1;
+  }
+
+  *buflen = total_len;
+  buffer = malloc(total_len);
+  char *p = buffer;
+
+  for (int i = 0; i < config.numrows; i++) {
+    erow *row = &config.editor_rows[i];
+    memcpy(p, row_peek(row), row->size);
+    p += row->size;
+    *p = '\n';
+    p++;
+  }
+
+  return buffer;
+}
+
+void insert_char(int c) {
+  if (config.cy == config.numrows) {
+    insert_erow(config.numrows, "", 0);
+  }
+
+  insert_char_at_row(&config.editor_rows[config.cy], config.cx, c);
+  config.cx++;
+}
+
+void insert_utf8_char(int lead) {
+  char seq[4];
+  int len = utf8_seq_len(lead);
+
+  if (len == 0) {
+    insert_char(lead);
+    return;
+  }
+
+  seq[0] = lead;
+
+  // the remaining bytes of the character arrive right after the first one
+  for (int i = 1; i < len; i++) {
+    int c = read_input_key();
+
+    if ((c & 0xc0) != 0x80 || c >= 0x100) {
+      len = i;
+      break;
+    }
+
+    seq[i] = c;
+  }
+
+  if (config.cy == config.numrows) {
+    insert_erow(config.numrows, "", 0);
+  }
+
+  insert_str_at_row(&config.editor_rows[config.cy], config.cx, seq, len);
+  config.cx += len;
+}
+
+void insert_new_line() {
+  if (config.cx == 0) {
+    insert_erow(config.cy, "", 0);
+
+  } else {
+    erow *row = &config.editor_rows[config.cy];
+    insert_erow(config.cy + 1, &row_chars(row)[config.cx],
+                row->size - config.cx);
+    row = &config.editor_rows[config.cy];
+    remove_str_at_row(row, config.cx, row->size - config.cx);
+  }
+
+  config.cy++;
+  config.cx = 0;
+}
+
+void delete_char() {
+  if (config.cy == config.numrows)
+    return;
+
+  erow *row = &config.editor_rows[config.cy];
+
+  if (config.cy == 0 && config.cx == 0) {
+    if (row->size == 0)
+      delete_erow(config.cy);
+
+    return;
+  }
+
+  if (config.cx > 0) {
+    int prev_cx = row_prev_cx(row, config.cx);
+    remove_str_at_row(row, prev_cx, config.cx - prev_cx);
+    config.cx = prev_cx;
+  } else {
+    erow *prev_row = &config.editor_rows[config.cy - 1];
+    config.cx = prev_row->size;
+    insert_str_at_row(prev_row, prev_row->size, row_chars(row), row->size);
+    delete_erow(config.cy);
+    config.cy--;
+  }
+}
+
+char *editor_prompt(char *prompt, char *default_value) {
+  size_t bufsize = 128;
+  size_t buflen = strlen(default_value);
+
+  while (buflen > bufsize) {
+    if (bufsize > 256)
+      break;
+    bufsize *= 2;
+  }
+
+  char *buf = malloc(bufsize);
+
+  for (int i = 0; i < buflen; i++) {
+    buf[i] = default_value[i];
+  }
+
+  buf[buflen] = '\0';
+
+  while (1) {
+    set_status_msg(prompt, buf);
+    refresh_screen();
+
+    int c = read_input_key();
+
+    if (c == DEL_KEY || c == BACKSPACE) {
+      // removes the whole UTF-8 character
+      while (buflen != 0 && (buf[buflen - 1] & 0xc0) == 0x80)
+        buflen--;
+      if (buflen != 0)
+        buf[--buflen] = '\0';
+      buf[buflen] = '\0';
+    } else if (c == '\x1b') {
+      set_status_msg("");
+      free(buf);
+      return NULL;
+    } else if (c == '\r') {
+      if (buflen != 0) {
+        set_status_msg("");
+        return buf;
+      }
+    } else if ((!iscntrl(c) && c < 128) || (c >= 128 && c < 256)) {
+      if (buflen == bufsize - 1) {
+        bufsize *= 2;
+        buf = realloc(buf, bufsize);
+      }
+
+      buf[buflen++] = c;
+      buf[buflen] = '\0';
+    }
+  }
+}
+
+int editor_open(char *filename) {
+  FILE *f = fopen(filename, "r");
+
+  if (!f) {
+    if (config.headless)
+      return -1;
+    die("fopen");
+  }
+
+  free(config.filename);
+  config.filename = strdup(filename);
+  select_syntax_highlight();
+
+  // binary files are mapped into the hex view instead of being loaded
+  if (hex_wanted(f)) {
+    int result = hex_open(f);
+
+    if (result == -1)
+      set_status_msg("Can't map %s into the hex view.", filename);
+
+    fclose(f);
+    return result;
+  }
+
+  char *line = NULL;
+  size_t linecap = 0;
+  size_t linelen;
+
+  // loading the file isn't an undoable action
+  undo_clear(1);
+  config.undo.paused = 1;
+  config.gzip = is_gzip_file(f);
+
+  if (config.gzip && load_gzip(filename) == -1)
+    set_status_msg("%s is corrupt or truncated, loaded what could be read.",
+                   filename);
+
+  while (!config.gzip && (linelen = getline(&line, &linecap, f)) != -1) {
+    while (linelen > 0 &&
+           (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) {
+      linelen--;
+    }
+
+    append_erow(line, linelen);
+  }
+
+  cold_flush();
+
+  config.undo.paused = config.headless;
+  config.modified = 0;
+  free(line);
+  fclose(f);
+
+  if (!config.headless) {
+    journal_close(0);
+    journal_open(1);
+  }
+
+  return 0;
+}
+
+void editor_close() {
+  filter_stop();
+  fold_clear();
+  project_grep_stop();
+  hex_close();
+  column_stop();
+
+  // only the drawn rows have a render, and the chars of every row,
+  // including the ones held by the history, go away with the arena
+  free_render_cache();
+  undo_clear(0);
+  intern_reset();
+  cold_reset();
+  arena_reset();
+  free(config.editor_rows);
+  config.editor_rows = NULL;
+  config.numrows = 0;
+  config.rowcap = 0;
+  config.cx = 0;
+  config.cy = 0;
+  config.rowoff = 0;
+  config.coloff = 0;
+  config.modified = 0;
+  config.hl_frontier = 0;
+  config.wrap_dirty = 1;
+  config.offsets_dirty = 1;
+  config.screen_dirty = 1;
+  config.search_match_found = -1;
+  config.current_search_idx = -1;
+}
+
+void editor_save() {
+  char *temp_filename = NULL;
+
+  if (config.filename == NULL) {
+    temp_filename = editor_prompt("Save as: %s (Esc to cancel)", "");
+  } else {
+    temp_filename =
+        editor_prompt("Save as: %s (Esc to cancel)", config.filename);
+  }
+
+  if (temp_filename == NULL) {
+    set_status_msg("Save operation cancelled.");
+    return;
+  }
+
+  off_t len = write_file(temp_filename);
+
+  if (len == -1) {
+    free(temp_filename);
+    set_status_msg("Error on save: %s", strerror(errno));
+    return;
+  }
+
+  free(config.filename);
+  config.filename = temp_filename;
+  select_syntax_highlight();
+
+  // the saved file is the new base of the journal
+  journal_close(1);
+  journal_open(0);
+
+  set_status_msg("%lld bytes saved on %s.", (long long)len, config.filename);
+  config.modified = 0;
+
+  // the rows are the whole file again
+  if (config.follow.active)
+    follow_start();
+}
+
+off_t write_file(char *filename) {
+  size_t namelen = strlen(filename);
+
+  if (namelen > 3 && strcmp(&filename[namelen - 3], ".gz") == 0)
+    return write_gzip(filename);
+
+  int fd = open(filename, O_RDWR | O_CREAT, 0644);
+
+  if (fd == -1)
+    return -1;
+
+  char *buf = malloc(SAVE_BUFFER_SIZE);
+  size_t used = 0;
+  off_t total = 0;
+  int failed = 0;
+
+  for (int i = 0; i < config.numrows && !failed; i++) {
+    erow *row = &config.editor_rows[i];
+    const char *chars = row_peek(row);
+    size_t size = row->size;
+
+    if (used + size + 1 > SAVE_BUFFER_SIZE) {
+      failed = write_all(fd, buf, used) == -1;
+      used = 0;
+    }
+
+    // rows longer than the buffer are written straight from the row
+    if (size + 1 > SAVE_BUFFER_SIZE) {
+      failed = failed || write_all(fd, chars, size) == -1 ||
+               write_all(fd, "\n", 1) == -1;
+    } else {
+      memcpy(&buf[used], chars, size);
+      buf[used + size] = '\n';
+      used += size + 1;
+    }
+
+    total += size + 1;
+  }
+
+  // the old bytes past the new end are cut once the rows are written
+  if (failed || write_all(fd, buf, used) == -1 || ftruncate(fd, total) == -1)
+    total = -1;
+
+  free(buf);
+  close(fd);
+  return total;
+}
+
+int write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1)
+      return -1;
+
+    buf += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+size_t append_lines(char *buf, size_t len) {
+  char *start = buf;
+  char *end = &buf[len];
+  char *nl;
+
+  while ((nl = memchr(start, '\n', end - start)) != NULL) {
+    size_t linelen = nl - start;
+
+    while (linelen > 0 && start[linelen - 1] == '\r')
+      linelen--;
+
+    append_erow(start, linelen);
+    start = nl + 1;
+  }
+
+  return start - buf;
+}
+
+int is_gzip_file(FILE *f) {
+  unsigned char magic[2];
+  size_t n = fread(magic, 1, 2, f);
+
+  rewind(f);
+  return n == 2 && magic[0] == 0x1f && magic[1] == 0x8b;
+}
+
+int load_gzip(char *filename) {
+  gzFile gz = gzopen(filename, "rb");
+
+  if (gz == NULL)
+    return -1;
+
+  gzbuffer(gz, GZIP_BUFFER_SIZE);
+
+  size_t cap = GZIP_BUFFER_SIZE;
+  char *buf = malloc(cap);
+  size_t have = 0;
+  int n;
+
+  // the bytes after the last newline move to the front of the buffer
+  // and wait for the rest of their line
+  while ((n = gzread(gz, &buf[have], cap - have)) > 0) {
+    have += n;
+
+    size_t used = append_lines(buf, have);
+    have -= used;
+    memmove(buf, &buf[used], have);
+
+    if (have == cap) {
+      cap *= 2;
+      buf = realloc(buf, cap);
+    }
+  }
+
+  int err;
+  gzerror(gz, &err);
+
+  // a last line without a newline is a row as well
+  if (have > 0) {
+    while (have > 0 && buf[have - 1] == '\r')
+      have--;
+    append_erow(buf, have);
+  }
+
+  free(buf);
+  gzclose(gz);
+  return n < 0 || (err != Z_OK && err != Z_STREAM_END) ? -1 : 0;
+}
+
+off_t write_gzip(char *filename) {
+  gzFile gz = gzopen(filename, "wb");
+
+  if (gz == NULL)
+    return -1;
+
+  gzbuffer(gz, GZIP_BUFFER_SIZE);
+
+  for (int i = 0; i < config.numrows; i++) {
+    erow *row = &config.editor_rows[i];
+
+    if ((row->size > 0 && gzwrite(gz, row_peek(row), row->size) == 0) ||
+        gzputc(gz, '\n') == -1) {
+      gzclose(gz);
+      return -1;
+    }
+  }
+
+  struct stat st;
+
+  if (gzclose(gz) != Z_OK || stat(filename, &st) == -1)
+    return -1;
+
+  return st.st_size;
+}
+
+void filter_start(const char *pattern, size_t plen) {
+  struct filter *f = &config.filter;
+
+  if (f->active) {
+    free(f->pattern);
+  } else if (config.wrap) {
+    toggle_wrap();
+    f->wrap = 1;
+  }
+
+  f->pattern = malloc(plen + 1);
+  memcpy(f->pattern, pattern, plen);
+  f->pattern[plen] = '\0';
+  f->plen = plen;
+  f->count = 0;
+  f->scanned = 0;
+  f->active = 1;
+
+  // the cursor goes to the first match at or after it, if there is one
+  filter_scan(config.cy, config.numrows + 1);
+  int first = f->count;
+  filter_scan(config.numrows, first + 1);
+
+  if (first < f->count) {
+    config.cy = f->rows[first];
+    config.cx = 0;
+  }
+
+  config.rowoff = 0;
+  config.screen_dirty = 1;
+}
+
+void filter_stop() {
+  struct filter *f = &config.filter;
+
+  if (!f->active)
+    return;
+
+  int top = config.rowoff < f->count ? f->rows[config.rowoff] : config.numrows;
+  int wrap = f->wrap;
+
+  free(f->pattern);
+  free(f->rows);
+  memset(f, 0, sizeof(*f));
+  config.rowoff = top;
+
+  if (wrap)
+    toggle_wrap();
+
+  config.screen_dirty = 1;
+}
+
+void filter_scan(int until_row, int until_count) {
+  struct filter *f = &config.filter;
+
+  if (until_row > config.numrows)
+    until_row = config.numrows;
+
+  while (f->scanned < until_row && f->count < until_count) {
+    erow *row = &config.editor_rows[f->scanned];
+
+    if (find_pattern(row_peek(row), row->size, f->pattern, f->plen) != NULL) {
+      if (f->count == f->cap) {
+        f->cap = f->cap ? f->cap * 2 : 256;
+        f->rows = realloc(f->rows, sizeof(int) * f->cap);
+      }
+
+      f->rows[f->count++] = f->scanned;
+    }
+
+    f->scanned++;
+  }
+}
+
+int filter_line(int row) {
+  struct filter *f = &config.filter;
+  int lo = 0, hi = f->count;
+
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+
+    if (f->rows[mid] < row)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+int filter_line_to_row(int line) {
+  struct filter *f = &config.filter;
+
+  filter_scan(config.numrows, line + 1);
+
+  if (line < f->count)
+    return f->rows[line];
+
+  return config.numrows + (line - f->count);
+}
+
+void filter_reveal(int row) {
+  struct filter *f = &config.filter;
+
+  if (row >= config.numrows)
+    return;
+
+  filter_scan(row + 1, config.numrows + 1);
+
+  int line = filter_line(row);
+
+  if (line < f->count && f->rows[line] == row)
+    return;
+
+  if (f->count == f->cap) {
+    f->cap = f->cap ? f->cap * 2 : 256;
+    f->rows = realloc(f->rows, sizeof(int) * f->cap);
+  }
+
+  memmove(&f->rows[line + 1], &f->rows[line], sizeof(int) * (f->count - line));
+  f->rows[line] = row;
+  f->count++;
+}
+
+void filter_move_cursor(int lines) {
+  int rx = config.cy < config.numrows
+               ? row_cx_to_rx(&config.editor_rows[config.cy], config.cx)
+               : 0;
+  long long line = (long long)filter_line(config.cy) + lines;
+
+  if (line < 0)
+    line = 0;
+  if (line > config.numrows)
+    line = config.numrows;
+
+  config.cy = filter_line_to_row(line);
+
+  if (config.cy >= config.numrows) {
+    config.cy = config.numrows;
+    config.cx = 0;
+    return;
+  }
+
+  config.cx = row_rx_to_cx(&config.editor_rows[config.cy], rx);
+}
+
+void filter_insert_rows(int at, int n) {
+  struct filter *f = &config.filter;
+
+  if (!f->active || at > f->scanned)
+    return;
+
+  // the rows after the inserted ones are set aside while those are searched
+  int line = filter_line(at);
+  int tail = f->count - line;
+  int scanned = f->scanned;
+  int *rest = malloc(sizeof(int) * (tail > 0 ? tail : 1));
+
+  memcpy(rest, &f->rows[line], sizeof(int) * tail);
+  f->count = line;
+  f->scanned = at;
+  filter_scan(at + n, config.numrows + 1);
+
+  if (f->count + tail > f->cap) {
+    while (f->count + tail > f->cap)
+      f->cap = f->cap ? f->cap * 2 : 256;
+    f->rows = realloc(f->rows, sizeof(int) * f->cap);
+  }
+
+  for (int i = 0; i < tail; i++) {
+    f->rows[f->count++] = rest[i] + n;
+  }
+
+  f->scanned = scanned + n;
+  free(rest);
+}
+
+void filter_delete_rows(int at, int n) {
+  struct filter *f = &config.filter;
+
+  if (!f->active || at >= f->scanned)
+    return;
+
+  int from = filter_line(at);
+  int to = filter_line(at + n);
+
+  for (int i = to; i < f->count; i++) {
+    f->rows[i - (to - from)] = f->rows[i] - n;
+  }
+
+  f->count -= to - from;
+  f->scanned = f->scanned >= at + n ? f->scanned - n : at;
+}
+
+void filter_rescan() {
+  config.filter.count = 0;
+  config.filter.scanned = 0;
+}
+
+int filter_idle() {
+  struct filter *f = &config.filter;
+
+  if (!f->active || f->scanned >= config.numrows)
+    return 0;
+
+  int count = f->count;
+  filter_scan(f->scanned + FILTER_SCAN_ROWS, config.numrows + 1);
+
+  // the rows found fill the part of the screen which was empty
+  if (count < config.rowoff + config.rows && f->count > count)
+    config.screen_dirty = 1;
+
+  // the status line shows the number of matches so far
+  return 1;
+}
+
+int follow_start() {
+  struct follow *fw = &config.follow;
+  struct stat st;
+
+  if (config.filename == NULL || stat(config.filename, &st) == -1) {
+    set_status_msg("There is no file to follow.");
+    return -1;
+  }
+
+  if (config.modified > 0) {
+    set_status_msg("Save the file before following it.");
+    return -1;
+  }
+
+  if (config.hex.active) {
+    set_status_msg("The hex view can't follow the file.");
+    return -1;
+  }
+
+  if (config.gzip) {
+    set_status_msg("A compressed file can't be followed.");
+    return -1;
+  }
+
+  // without inotify the file is looked at every time input is awaited
+  if (fw->fd == -1)
+    fw->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+  follow_watch();
+  fw->active = 1;
+  fw->ino = st.st_ino;
+  fw->offset = 0;
+
+  int fd = open(config.filename, O_RDONLY);
+  char buf[4096];
+  off_t pos = st.st_size;
+
+  // the offset goes right after the last newline of the file
+  while (fd != -1 && pos > 0) {
+    size_t n = pos < (off_t)sizeof(buf) ? (size_t)pos : sizeof(buf);
+
+    if (pread(fd, buf, n, pos - n) != (ssize_t)n)
+      break;
+
+    char *nl = memrchr(buf, '\n', n);
+
+    if (nl != NULL) {
+      fw->offset = pos - n + (nl - buf) + 1;
+      break;
+    }
+
+    pos -= n;
+  }
+
+  if (fd != -1)
+    close(fd);
+
+  // the history may point at the row which is taken out
+  if (fw->offset < st.st_size && config.numrows > 0) {
+    int journal_paused = config.journal.paused;
+
+    undo_clear(1);
+    config.undo.paused = 1;
+    config.journal.paused = 1;
+    delete_erow(config.numrows - 1);
+    config.journal.paused = journal_paused;
+    config.undo.paused = config.headless;
+    config.modified = 0;
+  }
+
+  // the edits from now on apply to the complete lines
+  fw->lines = config.numrows;
+  journal_reset();
+  return 0;
+}
+
+int follow_file_rows(off_t size) {
+  struct follow *fw = &config.follow;
+  int fd = open(config.filename, O_RDONLY);
+  int rows = fw->lines;
+  char buf[4096];
+  char last = '\n';
+  ssize_t n;
+
+  for (off_t pos = fw->offset; fd != -1 && pos < size; pos += n) {
+    size_t want = size - pos < (off_t)sizeof(buf) ? (size_t)(size - pos)
+                                                  : sizeof(buf);
+
+    if ((n = pread(fd, buf, want, pos)) <= 0)
+      break;
+
+    for (char *nl = buf; (nl = memchr(nl, '\n', buf + n - nl)) != NULL;
+         nl++) {
+      rows++;
+    }
+
+    last = buf[n - 1];
+  }
+
+  if (fd != -1)
+    close(fd);
+
+  // a last line without its newline is loaded as a row as well
+  return rows + (last != '\n');
+}
+
+void follow_stop() {
+  struct follow *fw = &config.follow;
+
+  if (fw->fd != -1)
+    close(fw->fd);
+
+  free(fw->buf);
+  memset(fw, 0, sizeof(*fw));
+  fw->fd = -1;
+  fw->file_wd = -1;
+  fw->dir_wd = -1;
+}
+
+void follow_watch() {
+  struct follow *fw = &config.follow;
+
+  if (fw->fd == -1)
+    return;
+
+  if (fw->file_wd != -1)
+    inotify_rm_watch(fw->fd, fw->file_wd);
+
+  fw->file_wd = inotify_add_watch(fw->fd, config.filename,
+                                  IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF |
+                                      IN_DELETE_SELF);
+
+  // a rotated file is replaced by a new one under the same name
+  if (fw->dir_wd == -1) {
+    char *slash = strrchr(config.filename, '/');
+    char *dir = slash == NULL ? strdup(".")
+                : slash == config.filename
+                    ? strdup("/")
+                    : strndup(config.filename, slash - config.filename);
+
+    fw->dir_wd = inotify_add_watch(fw->fd, dir, IN_CREATE | IN_MOVED_TO);
+    free(dir);
+  }
+}
+
+int follow_poll() {
+  struct follow *fw = &config.follow;
+  struct stat st;
+
+  if (!fw->active)
+    return 0;
+
+  if (fw->fd != -1) {
+    char events[4096];
+    int changed = 0;
+
+    while (read(fw->fd, events, sizeof(events)) > 0)
+      changed = 1;
+
+    if (!changed)
+      return 0;
+  }
+
+  // a file which was moved away may not have been created again yet
+  if (stat(config.filename, &st) == -1)
+    return 0;
+
+  if (st.st_ino != fw->ino || st.st_size < fw->offset) {
+    follow_reload();
+    return 1;
+  }
+
+  return st.st_size > fw->offset && follow_read() > 0;
+}
+
+int follow_read() {
+  struct follow *fw = &config.follow;
+  int fd = open(config.filename, O_RDONLY);
+
+  if (fd == -1)
+    return 0;
+
+  if (fw->buf == NULL) {
+    fw->cap = FOLLOW_READ_SIZE;
+    fw->buf = malloc(fw->cap);
+  }
+
+  struct filter *f = &config.filter;
+  int past_end = config.numrows > 0 && config.cy >= config.numrows;
+  int at_end = config.cy >= config.numrows - 1;
+  int modified = config.modified;
+
+  // or on the last row of a grep view which has searched every row
+  if (f->active && f->scanned == config.numrows && f->count > 0)
+    at_end |= config.cy == f->rows[f->count - 1];
+  int undo_paused = config.undo.paused;
+  int journal_paused = config.journal.paused;
+  off_t pos = fw->offset;
+  size_t have = 0;
+  int added = 0;
+  ssize_t n;
+
+  // the new lines are loaded like the rest of the file, and journaled
+  // after the edits when there are unsaved ones
+  config.undo.paused = 1;
+  config.journal.paused = journal_paused || modified == 0;
+
+  while ((n = pread(fd, &fw->buf[have], fw->cap - have, pos)) > 0) {
+    int numrows = config.numrows;
+
+    have += n;
+    pos += n;
+
+    size_t used = append_lines(fw->buf, have);
+    added += config.numrows - numrows;
+    fw->offset += used;
+    have -= used;
+    memmove(fw->buf, &fw->buf[used], have);
+
+    // a line longer than the buffer makes it grow
+    if (have == fw->cap) {
+      fw->cap *= 2;
+      fw->buf = realloc(fw->buf, fw->cap);
+    }
+  }
+
+  close(fd);
+  cold_flush();
+  config.journal.paused = journal_paused;
+  config.undo.paused = undo_paused;
+  config.modified = modified;
+
+  if (added == 0)
+    return 0;
+
+  // the journal of an unchanged buffer starts from the grown file,
+  // the one of a changed buffer keeps its edits for the grown file
+  fw->lines += added;
+  if (modified == 0)
+    journal_reset();
+  else
+    journal_rebase();
+
+  if (at_end) {
+    config.cy = past_end ? config.numrows : config.numrows - 1;
+    config.cx = 0;
+
+    if (f->active && !past_end) {
+      filter_scan(config.numrows, config.numrows + 1);
+      if (f->count > 0)
+        config.cy = f->rows[f->count - 1];
+    }
+  }
+
+  config.screen_dirty = 1;
+  return added;
+}
+
+void follow_reload() {
+  int at_end = config.cy >= config.numrows - 1;
+
+  if (config.modified > 0) {
+    follow_stop();
+    set_status_msg("The file was truncated or replaced, stopped following "
+                   "it to keep the changes.");
+    return;
+  }
+
+  // the journal would otherwise get every row of the new file
+  char *filename = strdup(config.filename);
+  char *pattern = config.filter.active ? strdup(config.filter.pattern) : NULL;
+  journal_close(1);
+  editor_close();
+  editor_open(filename);
+  free(filename);
+  follow_start();
+
+  if (pattern != NULL) {
+    filter_start(pattern, strlen(pattern));
+    free(pattern);
+  }
+
+  if (at_end) {
+    config.cy = config.numrows > 0 ? config.numrows - 1 : 0;
+    config.cx = 0;
+  }
+
+  set_status_msg("The file was truncated or replaced, reloaded it.");
+}
+
+int project_grep_start(const char *pattern, size_t plen, const char *dir) {
+  struct project_grep *g = &config.project;
+  struct stat st;
+
+  if (config.modified > 0) {
+    set_status_msg("The file has unsaved changes.");
+    return -1;
+  }
+
+  if (stat(dir, &st) == -1 || !S_ISDIR(st.st_mode)) {
+    set_status_msg("%s is not a directory.", dir);
+    return -1;
+  }
+
+  follow_stop();
+  journal_close(1);
+  editor_close();
+  free(config.filename);
+  config.filename = NULL;
+  select_syntax_highlight();
+
+  memset(g, 0, sizeof(*g));
+  g->active = 1;
+  g->pattern = malloc(plen + 1);
+  memcpy(g->pattern, pattern, plen);
+  g->pattern[plen] = '\0';
+  g->plen = plen;
+
+  size_t len = strlen(dir);
+  while (len > 1 && dir[len - 1] == '/')
+    len--;
+  g->root = strndup(dir, len);
+  g->root_len = strcmp(g->root, ".") == 0 ? 0
+                : strcmp(g->root, "/") == 0 ? 1
+                                            : len + 1;
+
+  g->taskcap = 64;
+  g->tasks = malloc(sizeof(grep_task) * g->taskcap);
+  g->tasks[0] = (grep_task){strdup(g->root), 1, NULL};
+  g->ntasks = 1;
+  pthread_mutex_init(&g->lock, NULL);
+  pthread_cond_init(&g->wake, NULL);
+
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int nthreads = cores < 1                  ? 1
+                 : cores > GREP_MAX_THREADS ? GREP_MAX_THREADS
+                                            : cores;
+
+  // the workers wait for the lock until every one of them is counted
+  pthread_mutex_lock(&g->lock);
+  for (int i = 0; i < nthreads; i++) {
+    if (pthread_create(&g->threads[g->nthreads], NULL, grep_worker, NULL) == 0)
+      g->nthreads++;
+  }
+  g->running = g->nthreads;
+  pthread_mutex_unlock(&g->lock);
+
+  // without threads the search runs on the calling thread
+  if (g->nthreads == 0) {
+    g->running = 1;
+    grep_worker(NULL);
+  }
+
+  set_status_msg("Searching %s for %.*s...", g->root, (int)plen, pattern);
+  return 0;
+}
+
+void project_grep_stop() {
+  struct project_grep *g = &config.project;
+
+  if (!g->active)
+    return;
+
+  pthread_mutex_lock(&g->lock);
+  g->stop = 1;
+  pthread_cond_broadcast(&g->wake);
+  pthread_mutex_unlock(&g->lock);
+  project_grep_join();
+
+  for (int i = 0; i < g->ntasks; i++) {
+    free(g->tasks[i].path);
+  }
+
+  while (g->head != NULL) {
+    grep_chunk *next = g->head->next;
+    free(g->head);
+    g->head = next;
+  }
+
+  while (g->rules != NULL) {
+    ignore_rules *next = g->rules->next;
+
+    for (int i = 0; i < g->rules->count; i++) {
+      free(g->rules->patterns[i].glob);
+    }
+
+    free(g->rules->patterns);
+    free(g->rules->base);
+    free(g->rules);
+    g->rules = next;
+  }
+
+  pthread_mutex_destroy(&g->lock);
+  pthread_cond_destroy(&g->wake);
+  free(g->tasks);
+  free(g->pattern);
+  free(g->root);
+  memset(g, 0, sizeof(*g));
+}
+
+void project_grep_join() {
+  struct project_grep *g = &config.project;
+
+  for (int i = 0; i < g->nthreads; i++) {
+    pthread_join(g->threads[i], NULL);
+  }
+
+  g->nthreads = 0;
+}
+
+int project_grep_poll() {
+  struct project_grep *g = &config.project;
+
+  if (!g->active || g->done)
+    return 0;
+
+  pthread_mutex_lock(&g->lock);
+  grep_chunk *chunk = g->head;
+  int running = g->running;
+  g->head = NULL;
+  g->tail = NULL;
+  g->files_seen = g->files;
+  g->matched_seen = g->matched;
+  pthread_mutex_unlock(&g->lock);
+
+  if (chunk == NULL && running > 0)
+    return 0;
+
+  // the results are loaded like the lines of a file
+  int modified = config.modified;
+  int undo_paused = config.undo.paused;
+  int journal_paused = config.journal.paused;
+  config.undo.paused = 1;
+  config.journal.paused = 1;
+
+  while (chunk != NULL) {
+    grep_chunk *next = chunk->next;
+    append_lines(chunk->data, chunk->len);
+    free(chunk);
+    chunk = next;
+  }
+
+  cold_flush();
+  config.journal.paused = journal_paused;
+  config.undo.paused = undo_paused;
+  config.modified = modified;
+  config.screen_dirty = 1;
+
+  // every result has been queued once no worker is left
+  if (running == 0) {
+    project_grep_join();
+    g->done = 1;
+    set_status_msg("%d matches in %d of %d files.", config.numrows,
+                   g->matched_seen, g->files_seen);
+  }
+
+  return 1;
+}
+
+int project_grep_open() {
+  if (config.cy >= config.numrows) {
+    set_status_msg("No result under the cursor.");
+    return -1;
+  }
+
+  erow *row = &config.editor_rows[config.cy];
+  char *s = row_chars(row);
+  int size = row->size;
+  int colon = -1;
+  int line = 0;
+
+  // the path ends at the first colon followed by digits and a colon
+  for (int i = 0; i < size && colon == -1; i++) {
+    int j = i + 1;
+
+    if (s[i] != ':')
+      continue;
+
+    while (j < size && isdigit((unsigned char)s[j]))
+      j++;
+
+    if (j > i + 1 && j < size && s[j] == ':') {
+      colon = i;
+      line = atoi(&s[i + 1]);
+    }
+  }
+
+  if (colon <= 0) {
+    set_status_msg("No result under the cursor.");
+    return -1;
+  }
+
+  if (config.filename != NULL && config.modified > 0) {
+    set_status_msg("The file has unsaved changes.");
+    return -1;
+  }
+
+  char *path = strndup(s, colon);
+
+  if (access(path, R_OK) == -1) {
+    set_status_msg("Can't open %s: %s", path, strerror(errno));
+    free(path);
+    return -1;
+  }
+
+  journal_close(1);
+  editor_close();
+
+  if (editor_open(path) == -1) {
+    set_status_msg("Can't open %s: %s", path, strerror(errno));
+    free(path);
+    return -1;
+  }
+
+  config.cy = line - 1 < config.numrows ? line - 1 : config.numrows;
+  if (config.cy < 0)
+    config.cy = 0;
+  config.cx = 0;
+  free(path);
+  return 0;
+}
+
+void *grep_worker(void *arg) {
+  struct project_grep *g = &config.project;
+  (void)arg;
+
+  pthread_mutex_lock(&g->lock);
+
+  while (1) {
+    while (g->ntasks == 0 && g->busy > 0 && !g->stop)
+      pthread_cond_wait(&g->wake, &g->lock);
+
+    if (g->stop || g->ntasks == 0)
+      break;
+
+    grep_task task = g->tasks[--g->ntasks];
+    g->busy++;
+    pthread_mutex_unlock(&g->lock);
+
+    if (task.is_dir)
+      grep_read_dir(&task);
+    else
+      grep_search_file(task.path);
+
+    free(task.path);
+    pthread_mutex_lock(&g->lock);
+    g->busy--;
+  }
+
+  // the workers still waiting find out the search is over
+  g->running--;
+  pthread_cond_broadcast(&g->wake);
+  pthread_mutex_unlock(&g->lock);
+  return NULL;
+}
+
+void grep_push_tasks(grep_task *tasks, int n) {
+  struct project_grep *g = &config.project;
+
+  if (n == 0)
+    return;
+
+  pthread_mutex_lock(&g->lock);
+
+  // the workers allocate with the libc functions, the trace counters
+  // are only updated by the main thread
+  if (g->ntasks + n > g->taskcap) {
+    while (g->ntasks + n > g->taskcap)
+      g->taskcap *= 2;
+    g->tasks = (realloc)(g->tasks, sizeof(grep_task) * g->taskcap);
+  }
+
+  memcpy(&g->tasks[g->ntasks], tasks, sizeof(grep_task) * n);
+  g->ntasks += n;
+  pthread_cond_broadcast(&g->wake);
+  pthread_mutex_unlock(&g->lock);
+}
+
+const char *grep_relative(const char *path) {
+  struct project_grep *g = &config.project;
+  return strcmp(path, g->root) == 0 ? "" : &path[g->root_len];
+}
+
+void grep_read_dir(grep_task *task) {
+  DIR *dir = opendir(task->path);
+
+  if (dir == NULL)
+    return;
+
+  ignore_rules *rules =
+      ignore_load(task->path, grep_relative(task->path), task->rules);
+  size_t dirlen = strlen(task->path);
+  int root = strcmp(task->path, ".") == 0;
+  int slash = task->path[dirlen - 1] == '/';
+  grep_task *found = NULL;
+  int nfound = 0;
+  int cap = 0;
+  struct dirent *e;
+
+  while ((e = readdir(dir)) != NULL) {
+    if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0 ||
+        strcmp(e->d_name, ".git") == 0)
+      continue;
+
+    // the entries of the current directory are named without ./
+    size_t namelen = strlen(e->d_name);
+    char *path = (malloc)(dirlen + namelen + 2);
+
+    if (root)
+      memcpy(path, e->d_name, namelen + 1);
+    else
+      sprintf(path, "%s%s%s", task->path, slash ? "" : "/", e->d_name);
+
+    int type = e->d_type;
+    struct stat st;
+
+    if (type == DT_UNKNOWN && lstat(path, &st) == 0)
+      type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : 0;
+
+    if ((type != DT_DIR && type != DT_REG) ||
+        ignore_match(rules, grep_relative(path), e->d_name, type == DT_DIR)) {
+      free(path);
+      continue;
+    }
+
+    if (nfound == cap) {
+      cap = cap ? cap * 2 : 16;
+      found = (realloc)(found, sizeof(grep_task) * cap);
+    }
+
+    found[nfound++] = (grep_task){path, type == DT_DIR, rules};
+  }
+
+  closedir(dir);
+  grep_push_tasks(found, nfound);
+  free(found);
+}
+
+void grep_search_file(const char *path) {
+  struct project_grep *g = &config.project;
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+
+  if (fd == -1)
+    return;
+
+  if (fstat(fd, &st) == -1 || st.st_size == 0) {
+    close(fd);
+    return;
+  }
+
+  // mapping a small file costs more than reading it
+  char small[GREP_MMAP_MIN];
+  size_t len = st.st_size;
+  int mapped = len > GREP_MMAP_MIN;
+  char *data = small;
+
+  if (mapped)
+    data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  else if (read(fd, small, len) != (ssize_t)len)
+    data = MAP_FAILED;
+
+  close(fd);
+
+  if (data == MAP_FAILED)
+    return;
+
+  // a null byte near the start makes it a binary file, as for git
+  if (memchr(data, '\0', len < BINARY_PROBE ? len : BINARY_PROBE)) {
+    if (mapped)
+      munmap(data, len);
+    return;
+  }
+
+  if (mapped)
+    madvise(data, len, MADV_SEQUENTIAL);
+
+  const char *p = data;
+  const char *end = &data[len];
+  const char *counted = data;
+  const char *m;
+  size_t pathlen = strlen(path);
+  char *out = NULL;
+  size_t outlen = 0;
+  size_t outcap = 0;
+  long line = 1;
+
+  while ((m = find_pattern(p, end - p, g->pattern, g->plen)) != NULL) {
+    const char *start = memrchr(p, '\n', m - p);
+    const char *nl;
+
+    start = start != NULL ? start + 1 : p;
+
+    while ((nl = memchr(counted, '\n', start - counted)) != NULL) {
+      line++;
+      counted = nl + 1;
+    }
+
+    const char *eol = memchr(m, '\n', end - m);
+    if (eol == NULL)
+      eol = end;
+
+    size_t textlen = eol - start;
+    while (textlen > 0 && start[textlen - 1] == '\r')
+      textlen--;
+    if (textlen > GREP_LINE_MAX)
+      textlen = GREP_LINE_MAX;
+
+    // the chunk starts with its header, which is filled in at the end
+    size_t need = sizeof(grep_chunk) + outlen + pathlen + textlen + 24;
+
+    if (need > outcap) {
+      outcap = need * 2;
+      out = (realloc)(out, outcap);
+    }
+
+    char *w = &out[sizeof(grep_chunk) + outlen];
+    int n = sprintf(w, "%s:%ld:", path, line);
+    memcpy(&w[n], start, textlen);
+    w[n + textlen] = '\n';
+    outlen += n + textlen + 1;
+
+    p = eol < end ? eol + 1 : end;
+  }
+
+  if (mapped)
+    munmap(data, len);
+
+  grep_chunk *chunk = (grep_chunk *)out;
+  pthread_mutex_lock(&g->lock);
+  g->files++;
+
+  if (chunk != NULL) {
+    chunk->next = NULL;
+    chunk->len = outlen;
+
+    if (g->tail != NULL)
+      g->tail->next = chunk;
+    else
+      g->head = chunk;
+
+    g->tail = chunk;
+    g->matched++;
+  }
+
+  pthread_mutex_unlock(&g->lock);
+}
+
+ignore_rules *ignore_load(const char *dir, const char *rel,
+                          ignore_rules *parent) {
+  struct project_grep *g = &config.project;
+  size_t dirlen = strlen(dir);
+  char *path = (malloc)(dirlen + 12);
+  sprintf(path, "%s/.gitignore", dir);
+  FILE *f = fopen(path, "r");
+  free(path);
+
+  if (f == NULL)
+    return parent;
+
+  ignore_rules *rules = (malloc)(sizeof(ignore_rules));
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t len;
+  int cap = 0;
+
+  rules->parent = parent;
+  rules->base = (strdup)(rel);
+  rules->patterns = NULL;
+  rules->count = 0;
+
+  while ((len = getline(&line, &linecap, f)) != -1) {
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' ||
+                       line[len - 1] == ' '))
+      line[--len] = '\0';
+
+    if (len == 0 || line[0] == '#')
+      continue;
+
+    ignore_pattern pat = {NULL, 0, 0, 0};
+    char *glob = line;
+
+    if (*glob == '!') {
+      pat.negate = 1;
+      glob++;
+    }
+
+    // a leading ! or # which is part of the name
+    if (*glob == '\\')
+      glob++;
+
+    size_t globlen = strlen(glob);
+    if (globlen > 0 && glob[globlen - 1] == '/') {
+      pat.dir_only = 1;
+      glob[--globlen] = '\0';
+    }
+
+    if (strncmp(glob, "**/", 3) == 0)
+      glob += 3;
+    else if (glob[0] == '/') {
+      pat.anchored = 1;
+      glob++;
+    }
+
+    pat.anchored |= strchr(glob, '/') != NULL;
+
+    if (*glob == '\0')
+      continue;
+
+    if (rules->count == cap) {
+      cap = cap ? cap * 2 : 8;
+      rules->patterns = (realloc)(rules->patterns, sizeof(ignore_pattern) * cap);
+    }
+
+    pat.glob = (strdup)(glob);
+    rules->patterns[rules->count++] = pat;
+  }
+
+  free(line);
+  fclose(f);
+
+  pthread_mutex_lock(&g->lock);
+  rules->next = g->rules;
+  g->rules = rules;
+  pthread_mutex_unlock(&g->lock);
+  return rules;
+}
+
+int ignore_match(ignore_rules *rules, const char *rel, const char *name,
+                 int is_dir) {
+  for (ignore_rules *r = rules; r != NULL; r = r->parent) {
+    const char *sub = r->base[0] != '\0' ? &rel[strlen(r->base) + 1] : rel;
+
+    for (int i = r->count - 1; i >= 0; i--) {
+      ignore_pattern *pat = &r->patterns[i];
+
+      if (pat->dir_only && !is_dir)
+        continue;
+
+      if (pat->anchored ? fnmatch(pat->glob, sub, FNM_PATHNAME) == 0
+                        : fnmatch(pat->glob, name, 0) == 0)
+        return !pat->negate;
+    }
+  }
+
+  return 0;
+}
+
+int hex_wanted(FILE *f) {
+  char probe[BINARY_PROBE];
+
+  if (config.hex.force != 0)
+    return config.hex.force > 0;
+
+  if (config.headless || is_gzip_file(f))
+    return 0;
+
+  size_t n = fread(probe, 1, sizeof(probe), f);
+  rewind(f);
+  return memchr(probe, '\0', n) != NULL;
+}
+
+int hex_open(FILE *f) {
+  struct hex_view *h = &config.hex;
+  struct stat st;
+
+  if (fstat(fileno(f), &st) == -1 ||
+      st.st_size / HEX_LINE_BYTES >= INT_MAX)
+    return -1;
+
+  unsigned char *data = NULL;
+
+  if (st.st_size > 0) {
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+
+    if (data == MAP_FAILED)
+      return -1;
+  }
+
+  h->active = 1;
+  h->data = data;
+  h->size = st.st_size;
+  h->match = -1;
+  h->digits = 8;
+
+  while (h->digits < 16 && (h->size >> (h->digits * 4)) > 0)
+    h->digits++;
+
+  config.cx = 0;
+  config.cy = 0;
+  config.rowoff = 0;
+  config.coloff = 0;
+  config.modified = 0;
+  config.screen_dirty = 1;
+  return 0;
+}
+
+void hex_close() {
+  struct hex_view *h = &config.hex;
+
+  if (!h->active)
+    return;
+
+  if (h->data != NULL)
+    munmap(h->data, h->size);
+
+  free(h->pattern);
+  h->active = 0;
+  h->data = NULL;
+  h->size = 0;
+  h->pattern = NULL;
+  h->plen = 0;
+}
+
+int hex_reopen(int on) {
+  if (config.filename == NULL) {
+    set_status_msg("There is no file to show.");
+    return -1;
+  }
+
+  if (config.modified > 0) {
+    set_status_msg("The file has unsaved changes.");
+    return -1;
+  }
+
+  if (on == config.hex.active)
+    return 0;
+
+  char *filename = strdup(config.filename);
+  follow_stop();
+  journal_close(1);
+  editor_close();
+
+  config.hex.force = on ? 1 : -1;
+  int result = editor_open(filename);
+  config.hex.force = 0;
+
+  if (result == -1)
+    set_status_msg("Can't open %s: %s", filename, strerror(errno));
+
+  free(filename);
+  return result;
+}
+
+int hex_lines() {
+  return (config.hex.size + HEX_LINE_BYTES - 1) / HEX_LINE_BYTES;
+}
+
+void hex_goto(long long offset) {
+  if (offset >= (long long)config.hex.size)
+    offset = (long long)config.hex.size - 1;
+  if (offset < 0)
+    offset = 0;
+
+  config.cy = offset / HEX_LINE_BYTES;
+  config.cx = offset % HEX_LINE_BYTES;
+}
+
+int hex_column(int cx) {
+  // the offset, two spaces, then a space after every byte and
+  // another one in the middle of the line
+  return config.hex.digits + 2 + cx * 3 + (cx >= HEX_LINE_BYTES / 2);
+}
+
+void hex_draw_line(struct ap_buf *buf, int line) {
+  struct hex_view *h = &config.hex;
+  long long start = (long long)line * HEX_LINE_BYTES;
+
+  if (start >= (long long)h->size) {
+    ap_buf_append(buf, "~", 1);
+    return;
+  }
+
+  static const char digits[] = "0123456789abcdef";
+  int n = h->size - start < HEX_LINE_BYTES ? h->size - start : HEX_LINE_BYTES;
+  char text[HEX_LINE_BYTES * 20 + 64];
+  int len = snprintf(text, sizeof(text), "%0*llx  ", h->digits, start);
+  int width = len;
+
+  if (width > config.cols) {
+    ap_buf_append(buf, text, config.cols);
+    return;
+  }
+
+  // the hex column, then the ASCII column, with the columns past
+  // the screen left out
+  for (int pass = 0; pass < 2; pass++) {
+    if (pass == 1) {
+      int pad = hex_column(HEX_LINE_BYTES) - width + 1;
+      if (pad > config.cols - width)
+        pad = config.cols - width;
+      memset(&text[len], ' ', pad);
+      len += pad;
+      width += pad;
+    }
+
+    for (int i = 0; i < n && width < config.cols; i++) {
+      long long offset = start + i;
+      unsigned char c = h->data[offset];
+      int marked = h->match != -1 && offset >= h->match &&
+                   offset < h->match + (long long)h->plen;
+
+      if (marked)
+        len += sprintf(&text[len], "\x1b[7m");
+
+      if (pass == 0) {
+        text[len++] = digits[c >> 4];
+        text[len++] = digits[c & 15];
+        width += 2;
+      } else {
+        text[len++] = c >= 32 && c < 127 ? c : '.';
+        width++;
+      }
+
+      if (marked)
+        len += sprintf(&text[len], "\x1b[m");
+
+      if (pass == 0 && width < config.cols) {
+        text[len++] = ' ';
+        width++;
+      }
+
+      if (pass == 0 && i == HEX_LINE_BYTES / 2 - 1 && width < config.cols) {
+        text[len++] = ' ';
+        width++;
+      }
+    }
+  }
+
+  ap_buf_append(buf, text, len);
+}
+
+char *hex_parse_pattern(const char *s, size_t *len) {
+  size_t n = strlen(s);
+  char *bytes = malloc(n + 1);
+  int high = -1;
+
+  *len = 0;
+
+  for (size_t i = 0; i <= n; i++) {
+    if (i == n) {
+      if (high == -1 && *len > 0)
+        return bytes;
+      break;
+    }
+
+    if (s[i] == ' ')
+      continue;
+
+    if (!isxdigit((unsigned char)s[i]))
+      break;
+
+    int v = isdigit((unsigned char)s[i]) ? s[i] - '0'
+                                         : tolower((unsigned char)s[i]) - 'a' + 10;
+
+    if (high == -1) {
+      high = v;
+    } else {
+      bytes[(*len)++] = high << 4 | v;
+      high = -1;
+    }
+  }
+
+  memcpy(bytes, s, n + 1);
+  *len = n;
+  return bytes;
+}
+
+long long hex_find(long long from, int backward) {
+  struct hex_view *h = &config.hex;
+  const char *data = (const char *)h->data;
+  long long size = h->size;
+
+  if (h->plen == 0 || (long long)h->plen > size)
+    return -1;
+
+  if (!backward) {
+    // from the byte after the offset to the end, then from the start
+    for (int round = 0; round < 2; round++) {
+      long long start = round == 0 ? from + 1 : 0;
+      long long end = round == 0 ? size : from + (long long)h->plen;
+
+      if (start < 0)
+        start = 0;
+      if (end > size)
+        end = size;
+      if (start >= end)
+        continue;
+
+      const char *m =
+          find_pattern(&data[start], end - start, h->pattern, h->plen);
+
+      if (m != NULL)
+        return m - data;
+    }
+
+    return -1;
+  }
+
+  // looks back for the first byte of the pattern, then compares the rest
+  for (int round = 0; round < 2; round++) {
+    long long pos = round == 0 ? from : size;
+    long long stop = round == 0 ? 0 : from;
+
+    while (pos > stop) {
+      const char *m = memrchr(&data[stop], h->pattern[0], pos - stop);
+
+      if (m == NULL)
+        break;
+
+      pos = m - data;
+      if (pos + (long long)h->plen <= size &&
+          memcmp(m, h->pattern, h->plen) == 0)
+        return pos;
+    }
+  }
+
+  return -1;
+}
+
+int hex_search(const char *s) {
+  struct hex_view *h = &config.hex;
+
+  free(h->pattern);
+  h->pattern = hex_parse_pattern(s, &h->plen);
+
+  // the match can start at the cursor
+  long long cursor = (long long)config.cy * HEX_LINE_BYTES + config.cx;
+  long long match = hex_find(cursor - 1, 0);
+
+  config.screen_dirty = 1;
+  h->match = match;
+
+  if (match == -1) {
+    set_status_msg("%s not found.", s);
+    return -1;
+  }
+
+  hex_goto(match);
+  return 0;
+}
+
+int hex_key_press(int key) {
+  struct hex_view *h = &config.hex;
+  long long cursor = (long long)config.cy * HEX_LINE_BYTES + config.cx;
+
+  switch (key) {
+  case ARROW_LEFT:
+    hex_goto(cursor - 1);
+    return 1;
+  case ARROW_RIGHT:
+    hex_goto(cursor + 1);
+    return 1;
+  case ARROW_UP:
+    if (config.cy > 0)
+      hex_goto(cursor - HEX_LINE_BYTES);
+    return 1;
+  case ARROW_DOWN:
+    if (config.cy < hex_lines() - 1)
+      hex_goto(cursor + HEX_LINE_BYTES);
+    return 1;
+  case PAGE_UP:
+    hex_goto(cursor - (long long)config.rows * HEX_LINE_BYTES);
+    return 1;
+  case PAGE_DOWN:
+    hex_goto(cursor + (long long)config.rows * HEX_LINE_BYTES);
+    return 1;
+  case HOME_KEY:
+    hex_goto(cursor - config.cx);
+    return 1;
+  case END_KEY:
+    hex_goto(cursor - config.cx + HEX_LINE_BYTES - 1);
+    return 1;
+
+  case CTRL_KEY('f'): {
+    char *pattern = editor_prompt("Search (hex bytes or text): %s", "");
+
+    if (pattern != NULL) {
+      if (pattern[0] != '\0')
+        hex_search(pattern);
+      free(pattern);
+    }
+    return 1;
+  }
+
+  case CTRL_KEY('n'):
+  case CTRL_KEY('p'): {
+    long long match = hex_find(cursor, key == CTRL_KEY('p'));
+
+    if (match != -1) {
+      h->match = match;
+      config.screen_dirty = 1;
+      hex_goto(match);
+    }
+    return 1;
+  }
+
+  case CTRL_KEY('q'):
+  case CTRL_KEY('e'):
+  case CTRL_KEY('g'):
+  case CTRL_KEY('l'):
+  case '\x1b':
+    return 0;
+  }
+
+  set_status_msg("The hex view is read-only, hex off shows the file as text.");
+  return 1;
+}
+
+int hex_command(int argc, char **argv) {
+  struct hex_view *h = &config.hex;
+
+  if (strcmp(argv[0], "goto") == 0 && argc >= 2) {
+    size_t arglen = strlen(argv[1]);
+
+    if (arglen > 0 && argv[1][arglen - 1] == '%') {
+      double percent = strtod(argv[1], NULL);
+
+      if (percent < 0 || percent > 100) {
+        set_status_msg("%s is out of range.", argv[1]);
+        return -1;
+      }
+
+      hex_goto((long long)(h->size * percent / 100));
+      return 0;
+    }
+
+    long long line = strtoll(argv[1], NULL, 10);
+
+    if (line < 1 || line > hex_lines()) {
+      set_status_msg("Line %s is out of range.", argv[1]);
+      return -1;
+    }
+
+    hex_goto((line - 1) * HEX_LINE_BYTES);
+    return 0;
+  }
+
+  if (strcmp(argv[0], "goto-byte") == 0 && argc >= 2) {
+    long long offset = strtoll(argv[1], NULL, 10);
+
+    if (offset < 0 || offset >= (long long)h->size) {
+      set_status_msg("Byte %s is out of range.", argv[1]);
+      return -1;
+    }
+
+    hex_goto(offset);
+    return 0;
+  }
+
+  if (strcmp(argv[0], "search") == 0 && argc >= 2 && argv[1][0] != '\0')
+    return hex_search(argv[1]);
+
+  if (strcmp(argv[0], "hex") == 0 || strcmp(argv[0], "mem") == 0 ||
+      strcmp(argv[0], "trace") == 0 || strcmp(argv[0], "set") == 0 ||
+      strcmp(argv[0], "grep-dir") == 0)
+    return 1;
+
+  set_status_msg("%s isn't available in the hex view.", argv[0]);
+  return -1;
+}
+
+void column_start(char delim) {
+  struct columns *c = &config.columns;
+
+  column_stop();
+
+  if (config.wrap) {
+    toggle_wrap();
+    c->wrap = 1;
+  }
+
+  c->delim = delim != 0 ? delim : column_detect_delimiter();
+  c->quotes = c->delim != '\t';
+  c->cache = malloc(sizeof(column_fields) * COLUMN_CACHE_SLOTS);
+
+  for (int i = 0; i < COLUMN_CACHE_SLOTS; i++) {
+    c->cache[i] = (column_fields){-1, 0, 0, 0, NULL};
+  }
+
+  c->active = 1;
+  column_sample();
+  config.screen_dirty = 1;
+}
+
+void column_stop() {
+  struct columns *c = &config.columns;
+
+  if (!c->active)
+    return;
+
+  int wrap = c->wrap;
+
+  for (int i = 0; i < COLUMN_CACHE_SLOTS; i++) {
+    free(c->cache[i].starts);
+  }
+
+  free(c->cache);
+  free(c->widths);
+  free(c->pos);
+  memset(c, 0, sizeof(*c));
+
+  if (wrap)
+    toggle_wrap();
+
+  config.screen_dirty = 1;
+}
+
+char column_detect_delimiter() {
+  const char *ext = config.filename ? strrchr(config.filename, '.') : NULL;
+
+  if (ext != NULL && strcasecmp(ext, ".tsv") == 0)
+    return '\t';
+  if (ext != NULL && strcasecmp(ext, ".csv") == 0)
+    return ',';
+
+  const char candidates[] = ",\t;|";
+  int best = 0, most = 0;
+
+  for (int i = 0; config.numrows > 0 && candidates[i] != '\0'; i++) {
+    erow *row = &config.editor_rows[0];
+    const char *s = row_peek(row);
+    int n = 0;
+
+    for (int j = 0; j < row->size; j++) {
+      n += s[j] == candidates[i];
+    }
+
+    if (n > most) {
+      most = n;
+      best = i;
+    }
+  }
+
+  return candidates[best];
+}
+
+int column_scan(const char *s, int len, char delim, int quotes,
+                uint32_t **starts, int *cap) {
+  int n = 0;
+  int quoted = 0;
+  int i = 0;
+
+  // the end of the last field takes one more slot
+  if (*cap < 16) {
+    *cap = 16;
+    *starts = realloc(*starts, sizeof(uint32_t) * *cap);
+  }
+
+  uint32_t *out = *starts;
+  out[n++] = 0;
+
+#ifdef __SSE2__
+  __m128i d = _mm_set1_epi8(delim);
+  __m128i q = _mm_set1_epi8(quotes ? '"' : delim);
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i c = _mm_loadu_si128((const __m128i *)&s[i]);
+    unsigned int mask = _mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(c, d), _mm_cmpeq_epi8(c, q)));
+
+    while (mask != 0) {
+      int k = __builtin_ctz(mask);
+
+      if (s[i + k] != delim)
+        quoted = !quoted;
+      else if (!quoted) {
+        if (n + 1 == *cap) {
+          *cap *= 2;
+          out = *starts = realloc(*starts, sizeof(uint32_t) * *cap);
+        }
+        out[n++] = i + k + 1;
+      }
+      mask &= mask - 1;
+    }
+  }
+#endif
+
+  for (; i < len; i++) {
+    if (quotes && s[i] == '"')
+      quoted = !quoted;
+    else if (s[i] == delim && !quoted) {
+      if (n + 1 == *cap) {
+        *cap *= 2;
+        out = *starts = realloc(*starts, sizeof(uint32_t) * *cap);
+      }
+      out[n++] = i + 1;
+    }
+  }
+
+  out[n] = len + 1;
+  return n;
+}
+
+column_fields *row_fields(int at) {
+  struct columns *c = &config.columns;
+  column_fields *f = &c->cache[at % COLUMN_CACHE_SLOTS];
+
+  if (f->row == at && f->gen == c->gen)
+    return f;
+
+  erow *row = &config.editor_rows[at];
+  f->count = column_scan(row_peek(row), row->size, c->delim, c->quotes,
+                         &f->starts, &f->cap);
+  f->row = at;
+  f->gen = c->gen;
+  return f;
+}
+
+int field_width(const char *s, int len) {
+  int width = 0;
+
+  // the continuation bytes of utf-8 characters take no column
+  for (int i = 0; i < len; i++) {
+    width += ((unsigned char)s[i] & 0xc0) != 0x80;
+  }
+
+  return width;
+}
+
+int column_width(int col) {
+  struct columns *c = &config.columns;
+  return col < c->count ? c->widths[col] : COLUMN_DEFAULT_WIDTH;
+}
+
+int column_pos(int col) {
+  struct columns *c = &config.columns;
+
+  if (col <= c->count)
+    return c->pos[col];
+
+  return c->pos[c->count] +
+         (col - c->count) * (COLUMN_DEFAULT_WIDTH + COLUMN_GAP);
+}
+
+void column_sample() {
+  struct columns *c = &config.columns;
+  int n = config.numrows < COLUMN_SAMPLE_ROWS ? config.numrows
+                                              : COLUMN_SAMPLE_ROWS;
+  uint32_t *starts = NULL;
+  int cap = 0;
+
+  c->count = 0;
+
+  for (int i = 0; i < n; i++) {
+    // the head of the file, then rows spread evenly over the rest
+    int at = i < COLUMN_SAMPLE_HEAD
+                 ? i
+                 : COLUMN_SAMPLE_HEAD +
+                       (long long)(i - COLUMN_SAMPLE_HEAD) *
+                           (config.numrows - COLUMN_SAMPLE_HEAD) /
+                           (n - COLUMN_SAMPLE_HEAD);
+    erow *row = &config.editor_rows[at];
+    const char *s = row_peek(row);
+    int count = column_scan(s, row->size, c->delim, c->quotes, &starts, &cap);
+
+    if (count > c->count) {
+      c->widths = realloc(c->widths, sizeof(int) * count);
+
+      for (int j = c->count; j < count; j++) {
+        c->widths[j] = 1;
+      }
+
+      c->count = count;
+    }
+
+    for (int j = 0; j < count; j++) {
+      int width = field_width(&s[starts[j]], starts[j + 1] - 1 - starts[j]);
+
+      if (width > COLUMN_MAX_WIDTH)
+        width = COLUMN_MAX_WIDTH;
+      if (width > c->widths[j])
+        c->widths[j] = width;
+    }
+  }
+
+  free(starts);
+
+  c->pos = realloc(c->pos, sizeof(int) * (c->count + 1));
+  c->pos[0] = 0;
+
+  for (int j = 0; j < c->count; j++) {
+    c->pos[j + 1] = c->pos[j] + c->widths[j] + COLUMN_GAP;
+  }
+}
+
+int column_at(column_fields *f, int cx) {
+  int lo = 0, hi = f->count - 1;
+
+  // the last field starting at or before cx
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+
+    if ((int)f->starts[mid] <= cx)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+
+  return lo;
+}
+
+int column_cx_to_rx(int at, int cx) {
+  column_fields *f = row_fields(at);
+  const char *s = row_peek(&config.editor_rows[at]);
+  int field = column_at(f, cx);
+  int start = f->starts[field];
+  int width = field_width(&s[start], cx - start);
+
+  if (width > column_width(field))
+    width = column_width(field);
+
+  return column_pos(field) + width;
+}
+
+int column_rx_to_cx(int at, int rx) {
+  column_fields *f = row_fields(at);
+  const char *s = row_peek(&config.editor_rows[at]);
+  int lo = 0, hi = f->count - 1;
+
+  // the last field whose column starts at or before rx
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+
+    if (column_pos(mid) <= rx)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+
+  int cx = f->starts[lo];
+  int end = f->starts[lo + 1] - 1;
+  int col = rx - column_pos(lo);
+
+  while (col > 0 && cx < end) {
+    cx++;
+    while (cx < end && ((unsigned char)s[cx] & 0xc0) == 0x80)
+      cx++;
+    col--;
+  }
+
+  return cx;
+}
+
+void column_draw_row(struct ap_buf *buf, int at) {
+  column_fields *f = row_fields(at);
+  const char *s = row_peek(&config.editor_rows[at]);
+  int left = config.coloff;
+  int right = config.coloff + config.cols;
+  int col = 0;
+
+  for (int i = 0; i < f->count && col < right; i++) {
+    int pos = column_pos(i);
+    int width = column_width(i);
+    int start = f->starts[i];
+    int end = f->starts[i + 1] - 1;
+    int cut = field_width(&s[start], end - start) > width;
+
+    for (; col < pos && col < right; col++) {
+      if (col >= left)
+        ap_buf_append(buf, " ", 1);
+    }
+
+    // the last column of a cut field shows a '>'
+    for (int j = start, w = 0; j < end && w < width && col < right; w++) {
+      int len = utf8_seq_len((unsigned char)s[j]);
+
+      if (len == 0 || j + len > end)
+        len = 1;
+
+      if (col >= left) {
+        if (cut && w == width - 1)
+          ap_buf_append(buf, ">", 1);
+        else if ((unsigned char)s[j] < 32 || s[j] == 127 ||
+                 ((unsigned char)s[j] >= 0x80 && len == 1))
+          ap_buf_append(buf, "?", 1);
+        else
+          ap_buf_append(buf, &s[j], len);
       }
+
+      j += len;
+      col++;
     }
-  }
 
-  free(lps);
-  *matches_len = matches_idx;
-  return matches;
+  }
 }
 
-void editor_search() {
-  char *pattern = editor_prompt("Search: %s", "");
+int column_goto(int field) {
+  if (config.cy >= config.numrows)
+    return -1;
 
-  if (pattern == NULL)
+  column_fields *f = row_fields(config.cy);
+
+  if (field < 0 || field >= f->count)
+    return -1;
+
+  config.cx = f->starts[field];
+  return 0;
+}
+
+void column_move(int fields) {
+  if (config.cy >= config.numrows)
     return;
 
-  size_t plen = strlen(pattern);
-  if (config.search_matches) {
-    free(config.search_matches);
+  column_fields *f = row_fields(config.cy);
+  int field = column_at(f, config.cx) + fields;
+
+  if (field < 0)
+    field = 0;
+  if (field >= f->count)
+    field = f->count - 1;
+
+  config.cx = f->starts[field];
+}
+
+int fold_active() {
+  return config.folds.count > 0 && !config.filter.active;
+}
+
+int fold_check() {
+  if (config.wrap) {
+    set_status_msg("Folding is off with soft wrap.");
+    return -1;
   }
 
-  int matches_len = 10;
-  int found_match = 0;
-  config.search_matches = malloc(sizeof(search_match) * matches_len);
+  if (config.filter.active) {
+    set_status_msg("Folding is off in the grep view.");
+    return -1;
+  }
 
-  for (int i = 0; i < config.numrows; i++) {
-    erow *row = &config.editor_rows[i];
-    int m_len;
-    int *matches = kmp_matching(row->render, pattern, row->rsize, plen, &m_len);
+  return 0;
+}
 
-    if (m_len == 0)
-      continue;
+int row_indent(int row) {
+  erow *r = &config.editor_rows[row];
+  const char *s = row_peek(r);
+  int width = 0;
+
+  for (int i = 0; i < r->size; i++) {
+    if (s[i] == '\t')
+      width += config.tab_stop - width % config.tab_stop;
+    else if (s[i] == ' ')
+      width++;
+    else if (!isspace((unsigned char)s[i]))
+      return width;
+  }
 
-    for (int j = 0; j < m_len; j++) {
-      search_match new_match;
-      new_match.cx = row_rx_to_cx(row, matches[j] + plen);
-      new_match.cy = i;
+  return -1;
+}
 
-      if (matches_len - 1 <= found_match) {
-        matches_len *= 2;
-        config.search_matches =
-            realloc(config.search_matches, sizeof(search_match) * matches_len);
+int fold_region(int row) {
+  erow *r = &config.editor_rows[row];
+  const char *s = row_peek(r);
+  int last = r->size - 1;
+
+  while (last >= 0 && isspace((unsigned char)s[last]))
+    last--;
+
+  if (last >= 0 && memchr("{[(", s[last], 3)) {
+    // only the bracket ending the header is counted, so "} else {"
+    // folds up to the bracket closing the block it opens
+    int depth = 1;
+
+    for (int at = row + 1; at < config.numrows; at++) {
+      erow *t = &config.editor_rows[at];
+      const char *c = row_peek(t);
+      char quote = 0;
+
+      for (int i = 0; i < t->size; i++) {
+        if (quote) {
+          if (c[i] == '\\')
+            i++;
+          else if (c[i] == quote)
+            quote = 0;
+        } else if (c[i] == '"' || c[i] == '\'') {
+          quote = c[i];
+        } else if (memchr("{[(", c[i], 3)) {
+          depth++;
+        } else if (memchr("}])", c[i], 3) && --depth == 0) {
+          // the row with the closing bracket stays shown
+          return at > row + 1 ? at : -1;
+        }
       }
+    }
+  }
 
-      config.search_matches[found_match++] = new_match;
+  int indent = row_indent(row);
+
+  if (indent < 0)
+    return -1;
+
+  int end = row + 1;
+
+  for (int at = row + 1; at < config.numrows; at++) {
+    int i = row_indent(at);
+
+    if (i < 0)
+      continue;
+    if (i <= indent)
+      break;
+    end = at + 1;
+  }
+
+  return end > row + 1 ? end : -1;
+}
+
+int fold_find(int row) {
+  struct folds *f = &config.folds;
+  int lo = 0, hi = f->count;
+
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+
+    if (f->ranges[mid].start <= row)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo - 1;
+}
+
+void fold_sum(int from) {
+  struct folds *f = &config.folds;
+
+  for (int i = from; i < f->count; i++) {
+    f->hidden[i + 1] = f->hidden[i] + f->ranges[i].end - f->ranges[i].start;
+  }
+}
+
+void fold_add(int start, int end) {
+  struct folds *f = &config.folds;
+
+  // the folds overlapping the new one or its header are replaced
+  int lo = fold_find(start - 1);
+  if (lo < 0 || f->ranges[lo].end < start)
+    lo++;
+  int hi = fold_find(end) + 1;
+
+  if (f->count - (hi - lo) + 1 > f->cap) {
+    f->cap = f->cap ? f->cap * 2 : 64;
+    f->ranges = realloc(f->ranges, sizeof(fold_range) * f->cap);
+    f->hidden = realloc(f->hidden, sizeof(int) * (f->cap + 1));
+  }
+
+  memmove(&f->ranges[lo + 1], &f->ranges[hi],
+          sizeof(fold_range) * (f->count - hi));
+  f->ranges[lo].start = start;
+  f->ranges[lo].end = end;
+  f->count += 1 - (hi - lo);
+  f->hidden[0] = 0;
+  fold_sum(lo);
+  config.screen_dirty = 1;
+}
+
+void fold_remove(int i) {
+  struct folds *f = &config.folds;
+
+  memmove(&f->ranges[i], &f->ranges[i + 1],
+          sizeof(fold_range) * (f->count - i - 1));
+  f->count--;
+  fold_sum(i);
+  config.screen_dirty = 1;
+}
+
+int fold_toggle(int row) {
+  if (row >= config.numrows)
+    return -1;
+
+  int i = fold_find(row + 1);
+
+  if (i >= 0 && config.folds.ranges[i].start == row + 1) {
+    fold_remove(i);
+    return 0;
+  }
+
+  int end = fold_region(row);
+
+  if (end < 0) {
+    set_status_msg("Nothing to fold at line %d", row + 1);
+    return -1;
+  }
+
+  fold_add(row + 1, end);
+
+  if (config.cy > row && config.cy < end) {
+    config.cy = row;
+    config.cx = 0;
+  }
+
+  return 0;
+}
+
+void fold_all(int from, int to, int depth) {
+  if (from == 0 && to == config.numrows)
+    fold_clear();
+
+  for (int row = from; row < to;) {
+    int end = fold_region(row);
+
+    if (end < 0 || end > to) {
+      row++;
+      continue;
     }
+
+    if (depth <= 1)
+      fold_add(row + 1, end);
+    else
+      fold_all(row + 1, end, depth - 1);
+
+    row = end;
   }
+}
 
-  config.search_match_found = found_match;
-  move_cursor_to_search_match(0);
+void fold_clear() {
+  free(config.folds.ranges);
+  free(config.folds.hidden);
+  memset(&config.folds, 0, sizeof(config.folds));
+  config.screen_dirty = 1;
 }
 
-void move_cursor_to_search_match(int match_idx) {
-  if (match_idx < 0 || match_idx + 1 > config.search_match_found)
+int fold_hidden(int row) {
+  if (!fold_active())
+    return 0;
+
+  int i = fold_find(row + 1);
+
+  if (i < 0 || config.folds.ranges[i].start != row + 1)
+    return 0;
+
+  return config.folds.ranges[i].end - config.folds.ranges[i].start;
+}
+
+int fold_line(int row) {
+  struct folds *f = &config.folds;
+  int i = fold_find(row);
+
+  if (i < 0)
+    return row;
+
+  if (row < f->ranges[i].end)
+    return f->ranges[i].start - 1 - f->hidden[i];
+
+  return row - f->hidden[i + 1];
+}
+
+int fold_line_to_row(int line) {
+  struct folds *f = &config.folds;
+  int lo = 0, hi = f->count;
+
+  // the last fold whose header is shown before the line
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+
+    if (f->ranges[mid].start - 1 - f->hidden[mid] < line)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo > 0 ? line + f->hidden[lo] : line;
+}
+
+void fold_reveal(int row) {
+  int i = fold_find(row);
+
+  if (i >= 0 && row < config.folds.ranges[i].end)
+    fold_remove(i);
+}
+
+void fold_move_cursor(int lines) {
+  int rx = config.cy < config.numrows
+               ? row_cx_to_rx(&config.editor_rows[config.cy], config.cx)
+               : 0;
+  long long line = (long long)fold_line(config.cy) + lines;
+  int last = fold_line(config.numrows);
+
+  if (line < 0)
+    line = 0;
+  if (line > last)
+    line = last;
+
+  config.cy = fold_line_to_row(line);
+
+  if (config.cy >= config.numrows) {
+    config.cy = config.numrows;
+    config.cx = 0;
     return;
+  }
 
-  search_match match = config.search_matches[match_idx];
-  config.cx = match.cx;
-  config.cy = match.cy;
-  config.current_search_idx = match_idx;
+  config.cx = row_rx_to_cx(&config.editor_rows[config.cy], rx);
 }
 
-void increment_search() {
-  int new_idx = (config.current_search_idx + 1) % config.search_match_found;
+void fold_insert_rows(int at, int n) {
+  struct folds *f = &config.folds;
+  int count = 0;
 
-  move_cursor_to_search_match(new_idx);
+  if (f->count == 0)
+    return;
+
+  for (int i = 0; i < f->count; i++) {
+    fold_range r = f->ranges[i];
+
+    // rows inserted right after the header land in the fold
+    if (at >= r.start && at < r.end)
+      continue;
+
+    if (at < r.start) {
+      r.start += n;
+      r.end += n;
+    }
+
+    f->ranges[count++] = r;
+  }
+
+  if (count != f->count)
+    config.screen_dirty = 1;
+
+  f->count = count;
+  fold_sum(0);
 }
 
-void decrement_search() {
-  int new_idx =
-      config.current_search_idx == 0
-          ? config.search_match_found - 1
-          : (config.current_search_idx - 1) % config.search_match_found;
+void fold_delete_rows(int at, int n) {
+  struct folds *f = &config.folds;
+  int count = 0;
 
-  move_cursor_to_search_match(new_idx);
+  if (f->count == 0)
+    return;
+
+  for (int i = 0; i < f->count; i++) {
+    fold_range r = f->ranges[i];
+
+    if (at + n < r.start) {
+      r.start -= n;
+      r.end -= n;
+    } else if (at < r.end) {
+      continue;
+    }
+
+    f->ranges[count++] = r;
+  }
+
+  if (count != f->count)
+    config.screen_dirty = 1;
+
+  f->count = count;
+  fold_sum(0);
 }
 
-void append_erow(char *s, size_t len) {
-  config.editor_rows =
-      realloc(config.editor_rows, sizeof(erow) * (config.numrows + 1));
+void permute_erows(int at, int n, const uint32_t *perm, int inverse) {
+  uint64_t trace_start = trace_now();
 
-  erow new_row;
-  new_row.size = len;
-  new_row.chars = malloc(len + 1);
-  new_row.rsize = 0;
-  new_row.render = NULL;
-
-  memcpy(new_row.chars, s, len);
-  new_row.chars[len] = '\0';
-  update_erow(&new_row);
-  config.editor_rows[config.numrows] = new_row;
+  if (n <= 0)
+    return;
 
-  config.numrows++;
+  erow *rows = &config.editor_rows[at];
+  erow *moved = malloc(sizeof(erow) * n);
+  uint32_t *applied = NULL;
+
+  for (int i = 0; i < n; i++) {
+    if (inverse)
+      moved[perm[i]] = rows[i];
+    else
+      moved[i] = rows[perm[i]];
+  }
+
+  memcpy(rows, moved, sizeof(erow) * n);
+  free(moved);
+
+  // the history and the journal get the permutation which was applied
+  if (inverse) {
+    applied = malloc(sizeof(uint32_t) * n);
+    for (int i = 0; i < n; i++) {
+      applied[perm[i]] = i;
+    }
+    perm = applied;
+  }
+
+  undo_record_perm(at, n, perm);
+  journal_record(JOURNAL_PERM_ROWS, at, 0, (const char *)perm,
+                 sizeof(uint32_t) * n);
+  free(applied);
+
+  filter_rescan();
+  fold_clear();
+  invalidate_highlight(at);
+  config.wrap_dirty = 1;
+  config.offsets_dirty = 1;
+  config.columns.gen++;
+  config.screen_dirty = 1;
   config.modified++;
+
+  trace_event_end(PROBE_EDIT, trace_start);
 }
 
-void insert_erow(int at, char *s, size_t len) {
-  if (at < 0 || at > config.numrows)
-    return;
+double leading_number(const char *s, int len) {
+  int i = 0;
 
-  config.editor_rows =
-      realloc(config.editor_rows, sizeof(erow) * (config.numrows + 1));
+  while (i < len && (s[i] == ' ' || s[i] == '\t'))
+    i++;
 
-  memmove(&config.editor_rows[at + 1], &config.editor_rows[at],
-          sizeof(erow) * (config.numrows - at));
+  int negative = i < len && s[i] == '-';
+  if (negative)
+    i++;
 
-  erow new_row;
-  new_row.size = len;
-  new_row.chars = malloc(len + 1);
-  new_row.rsize = 0;
-  new_row.render = NULL;
-
-  memcpy(new_row.chars, s, len);
-  new_row.chars[len] = '\0';
-  update_erow(&new_row);
-  config.editor_rows[at] = new_row;
+  double v = 0, scale = 1;
+  int fraction = 0;
+
+  for (; i < len; i++) {
+    if (s[i] >= '0' && s[i] <= '9') {
+      if (fraction) {
+        scale /= 10;
+        v += (s[i] - '0') * scale;
+      } else {
+        v = v * 10 + (s[i] - '0');
+      }
+    } else if (s[i] == '.' && !fraction) {
+      fraction = 1;
+    } else {
+      break;
+    }
+  }
+
+  return negative ? -v : v;
+}
+
+int sort_key_compare(const sort_key *a, const sort_key *b, int flags) {
+  if (flags & SORT_NUMERIC)
+    return (a->num > b->num) - (a->num < b->num);
+
+  int len = a->len < b->len ? a->len : b->len;
+
+  if (flags & SORT_NOCASE) {
+    // ASCII letters only, so the order doesn't depend on the locale
+    for (int i = 0; i < len; i++) {
+      unsigned char ca = a->s[i], cb = b->s[i];
+      if (ca >= 'A' && ca <= 'Z')
+        ca += 'a' - 'A';
+      if (cb >= 'A' && cb <= 'Z')
+        cb += 'a' - 'A';
+      if (ca != cb)
+        return ca - cb;
+    }
+  } else {
+    int d = memcmp(a->s, b->s, len);
+    if (d != 0)
+      return d;
+  }
+
+  return a->len - b->len;
+}
+
+int sort_compare(const sort_key *a, const sort_key *b, int flags) {
+  int d = sort_key_compare(a, b, flags);
+
+  if (d == 0 && (flags & (SORT_NUMERIC | SORT_NOCASE)))
+    d = sort_key_compare(a, b, 0);
+
+  if (flags & SORT_REVERSE)
+    d = -d;
+
+  if (d == 0)
+    d = (a->index > b->index) - (a->index < b->index);
+
+  return d;
+}
+
+void merge_sort_runs(const sort_key *src, sort_key *dst, int start, int mid,
+                     int end, int flags) {
+  int i = start, j = mid, k = start;
+
+  while (i < mid && j < end) {
+    if (sort_compare(&src[j], &src[i], flags) < 0)
+      dst[k++] = src[j++];
+    else
+      dst[k++] = src[i++];
+  }
+
+  memcpy(&dst[k], &src[i], sizeof(sort_key) * (mid - i));
+  k += mid - i;
+  memcpy(&dst[k], &src[j], sizeof(sort_key) * (end - j));
+}
+
+sort_key *merge_sort_keys(sort_key *keys, sort_key *tmp, int start, int end,
+                          int flags) {
+  for (int lo = start; lo < end; lo += SORT_INSERTION_RUN) {
+    int hi = lo + SORT_INSERTION_RUN < end ? lo + SORT_INSERTION_RUN : end;
+
+    for (int i = lo + 1; i < hi; i++) {
+      sort_key key = keys[i];
+      int j = i;
+
+      while (j > lo && sort_compare(&keys[j - 1], &key, flags) > 0) {
+        keys[j] = keys[j - 1];
+        j--;
+      }
+      keys[j] = key;
+    }
+  }
+
+  sort_key *src = keys, *dst = tmp;
+
+  for (int width = SORT_INSERTION_RUN; width < end - start; width *= 2) {
+    for (int lo = start; lo < end; lo += width * 2) {
+      int mid = lo + width < end ? lo + width : end;
+      int hi = mid + width < end ? mid + width : end;
+      merge_sort_runs(src, dst, lo, mid, hi, flags);
+    }
+
+    sort_key *swap = src;
+    src = dst;
+    dst = swap;
+  }
+
+  return src;
+}
+
+void *sort_worker(void *arg) {
+  sort_job *job = arg;
+
+  if (job->mid != -1) {
+    merge_sort_runs(job->src, job->dst, job->start, job->mid, job->end,
+                    job->flags);
+    return NULL;
+  }
+
+  sort_key *sorted =
+      merge_sort_keys(job->src, job->dst, job->start, job->end, job->flags);
+
+  if (sorted != job->src)
+    memcpy(&job->src[job->start], &sorted[job->start],
+           sizeof(sort_key) * (job->end - job->start));
+
+  return NULL;
+}
+
+void run_sort_jobs(sort_job *jobs, int n) {
+  pthread_t threads[SORT_MAX_THREADS];
+  int started[SORT_MAX_THREADS] = {0};
+
+  // a job whose thread can't be started runs on the calling thread
+  for (int i = 1; i < n; i++) {
+    started[i] = pthread_create(&threads[i], NULL, sort_worker, &jobs[i]) == 0;
+  }
 
-  config.numrows++;
-  config.modified++;
+  sort_worker(&jobs[0]);
+
+  for (int i = 1; i < n; i++) {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+    else
+      sort_worker(&jobs[i]);
+  }
 }
 
-void delete_erow(int at) {
-  if (at < 0 || at > config.numrows)
+void parallel_sort_keys(sort_key *keys, int n, int flags) {
+  if (n < 2)
     return;
 
-  erow *row = &config.editor_rows[at];
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int nthreads = n / SORT_MIN_ROWS;
 
-  free(row->chars);
-  free(row->render);
-  memmove(&config.editor_rows[at], &config.editor_rows[at + 1],
-          sizeof(erow) * (config.numrows - at - 1));
-  config.numrows--;
-  config.modified++;
-}
+  if (nthreads > cores)
+    nthreads = cores;
+  if (nthreads > SORT_MAX_THREADS)
+    nthreads = SORT_MAX_THREADS;
+  if (nthreads < 1)
+    nthreads = 1;
 
-int row_cx_to_rx(erow *row, int cx) {
-  int rx = 0;
+  sort_key *tmp = malloc(sizeof(sort_key) * n);
+  sort_job jobs[SORT_MAX_THREADS];
+  int bounds[SORT_MAX_THREADS + 1];
 
-  for (int i = 0; i < cx; i++) {
-    if (row->chars[i] == '\t') {
-      rx += (TAB_STOP - 1) + (rx % TAB_STOP);
-    }
+  for (int i = 0; i <= nthreads; i++) {
+    bounds[i] = (long long)n * i / nthreads;
+  }
 
-    rx++;
+  for (int i = 0; i < nthreads; i++) {
+    jobs[i] = (sort_job){keys, tmp, bounds[i], -1, bounds[i + 1], flags};
   }
+  run_sort_jobs(jobs, nthreads);
 
-  return rx;
-}
+  // every round merges the runs in pairs, a run without a pair is copied
+  sort_key *src = keys, *dst = tmp;
+  int runs = nthreads;
 
-int row_rx_to_cx(erow *row, int rx) {
-  int current_cx = 0;
-  int cx;
+  while (runs > 1) {
+    int njobs = 0;
 
-  for (cx = 0; cx < row->size; cx++) {
-    if (row->chars[cx] == '\t') {
-      current_cx += (TAB_STOP - 1) - (current_cx % TAB_STOP);
+    for (int i = 0; i < runs; i += 2) {
+      int mid = bounds[i + 1];
+      int end = i + 2 <= runs ? bounds[i + 2] : mid;
+      jobs[njobs++] = (sort_job){src, dst, bounds[i], mid, end, flags};
     }
 
-    current_cx++;
+    run_sort_jobs(jobs, njobs);
+
+    for (int i = 0; i < njobs; i++) {
+      bounds[i] = jobs[i].start;
+    }
+    bounds[njobs] = n;
+    runs = njobs;
 
-    if (current_cx > rx)
-      return cx;
+    sort_key *swap = src;
+    src = dst;
+    dst = swap;
   }
 
-  return cx;
+  if (src != keys)
+    memcpy(keys, src, sizeof(sort_key) * n);
+
+  free(tmp);
 }
 
-void insert_char_at_row(erow *row, int at, char c) {
-  if (at < 0 || at > row->size)
-    at = row->size;
+int sort_rows(int at, int n, int flags, int column) {
+  if (n < 2)
+    return 0;
 
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-  row->size++;
-  row->chars[at] = c;
-  update_erow(row);
-  config.modified++;
-}
+  struct columns *c = &config.columns;
+  sort_key *keys = malloc(sizeof(sort_key) * n);
+  uint32_t *starts = NULL;
+  int cap = 0;
+
+  // cold rows are decompressed first, the threads only read row bytes
+  for (int i = 0; i < n; i++) {
+    erow *row = &config.editor_rows[at + i];
+    keys[i].s = row_chars(row);
+    keys[i].len = row->size;
+    keys[i].index = i;
+
+    // the key of a column is its field, without the quotes around it
+    if (column >= 0) {
+      const char *s = keys[i].s;
+      int count =
+          column_scan(s, row->size, c->delim, c->quotes, &starts, &cap);
+      int start = column < count ? (int)starts[column] : row->size;
+      int end = column < count ? (int)starts[column + 1] - 1 : row->size;
+
+      if (c->quotes && end - start >= 2 && s[start] == '"' &&
+          s[end - 1] == '"') {
+        start++;
+        end--;
+      }
 
-void insert_str_at_row(erow *row, int at, char *c, size_t len) {
-  if (at < 0 || at > row->size)
-    return;
+      keys[i].s = &s[start];
+      keys[i].len = end - start;
+    }
 
-  row->chars = realloc(row->chars, row->size + len + 1);
+    keys[i].num =
+        flags & SORT_NUMERIC ? leading_number(keys[i].s, keys[i].len) : 0;
+  }
 
-  memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
-  memcpy(&row->chars[at], c, len);
+  free(starts);
+  parallel_sort_keys(keys, n, flags);
 
-  row->size += len;
-  update_erow(row);
-  config.modified++;
-}
+  // the dropped rows are moved after the kept ones, then deleted
+  uint32_t *perm = malloc(sizeof(uint32_t) * n);
+  int kept = 0, dropped = n, moved = 0;
 
-void remove_char_at_row(erow *row, int at) {
-  if (at < 0 || at >= row->size)
-    return;
+  for (int i = 0; i < n; i++) {
+    if ((flags & SORT_UNIQUE) && kept > 0 &&
+        sort_key_compare(&keys[i - 1], &keys[i], flags) == 0)
+      perm[--dropped] = keys[i].index;
+    else
+      perm[kept++] = keys[i].index;
+  }
 
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--;
-  update_erow(row);
-  config.modified++;
+  for (int i = 0; i < n && !moved; i++) {
+    moved = perm[i] != (uint32_t)i;
+  }
+
+  if (moved)
+    permute_erows(at, n, perm, 0);
+  if (kept < n)
+    delete_erows(at + kept, n - kept);
+
+  free(perm);
+  free(keys);
+  return n - kept;
 }
 
-void update_erow(erow *row) {
-  int tabs = 0;
+int unique_rows(int at, int n) {
+  if (n < 2)
+    return 0;
 
-  for (int i = 0; i < row->size; i++) {
-    if (row->chars[i] == '\t')
-      tabs++;
-  }
+  int cap = 1;
+  while (cap < n * 2)
+    cap *= 2;
 
-  free(row->render);
-  row->render = malloc(row->size + (tabs * (TAB_STOP - 1)) + 1);
+  sort_key *keys = malloc(sizeof(sort_key) * n);
+  uint32_t *slots = malloc(sizeof(uint32_t) * cap);
+  uint32_t *perm = malloc(sizeof(uint32_t) * n);
+  int kept = 0, dropped = n, moved = 0;
 
-  int j = 0;
-  for (int i = 0; i < row->size; i++) {
-    if (row->chars[i] == '\t') {
-      row->render[j++] = ' ';
+  memset(slots, 0xff, sizeof(uint32_t) * cap);
 
-      while (j % TAB_STOP != 0)
-        row->render[j++] = ' ';
+  for (int i = 0; i < n; i++) {
+    erow *row = &config.editor_rows[at + i];
+    keys[i].s = row_chars(row);
+    keys[i].len = row->size;
+
+    uint32_t h = intern_hash(keys[i].s, keys[i].len) & (cap - 1);
+    int duplicate = 0;
+
+    while (slots[h] != UINT32_MAX) {
+      sort_key *k = &keys[slots[h]];
+      if (k->len == keys[i].len && memcmp(k->s, keys[i].s, k->len) == 0) {
+        duplicate = 1;
+        break;
+      }
+      h = (h + 1) & (cap - 1);
+    }
+
+    if (duplicate) {
+      perm[--dropped] = i;
     } else {
-      row->render[j++] = row->chars[i];
+      slots[h] = i;
+      moved |= kept != i;
+      perm[kept++] = i;
     }
   }
 
-  row->render[j] = '\0';
-  row->rsize = j;
-}
+  if (moved)
+    permute_erows(at, n, perm, 0);
+  if (kept < n)
+    delete_erows(at + kept, n - kept);
 
-void ap_buf_append(struct ap_buf *buf, const char *s, size_t len) {
-  char *new = realloc(buf->b, buf->len + len);
+  free(perm);
+  free(slots);
+  free(keys);
+  return n - kept;
+}
 
-  if (new == NULL)
+void reverse_rows(int at, int n) {
+  if (n < 2)
     return;
 
-  memcpy(&new[buf->len], s, len);
-  buf->b = new;
-  buf->len += len;
+  uint32_t *perm = malloc(sizeof(uint32_t) * n);
+
+  for (int i = 0; i < n; i++) {
+    perm[i] = n - 1 - i;
+  }
+
+  permute_erows(at, n, perm, 0);
+  free(perm);
 }
 
-void free_ap_buf(struct ap_buf *buf) { free(buf->b); }
+void shuffle_rows(int at, int n) {
+  if (n < 2)
+    return;
 
-int get_cursor_pos(int *rows, int *cols) {
-  char buf[32];
-  unsigned int i = 0;
+  uint32_t *perm = malloc(sizeof(uint32_t) * n);
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t state = (ts.tv_nsec ^ ((uint64_t)getpid() << 32) ^ ts.tv_sec) | 1;
 
-  // the 'n' command (Device Status Report) will
-  // give the terminal status information
-  // and with the argument '6' it will give the
-  // cursor position and it can be read from the
-  // standard input.
-  if (write(STDIN_FILENO, "\x1b[6n", 4) != 4)
-    return -1;
+  for (int i = 0; i < n; i++) {
+    perm[i] = i;
+  }
 
-  while (i < sizeof(buf) - 1) {
-    if (read(STDIN_FILENO, &buf[i], 1) != 1 || buf[i] == 'R')
-      break;
-    i++;
+  // Fisher-Yates with a xorshift generator
+  for (int i = n - 1; i > 0; i--) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+
+    int j = state % (i + 1);
+    uint32_t swap = perm[i];
+    perm[i] = perm[j];
+    perm[j] = swap;
   }
 
-  buf[i] = '\0';
+  permute_erows(at, n, perm, 0);
+  free(perm);
+}
 
-  if (buf[0] != '\x1b' || buf[1] != '[')
-    return -1;
+int command_range(int argc, char **argv, int *at, int *n) {
+  if (argc == 0) {
+    *at = 0;
+    *n = config.numrows;
+    return 0;
+  }
 
-  if (sscanf(&buf[2], "%d;%d", rows, cols) != 2)
+  for (int i = 0; i < argc && i < 2; i++) {
+    char *end;
+    strtol(argv[i], &end, 10);
+    if (end == argv[i] || *end != '\0') {
+      set_status_msg("Invalid line number: %s", argv[i]);
+      return -1;
+    }
+  }
+
+  int first = atoi(argv[0]);
+  int last = argc >= 2 ? atoi(argv[1]) : config.numrows;
+
+  if (first < 1 || last > config.numrows || first > last) {
+    set_status_msg("Lines %d to %d are out of range.", first, last);
     return -1;
+  }
 
+  *at = first - 1;
+  *n = last - first + 1;
   return 0;
 }
 
-int get_term_size(int *rows, int *cols) {
-  struct winsize w;
+int split_command(char *line, char **argv, int max) {
+  int argc = 0;
+  char *src = line;
+  char *dst = line;
 
-  if (ioctl(STDIN_FILENO, TIOCGWINSZ, &w) != -1 && w.ws_col != 0) {
-    *cols = w.ws_col;
-    *rows = w.ws_row;
-    return 0;
-  } else {
-    if (write(STDIN_FILENO, "\x1b[999C\x1b[999B", 12) != 12)
-      return -1;
-    return get_cursor_pos(rows, cols);
+  // arguments are unescaped in place
+  while (*src != '\0' && argc < max) {
+    while (*src == ' ' || *src == '\t')
+      src++;
+
+    if (*src == '\0')
+      break;
+
+    int quoted = *src == '"';
+    if (quoted)
+      src++;
+
+    argv[argc++] = dst;
+
+    while (*src != '\0') {
+      if (quoted ? *src == '"' : (*src == ' ' || *src == '\t')) {
+        src++;
+        break;
+      }
+
+      if (*src == '\\' && src[1] != '\0') {
+        src++;
+        *dst++ = *src == 'n' ? '\n' : *src == 't' ? '\t' : *src;
+        src++;
+      } else {
+        *dst++ = *src++;
+      }
+    }
+
+    *dst++ = '\0';
   }
+
+  return argc;
 }
 
-void draw_rows(struct ap_buf *buf) {
-  for (int y = 0; y < config.rows; y++) {
-    int filerow = y + config.rowoff;
+int run_command(char *line) {
+  char *argv[COMMAND_MAX_ARGS];
+  int argc = split_command(line, argv, COMMAND_MAX_ARGS);
 
-    if (filerow >= config.numrows) {
-      if (config.numrows == 0 && y == config.rows / 3) {
-        char welcome[80];
-        int welcome_len = snprintf(welcome, sizeof(welcome),
-                                   "Text Editor In C - Version %s", VERSION);
+  if (argc == 0)
+    return 0;
 
-        if (welcome_len > config.cols) {
-          welcome_len = config.cols;
-        }
+  if (config.hex.active) {
+    int result = hex_command(argc, argv);
+    if (result != 1)
+      return result;
+  }
 
-        ap_buf_append(buf, "~", 1);
-        for (int i = 0; i < (config.cols - welcome_len) / 2; i++) {
-          ap_buf_append(buf, " ", 1);
-        }
+  // a percentage of the file size, at the start of the line holding it
+  if (strcmp(argv[0], "goto") == 0 && argc >= 2 && argv[1][0] != '\0' &&
+      argv[1][strlen(argv[1]) - 1] == '%') {
+    double percent = strtod(argv[1], NULL);
+    int col;
 
-        ap_buf_append(buf, welcome, welcome_len);
-      } else {
+    if (percent < 0 || percent > 100) {
+      set_status_msg("%s is out of range.", argv[1]);
+      return -1;
+    }
 
-        ap_buf_append(buf, "~", 1);
-      }
-    } else {
-      int len = config.editor_rows[filerow].rsize - config.coloff;
-      if (len < 0)
-        len = 0;
-      if (len > config.cols)
-        len = config.cols;
+    long long total = row_offset(config.numrows);
+    config.cy = offset_to_row(total * percent / 100, &col);
+    config.cx = 0;
+    return 0;
+  }
 
-      ap_buf_append(buf, &config.editor_rows[filerow].render[config.coloff],
-                    len);
+  if (strcmp(argv[0], "goto") == 0 && argc >= 2) {
+    int cy = atoi(argv[1]) - 1;
+    int cx = argc >= 3 ? atoi(argv[2]) - 1 : 0;
+
+    if (cy < 0 || cy > config.numrows) {
+      set_status_msg("Line %s is out of range.", argv[1]);
+      return -1;
     }
 
-    // clears each line
-    ap_buf_append(buf, "\x1b[K", 3);
+    config.cy = cy;
+    int size = cy < config.numrows ? config.editor_rows[cy].size : 0;
+    config.cx = cx < 0 ? 0 : cx > size ? size : cx;
+    return 0;
+  }
+
+  if (strcmp(argv[0], "goto-byte") == 0 && argc >= 2) {
+    long long offset = strtoll(argv[1], NULL, 10);
+    int col;
 
-    ap_buf_append(buf, "\r\n", 2);
+    if (offset < 0 || offset > row_offset(config.numrows)) {
+      set_status_msg("Byte %s is out of range.", argv[1]);
+      return -1;
+    }
+
+    config.cy = offset_to_row(offset, &col);
+    config.cx = col;
+    return 0;
   }
-}
 
-void update_scroll() {
-  config.rx = 0;
+  if (strcmp(argv[0], "search") == 0 && argc >= 2) {
+    search_pattern(argv[1], strlen(argv[1]));
 
-  if (config.cy < config.numrows) {
-    config.rx = row_cx_to_rx(&config.editor_rows[config.cy], config.cx);
+    // moves to the first match after the cursor
+    for (int i = 0; i < config.search_match_found; i++) {
+      search_match *m = &config.search_matches[i];
+      if (m->cy > config.cy ||
+          (m->cy == config.cy && m->cx - (int)strlen(argv[1]) >= config.cx)) {
+        move_cursor_to_search_match(i);
+        return 0;
+      }
+    }
+
+    set_status_msg("%s not found.", argv[1]);
+    return -1;
   }
 
-  if (config.cy < config.rowoff) {
-    config.rowoff = config.cy;
+  if (strcmp(argv[0], "replace") == 0 && argc >= 3) {
+    int n = replace_all(argv[1], strlen(argv[1]), argv[2], strlen(argv[2]));
+    set_status_msg("%d occurrences replaced.", n);
+    return 0;
   }
 
-  if (config.cy >= config.rowoff + config.rows) {
-    config.rowoff = config.cy - config.rows + 1;
+  if (strcmp(argv[0], "insert") == 0 && argc >= 2) {
+    insert_text(argv[1], strlen(argv[1]));
+    return 0;
   }
 
-  if (config.rx < config.coloff) {
-    config.coloff = config.rx;
+  if (strcmp(argv[0], "delete") == 0) {
+    delete_text(argc >= 2 ? atoi(argv[1]) : 1);
+    return 0;
   }
 
-  if (config.rx >= config.coloff + config.cols) {
-    config.coloff = config.rx - config.cols + 1;
+  if (strcmp(argv[0], "delete-line") == 0) {
+    int n = argc >= 2 ? atoi(argv[1]) : 1;
+
+    for (int i = 0; i < n && config.cy < config.numrows; i++) {
+      delete_erow(config.cy);
+    }
+
+    config.cx = 0;
+    return 0;
   }
-}
 
-void set_status_msg(const char *fmt, ...) {
-  va_list ap;
-  va_start(ap, fmt);
-  vsnprintf(config.status_msg, sizeof(config.status_msg), fmt, ap);
-  va_end(ap);
-  config.status_time = time(NULL);
-}
+  if (strcmp(argv[0], "save") == 0) {
+    char *filename = argc >= 2 ? argv[1] : config.filename;
 
-void draw_status_line(struct ap_buf *buf) {
-  ap_buf_append(buf, "\x1b[7m", 4);
+    if (filename == NULL) {
+      set_status_msg("No file name to save to.");
+      return -1;
+    }
 
-  char status[160], rstatus[80];
+    off_t len = write_file(filename);
 
-  int len = snprintf(status, sizeof(status), "%.20s %s - %d lines",
-                     config.filename ? config.filename : "[No Name]",
-                     config.modified ? "(modified)" : "", config.numrows);
+    if (len == -1) {
+      set_status_msg("Error on save: %s", strerror(errno));
+      return -1;
+    }
 
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d", config.cy + 1,
-                      config.numrows);
+    if (filename == config.filename)
+      config.modified = 0;
 
-  if (len > config.cols)
-    len = config.cols;
+    set_status_msg("%lld bytes saved on %s.", (long long)len, filename);
+    return 0;
+  }
 
-  ap_buf_append(buf, status, len);
+  if (strcmp(argv[0], "mem") == 0) {
+    if (show_mem_usage(argc >= 2 ? argv[1] : NULL) == -1) {
+      set_status_msg("Can't write the memory usage to %s.", argv[1]);
+      return -1;
+    }
 
-  while (len < config.cols) {
-    if (config.cols - len == rlen) {
-      ap_buf_append(buf, rstatus, rlen);
-      break;
-    } else {
-      ap_buf_append(buf, " ", 1);
-      len++;
+    if (argc >= 2)
+      set_status_msg("Memory usage written to %s.", argv[1]);
+    return 0;
+  }
+
+  if (strcmp(argv[0], "trace") == 0 && argc >= 2) {
+    if (trace_dump(argv[1]) == -1) {
+      set_status_msg("Can't write the trace to %s.", argv[1]);
+      return -1;
     }
+
+    set_status_msg("Trace written to %s.", argv[1]);
+    return 0;
   }
 
-  ap_buf_append(buf, "\x1b[m", 3);
-  ap_buf_append(buf, "\r\n", 2);
-}
+  if (strcmp(argv[0], "follow") == 0) {
+    int on = argc >= 2 ? strcmp(argv[1], "off") != 0 : !config.follow.active;
 
-void draw_status_msg_line(struct ap_buf *buf) {
-  ap_buf_append(buf, "\x1b[K", 3);
-  int msg_len = strlen(config.status_msg);
+    if (!on) {
+      follow_stop();
+      return 0;
+    }
 
-  if (msg_len > config.cols)
-    msg_len = config.cols;
+    if (follow_start() == -1)
+      return -1;
 
-  if (msg_len && time(NULL) - config.status_time < 7) {
-    ap_buf_append(buf, config.status_msg, msg_len);
+    set_status_msg("Following %s.", config.filename);
+    return 0;
   }
-}
 
-void refresh_screen() {
-  struct ap_buf buf = AP_BUF_INIT;
+  if (strcmp(argv[0], "grep") == 0) {
+    if (argc < 2 || argv[1][0] == '\0') {
+      filter_stop();
+      return 0;
+    }
 
-  update_scroll();
+    filter_start(argv[1], strlen(argv[1]));
+    return 0;
+  }
 
-  // hides the cursor
-  ap_buf_append(&buf, "\x1b[?25l", 6);
+  // the results replace the current file, a script gets all of them
+  if (strcmp(argv[0], "grep-dir") == 0 && argc >= 2 && argv[1][0] != '\0') {
+    if (project_grep_start(argv[1], strlen(argv[1]),
+                           argc >= 3 ? argv[2] : ".") == -1)
+      return -1;
 
-  // moves cursor to the top
-  ap_buf_append(&buf, "\x1b[H", 3);
+    if (config.headless) {
+      project_grep_join();
+      project_grep_poll();
+    }
+    return 0;
+  }
 
-  draw_rows(&buf);
-  draw_status_line(&buf);
-  draw_status_msg_line(&buf);
+  if (strcmp(argv[0], "hex") == 0) {
+    int on = argc >= 2 ? strcmp(argv[1], "off") != 0 : !config.hex.active;
+    return hex_reopen(on);
+  }
 
-  // moves cursor to the defined position in the config struct
-  char temp_buf[32];
-  snprintf(temp_buf, sizeof(temp_buf), "\x1b[%d;%dH",
-           config.cy - config.rowoff + 1, config.rx - config.coloff + 1);
-  ap_buf_append(&buf, temp_buf, strlen(temp_buf));
+  if (strcmp(argv[0], "columns") == 0) {
+    int on = argc >= 2 ? strcmp(argv[1], "off") != 0 : !config.columns.active;
 
-  // shows the cursor
-  ap_buf_append(&buf, "\x1b[?25h", 6);
+    if (!on) {
+      column_stop();
+      return 0;
+    }
+
+    // the delimiter is one character, or tab
+    char delim = 0;
+    if (argc >= 3)
+      delim = strcmp(argv[2], "tab") == 0 ? '\t' : argv[2][0];
+
+    column_start(delim);
+    set_status_msg("%d columns.", config.columns.count);
+    return 0;
+  }
+
+  if (strcmp(argv[0], "column") == 0 && argc >= 2) {
+    if (!config.columns.active) {
+      set_status_msg("The column mode is off.");
+      return -1;
+    }
+
+    if (column_goto(atoi(argv[1]) - 1) == -1) {
+      set_status_msg("Column %s is out of the line.", argv[1]);
+      return -1;
+    }
+    return 0;
+  }
+
+  if (strcmp(argv[0], "fold") == 0 || strcmp(argv[0], "unfold") == 0) {
+    int row = argc >= 2 ? atoi(argv[1]) - 1 : config.cy;
+
+    if (fold_check() == -1)
+      return -1;
 
-  write(STDIN_FILENO, buf.b, buf.len);
-  free_ap_buf(&buf);
-}
+    if (row < 0 || row >= config.numrows) {
+      set_status_msg("Line %s is out of range.", argv[1]);
+      return -1;
+    }
 
-void disable_raw_mode() {
-  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &config.orig_termios) == -1)
-    die("tcsetattr");
-}
+    if (argv[0][0] == 'f')
+      return fold_hidden(row) > 0 ? 0 : fold_toggle(row);
 
-void enable_raw_mode() {
-  if (tcgetattr(STDIN_FILENO, &config.orig_termios) == -1)
-    die("tcgetattr");
+    // the fold of the line, or the one hiding it
+    if (fold_hidden(row) > 0)
+      return fold_toggle(row);
+    fold_reveal(row);
+    return 0;
+  }
 
-  atexit(disable_raw_mode);
+  if (strcmp(argv[0], "fold-all") == 0) {
+    if (fold_check() == -1)
+      return -1;
 
-  struct termios raw = config.orig_termios;
+    fold_all(0, config.numrows, argc >= 2 ? atoi(argv[1]) : 1);
+    set_status_msg("%d folds.", config.folds.count);
+    return 0;
+  }
 
-  raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
-  raw.c_oflag &= ~(OPOST);
-  raw.c_cflag |= (CS8);
-  raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
-  raw.c_cc[VMIN] = 0;
-  raw.c_cc[VTIME] = 1;
+  if (strcmp(argv[0], "unfold-all") == 0) {
+    fold_clear();
+    return 0;
+  }
 
-  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
-    die("tcsetattr");
-}
+  if (strcmp(argv[0], "sort") == 0) {
+    int flags = 0, first = 1, column = -1, at, n;
+
+    // flags may be combined in one argument or given separately
+    for (; first < argc && argv[first][0] == '-'; first++) {
+      for (char *f = &argv[first][1]; *f != '\0'; f++) {
+        if (*f == 'n')
+          flags |= SORT_NUMERIC;
+        else if (*f == 'i')
+          flags |= SORT_NOCASE;
+        else if (*f == 'u')
+          flags |= SORT_UNIQUE;
+        else if (*f == 'r')
+          flags |= SORT_REVERSE;
+        else if (*f == 'k' && atoi(&f[1]) > 0) {
+          column = atoi(&f[1]) - 1;
+          while (isdigit((unsigned char)f[1]))
+            f++;
+        } else {
+          set_status_msg("Invalid sort flag: %c", *f);
+          return -1;
+        }
+      }
+    }
 
-char *erows_to_str(int *buflen) {
-  char *buffer = NULL;
+    if (column >= 0 && !config.columns.active) {
+      set_status_msg("Sorting by a column needs the column mode.");
+      return -1;
+    }
 
-  int total_len = 0;
+    if (command_range(argc - first, &argv[first], &at, &n) == -1)
+      return -1;
 
-  for (int i = 0; i < config.numrows; i++) {
-    erow row = config.editor_rows[i];
-    total_len += row.size + 1;
+    int dropped = sort_rows(at, n, flags, column);
+    config.cx = 0;
+    if (config.cy > config.numrows)
+      config.cy = config.numrows;
+    if (flags & SORT_UNIQUE)
+      set_status_msg("%d lines sorted, %d duplicates removed.", n, dropped);
+    else
+      set_status_msg("%d lines sorted.", n);
+    return 0;
   }
 
-  *buflen = total_len;
-  buffer = malloc(total_len);
-  char *p = buffer;
+  if (strcmp(argv[0], "unique") == 0 || strcmp(argv[0], "reverse") == 0 ||
+      strcmp(argv[0], "shuffle") == 0) {
+    int at, n;
 
-  for (int i = 0; i < config.numrows; i++) {
-    erow row = config.editor_rows[i];
-    memcpy(p, row.chars, row.size);
-    p += row.size;
-    *p = '\n';
-    p++;
+    if (command_range(argc - 1, &argv[1], &at, &n) == -1)
+      return -1;
+
+    if (argv[0][0] == 'u') {
+      set_status_msg("%d duplicates removed.", unique_rows(at, n));
+    } else if (argv[0][0] == 'r') {
+      reverse_rows(at, n);
+      set_status_msg("%d lines reversed.", n);
+    } else {
+      shuffle_rows(at, n);
+      set_status_msg("%d lines shuffled.", n);
+    }
+
+    config.cx = 0;
+    if (config.cy > config.numrows)
+      config.cy = config.numrows;
+    return 0;
   }
 
-  return buffer;
-}
+  if (strcmp(argv[0], "set") == 0 && argc >= 3) {
+    if (strcmp(argv[1], "tab-stop") == 0) {
+      set_tab_stop(atoi(argv[2]));
+      return 0;
+    }
 
-void insert_char(int c) {
-  if (config.cy == config.numrows) {
-    insert_erow(config.numrows, "", 0);
+    if (strcmp(argv[1], "undo-limit") == 0) {
+      config.undo.limit = strtoull(argv[2], NULL, 10);
+      undo_trim();
+      return 0;
+    }
+
+    // only files opened after it are interned
+    if (strcmp(argv[1], "intern") == 0) {
+      config.intern = strcmp(argv[2], "on") == 0;
+      return 0;
+    }
+
+    // in megabytes, 0 stops compressing rows
+    if (strcmp(argv[1], "cold-budget") == 0) {
+      config.cold.budget = strtoull(argv[2], NULL, 10) << 20;
+      config.cold.limit = config.cold.budget;
+      return 0;
+    }
   }
 
-  insert_char_at_row(&config.editor_rows[config.cy], config.cx, c);
-  config.cx++;
+  set_status_msg("Invalid command: %s", argv[0]);
+  return -1;
 }
 
-void insert_new_line() {
-  if (config.cx == 0) {
-    insert_erow(config.cy, "", 0);
+void editor_command() {
+  char *line = editor_prompt("Command: %s", "");
 
-  } else {
-    erow *row = &config.editor_rows[config.cy];
-    insert_erow(config.cy + 1, &row->chars[config.cx], row->size - config.cx);
-    row = &config.editor_rows[config.cy];
-    row->size = config.cx;
-    row->chars[row->size] = '\0';
-    update_erow(row);
-  }
+  if (line == NULL)
+    return;
 
-  config.cy++;
-  config.cx = 0;
+  run_command(line);
+  free(line);
 }
 
-void delete_char() {
+void insert_text(char *s, size_t len) {
   if (config.cy == config.numrows)
-    return;
+    insert_erow(config.numrows, "", 0);
 
   erow *row = &config.editor_rows[config.cy];
+  char *nl = memchr(s, '\n', len);
 
-  if (config.cy == 0 && config.cx == 0) {
-    if (row->size == 0)
-      delete_erow(config.cy);
-
+  if (nl == NULL) {
+    insert_str_at_row(row, config.cx, s, len);
+    config.cx += len;
     return;
   }
 
-  if (config.cx > 0) {
-    remove_char_at_row(row, config.cx - 1);
-    config.cx--;
-  } else {
-    erow *prev_row = &config.editor_rows[config.cy - 1];
-    config.cx = prev_row->size;
-    insert_str_at_row(prev_row, prev_row->size, row->chars, row->size);
-    delete_erow(config.cy);
-    config.cy--;
+  int lines = 0;
+  for (char *p = nl; p != NULL; p = memchr(p + 1, '\n', s + len - p - 1)) {
+    lines++;
+  }
+
+  // the rest of the row moves once to the end of the last inserted line,
+  // and the new rows go in with a single move of the rows below
+  size_t tail_len = row->size - config.cx;
+  char *tail = malloc(tail_len + 1);
+  memcpy(tail, &row_chars(row)[config.cx], tail_len);
+
+  erow *rows = malloc(sizeof(erow) * lines);
+  char *start = nl + 1;
+  size_t last_len = 0;
+
+  for (int i = 0; i < lines; i++) {
+    char *end = memchr(start, '\n', s + len - start);
+    size_t n = end ? (size_t)(end - start) : (size_t)(s + len - start);
+
+    if (i == lines - 1) {
+      init_erow(&rows[i], start, n, 0);
+      memcpy(&row_resize(&rows[i], n + tail_len)[n], tail, tail_len);
+      row_scan_inserted(&rows[i], tail, tail_len);
+      last_len = n;
+    } else {
+      init_erow(&rows[i], start, n, 0);
+      start = end + 1;
+    }
   }
+
+  remove_str_at_row(row, config.cx, tail_len);
+  insert_str_at_row(row, config.cx, s, nl - s);
+  insert_erows(config.cy + 1, lines, rows);
+
+  config.cy += lines;
+  config.cx = last_len;
+  free(rows);
+  free(tail);
 }
 
-char *editor_prompt(char *prompt, char *default_value) {
-  size_t bufsize = 128;
-  size_t buflen = strlen(default_value);
+void delete_text(int count) {
+  while (count > 0 && config.cy < config.numrows) {
+    erow *row = &config.editor_rows[config.cy];
 
-  while (buflen > bufsize) {
-    if (bufsize > 256)
+    if (config.cx < row->size) {
+      int n = row->size - config.cx < count ? row->size - config.cx : count;
+      remove_str_at_row(row, config.cx, n);
+      count -= n;
+    } else if (config.cy + 1 < config.numrows) {
+      erow *next = &config.editor_rows[config.cy + 1];
+      insert_str_at_row(row, row->size, row_chars(next), next->size);
+      delete_erow(config.cy + 1);
+      count--;
+    } else {
       break;
-    bufsize *= 2;
+    }
   }
+}
 
-  char *buf = malloc(bufsize);
-
-  for (int i = 0; i < buflen; i++) {
-    buf[i] = default_value[i];
-  }
+int replace_all(char *pattern, size_t plen, char *with, size_t wlen) {
+  int total = 0;
 
-  buf[buflen] = '\0';
+  if (plen == 0)
+    return 0;
 
-  while (1) {
-    set_status_msg(prompt, buf);
-    refresh_screen();
+  for (int i = 0; i < config.numrows; i++) {
+    erow *row = &config.editor_rows[i];
 
-    int c = read_input_key();
+    // most rows have no match, which memmem rejects without allocating
+    if (memmem(row_peek(row), row->size, pattern, plen) == NULL)
+      continue;
 
-    if (c == DEL_KEY || c == BACKSPACE) {
-      if (buflen != 0)
-        buf[--buflen] = '\0';
-    } else if (c == '\x1b') {
-      set_status_msg("");
-      free(buf);
-      return NULL;
-    } else if (c == '\r') {
-      if (buflen != 0) {
-        set_status_msg("");
-        return buf;
-      }
-    } else if (!iscntrl(c) && c < 128) {
-      if (buflen == bufsize - 1) {
-        bufsize *= 2;
-        buf = realloc(buf, bufsize);
-      }
+    int m_len;
+    int *matches =
+        kmp_matching(row_chars(row), pattern, row->size, plen, &m_len);
 
-      buf[buflen++] = c;
-      buf[buflen] = '\0';
+    // from the last match backwards, so the earlier indexes stay valid
+    for (int j = m_len - 1; j >= 0; j--) {
+      remove_str_at_row(row, matches[j], plen);
+      insert_str_at_row(row, matches[j], with, wlen);
     }
+
+    total += m_len;
+    free(matches);
   }
-}
 
-void editor_open(char *filename) {
-  free(config.filename);
-  config.filename = strdup(filename);
+  return total;
+}
 
-  FILE *f = fopen(filename, "r");
+int run_script(char *script, int nfiles, char **files) {
+  FILE *f = strcmp(script, "-") == 0 ? stdin : fopen(script, "r");
 
-  if (!f)
-    die("fopen");
+  if (!f) {
+    fprintf(stderr, "%s: %s\n", script, strerror(errno));
+    return nfiles > 0 ? nfiles : 1;
+  }
 
+  char **lines = NULL;
+  int nlines = 0;
   char *line = NULL;
   size_t linecap = 0;
-  size_t linelen;
+  ssize_t linelen;
 
   while ((linelen = getline(&line, &linecap, f)) != -1) {
     while (linelen > 0 &&
-           (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) {
-      linelen--;
-    }
+           (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+      line[--linelen] = '\0';
 
-    append_erow(line, linelen);
+    if (linelen == 0 || line[0] == '#')
+      continue;
+
+    lines = realloc(lines, sizeof(char *) * (nlines + 1));
+    lines[nlines++] = strdup(line);
   }
 
-  config.modified = 0;
   free(line);
-  fclose(f);
-}
+  if (f != stdin)
+    fclose(f);
+
+  int failed = 0;
+  char *cmd = NULL;
+  size_t cmdcap = 0;
+  mem_report peak;
+  size_t peak_bytes = 0;
+  char *peak_file = NULL;
+
+  for (int i = 0; i < nfiles; i++) {
+    if (editor_open(files[i]) == -1) {
+      fprintf(stderr, "%s: %s\n", files[i], strerror(errno));
+      failed++;
+      continue;
+    }
 
-void editor_save() {
-  char *temp_filename = NULL;
+    for (int j = 0; j < nlines; j++) {
+      // the command is split in place, so every file gets a fresh copy
+      size_t len = strlen(lines[j]) + 1;
+      if (len > cmdcap) {
+        cmdcap = len;
+        cmd = realloc(cmd, cmdcap);
+      }
+      memcpy(cmd, lines[j], len);
 
-  if (config.filename == NULL) {
-    temp_filename = editor_prompt("Save as: %s (Esc to cancel)", "");
-  } else {
-    temp_filename =
-        editor_prompt("Save as: %s (Esc to cancel)", config.filename);
-  }
+      if (run_command(cmd) == -1) {
+        fprintf(stderr, "%s: %s\n", files[i], config.status_msg);
+        failed++;
+        break;
+      }
+    }
 
-  if (temp_filename == NULL) {
-    set_status_msg("Save operation cancelled.");
-    return;
-  }
+    // keeps the breakdown of the file which needed the most memory
+    if (config.mem_stats) {
+      mem_report report;
+      size_t bytes = 0;
+      collect_mem_usage(&report);
 
-  int len;
-  char *buf = erows_to_str(&len);
+      for (int m = 0; m < MEM_COUNT; m++) {
+        bytes += report.usage[m].bytes;
+      }
 
-  int fd = open(temp_filename, O_RDWR | O_CREAT, 0644);
+      if (peak_file == NULL || bytes > peak_bytes) {
+        peak = report;
+        peak_bytes = bytes;
+        peak_file = files[i];
+      }
+    }
 
-  if (fd != -1) {
-    if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        free(buf);
-        config.filename = temp_filename;
+    editor_close();
+  }
 
-        set_status_msg("%d bytes saved on %s.", len, config.filename);
+  if (peak_file != NULL) {
+    fprintf(stderr, "memory usage of %s:\n", peak_file);
+    print_mem_usage(stderr, &peak);
+  }
 
-        config.modified = 0;
-        return;
-      }
-    }
-    close(fd);
+  for (int j = 0; j < nlines; j++) {
+    free(lines[j]);
   }
 
-  free(buf);
-  free(temp_filename);
-  set_status_msg("Error on save: %s", strerror(errno));
+  free(lines);
+  free(cmd);
+  return failed;
 }
 
 void update_cursor_pos(int key) {
+  // in soft-wrap mode up and down move between wrapped lines
+  if (config.wrap && (key == ARROW_UP || key == ARROW_DOWN)) {
+    wrap_move_cursor(key == ARROW_UP ? -1 : 1);
+    return;
+  }
+
+  // and in the grep view between the rows it shows
+  if (config.filter.active && (key == ARROW_UP || key == ARROW_DOWN)) {
+    filter_move_cursor(key == ARROW_UP ? -1 : 1);
+    return;
+  }
+
+  // and over the folded rows
+  if (config.folds.count > 0 && (key == ARROW_UP || key == ARROW_DOWN)) {
+    fold_move_cursor(key == ARROW_UP ? -1 : 1);
+    return;
+  }
+
   erow *current_row =
       config.cy >= config.numrows ? NULL : &config.editor_rows[config.cy];
 
+  // vertical moves keep the display column instead of the byte index
+  int rx = current_row ? row_cx_to_rx(current_row, config.cx) : 0;
+
   switch (key) {
   case ARROW_RIGHT: {
     if (current_row && config.cx < current_row->size) {
-      config.cx++;
+      config.cx = row_next_cx(current_row, config.cx);
     } else if (current_row && config.cx == current_row->size) {
-      config.cy++;
+      if (config.filter.active)
+        filter_move_cursor(1);
+      else if (config.folds.count > 0)
+        fold_move_cursor(1);
+      else
+        config.cy++;
       config.cx = 0;
     }
     break;
   }
   case ARROW_LEFT: {
     if (config.cx > 0) {
-      config.cx--;
+      config.cx = row_prev_cx(current_row, config.cx);
+    } else if (config.filter.active) {
+      if (filter_line(config.cy) > 0) {
+        filter_move_cursor(-1);
+        config.cx = config.editor_rows[config.cy].size;
+      }
+    } else if (config.folds.count > 0) {
+      if (fold_line(config.cy) > 0) {
+        fold_move_cursor(-1);
+        config.cx = config.editor_rows[config.cy].size;
+      }
     } else if (config.cy > 0) {
       config.cy--;
       config.cx = config.editor_rows[config.cy].size;
@@ -1154,12 +10853,16 @@ void update_cursor_pos(int key) {
   case ARROW_UP: {
     if (config.cy > 0) {
       config.cy--;
+      config.cx = row_rx_to_cx(&config.editor_rows[config.cy], rx);
     }
     break;
   }
   case ARROW_DOWN: {
     if (config.cy < config.numrows) {
       config.cy++;
+
+      if (config.cy < config.numrows)
+        config.cx = row_rx_to_cx(&config.editor_rows[config.cy], rx);
     }
     break;
   }
@@ -1176,13 +10879,29 @@ void update_cursor_pos(int key) {
 
 int read_input_key() {
   int nread;
-  char c;
+  unsigned char c;
 
   while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN)
+    if (nread == -1 && errno != EAGAIN && errno != EINTR)
       die("read");
+
+    journal_signaled();
+    journal_idle();
+
+    // the new lines of a followed file show up without a key press
+    // so do the rows of the grep view, which are searched meanwhile,
+    // and the results of a project grep
+    int redraw = follow_poll();
+    redraw |= filter_idle();
+    redraw |= project_grep_poll();
+
+    if (redraw)
+      refresh_screen();
   }
 
+  // the input probe covers the key from its first byte
+  config.trace.input_start = trace_now();
+
   if (c == '\x1b') {
     char esc[3];
 
@@ -1229,6 +10948,8 @@ int read_input_key() {
           return HOME_KEY;
         case 'F':
           return END_KEY;
+        case 'Z':
+          return BACK_TAB;
         }
       }
     } else if (esc[0] == 'O') {
@@ -1249,6 +10970,15 @@ int read_input_key() {
 void process_key_press() {
   static int quit_count = FORCE_QUIT_TIMES;
   int key = read_input_key();
+  trace_event_end(PROBE_INPUT, config.trace.input_start);
+
+  undo_begin_action();
+
+  // the hex view moves by bytes and can't be edited
+  if (config.hex.active && hex_key_press(key)) {
+    trace_event_end(PROBE_KEY, config.trace.input_start);
+    return;
+  }
 
   switch (key) {
 
@@ -1272,6 +11002,49 @@ void process_key_press() {
     break;
   }
 
+  case CTRL_KEY('g'): {
+    config.trace.overlay = !config.trace.overlay;
+    break;
+  }
+
+  case CTRL_KEY('e'): {
+    editor_command();
+    break;
+  }
+
+  case CTRL_KEY('z'): {
+    if (!editor_undo())
+      set_status_msg("Nothing to undo.");
+    break;
+  }
+
+  case CTRL_KEY('y'): {
+    if (!editor_redo())
+      set_status_msg("Nothing to redo.");
+    break;
+  }
+
+  case CTRL_KEY('o'): {
+    toggle_wrap();
+    break;
+  }
+
+  case CTRL_KEY('k'): {
+    if (fold_check() == 0)
+      fold_toggle(config.cy);
+    break;
+  }
+
+  case CTRL_KEY('t'): {
+    char *width = editor_prompt("Tab width: %s (Esc to cancel)", "");
+
+    if (width != NULL) {
+      set_tab_stop(atoi(width));
+      free(width);
+    }
+    break;
+  }
+
   case CTRL_KEY('q'): {
     if (config.modified > 0 && quit_count > 0) {
       set_status_msg("The file has unsaved changes, if you want to force quit "
@@ -1285,6 +11058,7 @@ void process_key_press() {
       free(config.search_matches);
     }
 
+    journal_close(1);
     clear_screen();
     move_cursor(0, 0);
     exit(0);
@@ -1308,21 +11082,65 @@ void process_key_press() {
     break;
   }
 
+  // Tab moves between the fields in column mode
+  case '\t':
+    if (config.columns.active)
+      column_move(1);
+    else
+      insert_char(key);
+    break;
+  case BACK_TAB:
+    if (config.columns.active)
+      column_move(-1);
+    break;
+
   case '\r': {
-    insert_new_line();
+    // Enter opens a result of the project grep
+    if (config.project.active)
+      project_grep_open();
+    else
+      insert_new_line();
     break;
   }
 
   case CTRL_KEY('l'):
+    config.screen_dirty = 1;
+    break;
+
   case '\x1b':
     break;
 
   case PAGE_UP:
   case PAGE_DOWN: {
-    int i = config.rows;
-    while (i--) {
-      update_cursor_pos(key == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+    if (config.wrap) {
+      wrap_move_cursor(key == PAGE_UP ? -config.rows : config.rows);
+      break;
     }
+
+    if (config.filter.active) {
+      filter_move_cursor(key == PAGE_UP ? -config.rows : config.rows);
+      break;
+    }
+
+    if (config.folds.count > 0) {
+      fold_move_cursor(key == PAGE_UP ? -config.rows : config.rows);
+      break;
+    }
+
+    // jumps a screen of rows at once, keeping the display column
+    int rx = config.cy < config.numrows
+                 ? row_cx_to_rx(&config.editor_rows[config.cy], config.cx)
+                 : 0;
+
+    config.cy += key == PAGE_UP ? -config.rows : config.rows;
+    if (config.cy < 0)
+      config.cy = 0;
+    if (config.cy > config.numrows)
+      config.cy = config.numrows;
+
+    config.cx = config.cy < config.numrows
+                    ? row_rx_to_cx(&config.editor_rows[config.cy], rx)
+                    : 0;
     break;
   }
 
@@ -1335,17 +11153,30 @@ void process_key_press() {
   }
 
   default: {
+    if (key >= 0xc0 && key < 0x100) {
+      insert_utf8_char(key);
+      break;
+    }
+
     insert_char(key);
     break;
   }
   }
 
   quit_count = FORCE_QUIT_TIMES;
+  trace_event_end(PROBE_KEY, config.trace.input_start);
 }
 
 void die(const char *s) {
+  // the error of the caller, before clearing the screen changes it
+  int err = errno;
+
+  // the journal is kept so the edits can be recovered
+  if (config.journal.path != NULL)
+    journal_flush(1);
   clear_screen();
   move_cursor(0, 0);
+  errno = err;
   perror(s);
   exit(1);
 }
@@ -1355,6 +11186,7 @@ void init() {
   config.rx = 0;
   config.cy = 0;
   config.numrows = 0;
+  config.rowcap = 0;
   config.editor_rows = NULL;
   config.rowoff = 0;
   config.coloff = 0;
@@ -1362,9 +11194,71 @@ void init() {
   config.status_msg[0] = '\0';
   config.status_time = 0;
   config.modified = 0;
+  config.tab_stop = DEFAULT_TAB_STOP;
   config.search_matches = NULL;
   config.search_match_found = -1;
   config.current_search_idx = -1;
+  config.syntax = NULL;
+  config.hl_frontier = 0;
+  config.prev_rowoff = 0;
+  config.prev_coloff = 0;
+  config.screen_dirty = 1;
+  config.wrap = 0;
+  config.wrap_dirty = 1;
+  config.offsets_dirty = 1;
+  config.wrap_index.tree = NULL;
+  config.wrap_index.size = 0;
+  config.wrap_index.cap = 0;
+  memset(&config.renders, 0, sizeof(config.renders));
+  memset(&config.scratch, 0, sizeof(config.scratch));
+  arena_reset();
+  memset(&config.undo, 0, sizeof(config.undo));
+  config.undo.limit = UNDO_LIMIT;
+  config.undo.sealed = 1;
+  config.undo.paused = config.headless;
+
+  char *undo_limit = getenv("TEXT_EDITOR_UNDO_LIMIT");
+  if (undo_limit != NULL)
+    config.undo.limit = strtoull(undo_limit, NULL, 10);
+
+  char *intern = getenv("TEXT_EDITOR_INTERN");
+  config.intern = intern != NULL && strcmp(intern, "0") != 0;
+  memset(&config.interned, 0, sizeof(config.interned));
+
+  char *cold_budget = getenv("TEXT_EDITOR_COLD_BUDGET");
+  memset(&config.cold, 0, sizeof(config.cold));
+  config.cold.budget = cold_budget != NULL
+                           ? strtoull(cold_budget, NULL, 10) << 20
+                           : COLD_BUDGET;
+  cold_reset();
+
+  config.journal.fd = -1;
+  config.journal.path = NULL;
+  config.journal.cap = 0;
+  config.journal.buf = NULL;
+  config.journal.len = 0;
+  config.journal.last_sync = 0;
+  config.journal.unsynced = 0;
+  config.journal.paused = 0;
+
+  memset(&config.follow, 0, sizeof(config.follow));
+  config.follow.fd = -1;
+  config.follow.file_wd = -1;
+  config.follow.dir_wd = -1;
+
+  memset(&config.project, 0, sizeof(config.project));
+  memset(&config.hex, 0, sizeof(config.hex));
+  memset(&config.trace, 0, sizeof(config.trace));
+
+  // headless mode has no terminal, no journal and no trace
+  if (config.headless)
+    return;
+
+  config.trace.events = malloc(sizeof(trace_event) * TRACE_EVENTS);
+  config.trace.frames = malloc(sizeof(trace_frame) * TRACE_FRAMES);
+
+  signal(SIGHUP, handle_signal);
+  signal(SIGTERM, handle_signal);
 
   if (get_term_size(&config.rows, &config.cols) == -1)
     die("get_term_size");